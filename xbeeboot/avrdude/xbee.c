@@ -32,6 +32,11 @@
 
 #include <sys/time.h> /* gettimeofday() */
 
+#ifndef WIN32NATIVE
+#include <sys/select.h> /* select() */
+#include <errno.h>
+#endif
+
 #include <stdio.h> /* sscanf() */
 #include <stdlib.h> /* malloc() */
 #include <string.h> /* memmove() etc. */
@@ -67,13 +72,29 @@
 /*
  * After eight seconds the AVR bootloader watchdog will kick in.  But
  * to allow for the possibility of eight seconds upstream and another
- * eight seconds downstream, allow for 16 retries (of roughly one
- * second each).
+ * eight seconds downstream, a session only gives up after 16 seconds
+ * without progress.  Elapsed time decides rather than the number of
+ * retries: the adaptive timeout starts from XBEE_MIN_TIMEOUT_MS, and
+ * is measured from ACKs alone, so a reply held up by a flash erase
+ * and write sees many early retries.  At least XBEE_MAX_RETRIES are
+ * made in any case, which also bounds each fleet mode query.
  */
+#ifndef XBEE_GIVE_UP_MS
+#define XBEE_GIVE_UP_MS 16000
+#endif
+
 #ifndef XBEE_MAX_RETRIES
 #define XBEE_MAX_RETRIES 16
 #endif
 
+/*
+ * Once a session has retried this many times in a row, and as often
+ * again after that, check that the local XBee is still there.
+ */
+#ifndef XBEE_PING_RETRIES
+#define XBEE_PING_RETRIES 4
+#endif
+
 /*
  * Maximum chunk size, which is the maximum encapsulated payload to be
  * delivered to the remote CPU.
@@ -105,6 +126,21 @@
 #define XBEEBOOT_MAX_CHUNK 54
 #endif
 
+/*
+ * Larger chunks are tried XBEE_PROBE_STEP bytes at a time, once we
+ * know that both the local XBee and XBeeBoot allow them.  APS
+ * encryption costs XBEE_APS_OVERHEAD bytes of the maximum payload
+ * that NP reports.
+ */
+#define XBEE_PROBE_STEP 8
+#define XBEE_APS_OVERHEAD 9
+
+/*
+ * sendAPIRequest() builds frames in 256 bytes, which must allow for
+ * every byte being escaped.
+ */
+#define XBEE_LARGEST_CHUNK 100
+
 /*
  * Maximum source route intermediate hops.  This is described in the
  * documentation variously as 40 hops (routing table); OR 25 hops
@@ -117,10 +153,240 @@
 #define XBEE_MAX_INTERMEDIATE_HOPS 40
 #endif
 
-/* Protocol */
+/*
+ * Bounds on the retransmission timeout, in milliseconds.  Until we
+ * have measured the round trip time to XBeeBoot, and for XBee AT
+ * commands, the maximum is used.
+ */
+#ifndef XBEE_MIN_TIMEOUT_MS
+#define XBEE_MIN_TIMEOUT_MS 20
+#endif
+
+#ifndef XBEE_MAX_TIMEOUT_MS
+#define XBEE_MAX_TIMEOUT_MS 1000
+#endif
+
+/*
+ * How long, in milliseconds, to wait for the response to an AT
+ * command before sending it again, and how many times to send it in
+ * all.  Remote commands cross the mesh, subject to the remote XBee's
+ * own retries and any route discovery, so are given longer.
+ */
+#ifndef XBEE_LOCAL_AT_TIMEOUT_MS
+#define XBEE_LOCAL_AT_TIMEOUT_MS 1000
+#endif
+
+#ifndef XBEE_LOCAL_AT_TRIES
+#define XBEE_LOCAL_AT_TRIES 5
+#endif
+
+#ifndef XBEE_REMOTE_AT_TIMEOUT_MS
+#define XBEE_REMOTE_AT_TIMEOUT_MS 5000
+#endif
+
+#ifndef XBEE_REMOTE_AT_TRIES
+#define XBEE_REMOTE_AT_TRIES 6
+#endif
+
+/*
+ * How long, in milliseconds, the ACK for a reply may be held back
+ * waiting for a FIRMWARE_DELIVER to carry it, when piggybacking.
+ */
+#ifndef XBEE_ACK_DELAY_MS
+#define XBEE_ACK_DELAY_MS 20
+#endif
+
+/*
+ * Maximum number of FIRMWARE_DELIVER packets that may be outstanding
+ * (sent but not yet ACK'd) at once.  The effective window is further
+ * limited by the receive queue size advertised by the bootloader.
+ * No more than fits in XBEE_FLAG_WINDOW_MASK.
+ */
+#ifndef XBEE_MAX_WINDOW
+#define XBEE_MAX_WINDOW 15
+#endif
+
+/*
+ * Protocol.  xbee.c is built as part of avrdude, away from the
+ * bootloader, so these repeat bootloaders/xbeeboot/xbeeboot.h, and
+ * any change must be made in both.
+ */
 #define XBEEBOOT_PACKET_TYPE_ACK 0
 #define XBEEBOOT_PACKET_TYPE_REQUEST 1
 
+/*
+ * A FIRMWARE_REPLY that also ACKs our data, sent by bootloaders with
+ * XBEEBOOT_CAP_PIGGYBACK once we have read XBEEBOOT_PARM_PIGGYBACK:
+ *
+ *   [REPLY_ACK] [SEQUENCE] [FIRMWARE_REPLY] [DATA...] [ACK SEQUENCE]
+ */
+#define XBEEBOOT_PACKET_TYPE_REPLY_ACK 5
+
+/*
+ * Our FIRMWARE_DELIVER in the same form, ACKing the latest reply:
+ *
+ *   [DELIVER_ACK] [SEQUENCE] [FIRMWARE_DELIVER] [DATA...] [ACK SEQUENCE]
+ */
+#define XBEEBOOT_PACKET_TYPE_DELIVER_ACK 6
+
+/*
+ * Fleet mode packets, none of which are ACK'd:
+ *
+ *   [FLEET_CHUNK] [CHUNK LSB] [CHUNK MSB] [DATA * XBEEBOOT_FLEET_CHUNK]
+ *   [FLEET_QUERY] [START LSB] [START MSB] [END LSB] [END MSB]
+ *   [FLEET_NACK] [FIRST LSB] [FIRST MSB] [BITMAP * XBEEBOOT_FLEET_NACK]
+ *
+ * Chunk N holds flash from N * XBEEBOOT_FLEET_CHUNK.  FLEET_NACK
+ * answers FLEET_QUERY with the first chunk from START not received
+ * (END if none), and a bit for each chunk from there, set if missing.
+ */
+#define XBEEBOOT_PACKET_TYPE_FLEET_CHUNK 2
+#define XBEEBOOT_PACKET_TYPE_FLEET_QUERY 3
+#define XBEEBOOT_PACKET_TYPE_FLEET_NACK 4
+#define XBEEBOOT_FLEET_CHUNK 32
+#define XBEEBOOT_FLEET_NACK 32
+
+/*
+ * Default pause between fleet mode chunks, in milliseconds.  ZigBee
+ * broadcasts are relayed by every router, so the mesh can't carry
+ * them at anything like the unicast rate.  The pause also lets
+ * XBeeBoot write each page without missing the next chunk.
+ */
+#define XBEE_FLEET_DEFAULT_DELAY_MS 50
+
+/* Rounds of fleet mode repair before giving up */
+#define XBEE_FLEET_ROUNDS 8
+
+/*
+ * XBeeBoot specific STK_GET_PARAMETER parameters.  Bootloaders
+ * predating these parameters answer any unrecognised parameter with
+ * 0x03, which never has XBEEBOOT_CAP_VALID set.
+ */
+#define XBEEBOOT_PARM_CAPABILITIES 0xc0
+#define XBEEBOOT_PARM_WINDOW 0xc1
+#define XBEEBOOT_PARM_MAX_CHUNK 0xc2
+#define XBEEBOOT_PARM_PIGGYBACK 0xc3
+#define XBEEBOOT_PARM_QUEUE 0xc4
+#define XBEEBOOT_PARM_BAUDS 0xc5
+
+#define XBEEBOOT_CAP_VALID 0x80
+#define XBEEBOOT_CAP_WINDOW 0x01
+#define XBEEBOOT_CAP_CRC 0x02
+#define XBEEBOOT_CAP_COMPRESS 0x04
+#define XBEEBOOT_CAP_ERASE 0x08
+#define XBEEBOOT_CAP_FLEET 0x10
+#define XBEEBOOT_CAP_RTS 0x20
+#define XBEEBOOT_CAP_PIGGYBACK 0x40
+
+/*
+ * XBeeBoot specific STK500 command returning the CRC-32 of a range of
+ * flash, starting at the loaded address:
+ *
+ *   [XBEEBOOT_CMD_CRC] [length MSB] [length LSB] [type] [Sync_CRC_EOP]
+ *
+ * The reply is Resp_STK_INSYNC, the CRCs each least significant byte
+ * first, then Resp_STK_OK.  Type XBEEBOOT_CRC_RANGE gives one CRC for
+ * the whole range, and XBEEBOOT_CRC_PAGES one for each flash page.
+ */
+#define XBEEBOOT_CMD_CRC 0xd0
+#define XBEEBOOT_CRC_RANGE 'F'
+#define XBEEBOOT_CRC_PAGES 'P'
+
+/*
+ * The most flash checked by a single XBEEBOOT_CMD_CRC.  Ranges are
+ * aligned to this, which keeps them within a 64kB flash segment.
+ */
+#define XBEE_CRC_RANGE 4096
+
+/* The most page CRCs a single XBEEBOOT_CMD_CRC can return */
+#define XBEE_CRC_MAX_PAGES (XBEE_CRC_RANGE / 64)
+
+/*
+ * XBeeBoot specific STK500 command writing a compressed page of flash
+ * at the loaded address:
+ *
+ *   [XBEEBOOT_CMD_PROG_PAGE_LZ] [length MSB] [length LSB] ['F']
+ *   [tokens...] [Sync_CRC_EOP]
+ *
+ * where length is the uncompressed page length.  Each token is either
+ * a literal run, [0nnnnnnn] followed by n + 1 bytes, or a copy of
+ * earlier bytes of the same page, [1nnnnnnn] [d] copying n + 3 bytes
+ * from d + 1 bytes back.  Copies may overlap the bytes they produce.
+ */
+#define XBEEBOOT_CMD_PROG_PAGE_LZ 0xd1
+#define XBEE_LZ_MAX_LITERAL 128
+#define XBEE_LZ_MIN_MATCH 3
+#define XBEE_LZ_MAX_MATCH (127 + XBEE_LZ_MIN_MATCH)
+#define XBEE_LZ_MAX_DISTANCE 256
+
+/*
+ * The largest flash page we send in one command, that of the biggest
+ * megaAVRs.  A page of nothing but literal runs compresses to the
+ * most: a token per XBEE_LZ_MAX_LITERAL bytes.
+ */
+#define XBEE_LZ_MAX_PAGE 256
+#define XBEE_LZ_MAX_OUTPUT (XBEE_LZ_MAX_PAGE + \
+                            (XBEE_LZ_MAX_PAGE + XBEE_LZ_MAX_LITERAL - 1) / \
+                            XBEE_LZ_MAX_LITERAL)
+
+/*
+ * XBeeBoot specific STK500 command erasing the page of flash at the
+ * loaded address, so that a blank page needs no data sent:
+ *
+ *   [XBEEBOOT_CMD_ERASE_PAGE] [Sync_CRC_EOP]
+ */
+#define XBEEBOOT_CMD_ERASE_PAGE 0xd2
+
+/*
+ * XBeeBoot specific STK500 command switching the bootloader's UART to
+ * the rate of an XBee BD setting, once it has the ACK for the reply:
+ *
+ *   [XBEEBOOT_CMD_BAUD] [bd] [Sync_CRC_EOP]
+ *
+ * XBEEBOOT_PARM_BAUDS has bit n set if BD n is usable.  The remote
+ * XBee's BD is then set to match.
+ */
+#define XBEEBOOT_CMD_BAUD 0xd3
+
+/* Rates of XBee BD settings 0 to 7 */
+static const long xbeeBaudRates[] =
+  { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+#define XBEE_MAX_BD 7
+
+/*
+ * Time for the remote XBee to pass the ACK for the XBEEBOOT_CMD_BAUD
+ * reply on to XBeeBoot at the old rate, before its rate is changed.
+ */
+#define XBEE_BAUD_SETTLE_MS 100
+
+/*
+ * Serial bytes XBeeBoot receives per FIRMWARE_DELIVER packet beyond
+ * the chunk itself: start delimiter, length, 0x90 receive header,
+ * the three byte XBeeBoot header and the checksum.  The advertised
+ * receive buffer capacity needs to allow for this.
+ */
+#define XBEEBOOT_PACKET_OVERHEAD (1 + 2 + 12 + 3 + 1)
+
+/*
+ * The private PROGRAMMER "flag" field holds our extended parameters.
+ */
+#define XBEE_FLAG_RESETPIN_MASK 0x0007
+#define XBEE_FLAG_WINDOW_SHIFT 3
+#define XBEE_FLAG_WINDOW_MASK (0x000f << XBEE_FLAG_WINDOW_SHIFT)
+#define XBEE_FLAG_FLEET_SHIFT 8
+#define XBEE_FLAG_FLEET_MASK (0x03ff << XBEE_FLAG_FLEET_SHIFT)
+#define XBEE_FLAG_API1 0x40000
+#define XBEE_FLAG_BAUD_SHIFT 19
+#define XBEE_FLAG_BAUD_MASK (0x000f << XBEE_FLAG_BAUD_SHIFT)
+#define XBEE_FLAG_LOCALBAUD_SHIFT 23
+#define XBEE_FLAG_LOCALBAUD_MASK (0x000f << XBEE_FLAG_LOCALBAUD_SHIFT)
+
+/*
+ * Passed as waitForAck to xbeedev_poll() to return on any XBeeBoot
+ * ACK or reply, for any of the sessions sharing the serial port.
+ */
+#define XBEE_WAIT_ANY 256
+
 /*
  * Read signature bytes - Direct copy of the Arduino behaviour to
  * satisfy Optiboot.
@@ -170,8 +436,27 @@ static int xbee_read_sig_bytes(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m)
   return 3;
 }
 
+#define XBEE_LENGTH_LEN 2
+#define XBEE_CHECKSUM_LEN 1
+#define XBEE_APITYPE_LEN 1
+#define XBEE_APISEQUENCE_LEN 1
+#define XBEE_ADDRESS_64BIT_LEN 8
+#define XBEE_ADDRESS_16BIT_LEN 2
+#define XBEE_RADIUS_LEN 1
+#define XBEE_TXOPTIONS_LEN 1
+#define XBEE_RXOPTIONS_LEN 1
+
+/* Room for a 64-bit address as hexadecimal text */
+#define XBEE_ADDRESS_STRING_LEN (2 * XBEE_ADDRESS_64BIT_LEN + 1)
+
 struct XBeeSequenceStatistics {
   struct timeval sendTime;
+
+  /*
+   * Non-zero if the next response may be used as a round trip time
+   * sample, which is never the case once the request was retried.
+   */
+  int rttValid;
 };
 
 struct XBeeStaticticsSummary {
@@ -195,20 +480,130 @@ static const char* groupNames[] =
    "RECEIVE"
   };
 
+/*
+ * Incremental XBee API frame parser.  Bytes are fed in one at a time
+ * as they arrive, so a frame split across reads (or across a timeout)
+ * is picked up where it was left off.
+ */
+struct XBeeFrameParser {
+  int inFrame;
+  int escaped;
+  size_t index;
+  unsigned int frameSize;
+  unsigned char frame[256];
+};
+
+/*
+ * What, if anything, a session is waiting on.  Timer expiry for a
+ * pending session triggers a retransmission.
+ */
+#define XBEE_PENDING_NONE 0
+#define XBEE_PENDING_SEND 1
+#define XBEE_PENDING_RECV 2
+
+/*
+ * A FIRMWARE_DELIVER packet that has been sent but not yet ACK'd.
+ */
+struct XBeeWindowEntry {
+  const unsigned char *data;
+  unsigned char length;
+  unsigned char sequence;
+};
+
 struct XBeeBootSession {
   struct serial_device *serialDevice;
   union filedescriptor serialDescriptor;
 
+  /*
+   * When programming several targets in lockstep through one local
+   * XBee, the sessions are chained from the primary session.  The
+   * primary session owns the serial port and the XBee API frame
+   * sequence, which are shared.
+   */
+  struct XBeeBootSession *primary;
+  struct XBeeBootSession *nextSession;
+
   unsigned char xbee_address[10];
   int directMode;
   unsigned char outSequence;
   unsigned char inSequence;
 
+  /*
+   * Sequence number of the most recently received ACK.
+   */
+  unsigned char lastAckSequence;
+
+  /*
+   * XBeeBoot capabilities (XBEEBOOT_CAP_*) reported by the
+   * bootloader, or zero if unknown.
+   */
+  int capabilities;
+
+  /*
+   * Set once XBeeBoot carries its ACKs in its replies, when we carry
+   * ours in our FIRMWARE_DELIVER packets too.  ackPending is set while
+   * the ACK for inSequence is held back, until ackDeadline.
+   */
+  int piggyback;
+  int ackPending;
+  struct timeval ackDeadline;
+
+  /*
+   * The number of FIRMWARE_DELIVER packets we may have outstanding,
+   * and the packets currently outstanding, oldest first.
+   */
+  unsigned int window;
+  unsigned int windowUsed;
+  struct XBeeWindowEntry windowEntries[XBEE_MAX_WINDOW];
+
+  /*
+   * Transfer state for the current xbeedev_send() or xbeedev_recv():
+   * data not yet sent, what we are waiting on this session for
+   * (XBEE_PENDING_*), consecutive timeouts, the time at which the
+   * next timeout expires, and the time after which we give up unless
+   * progress is made.
+   */
+  const unsigned char *sendData;
+  size_t sendLength;
+  int pending;
+  int retries;
+  struct timeval deadline;
+  struct timeval giveUp;
+
+  /*
+   * The bootloader's receive queue, in bytes, and on the first
+   * session, the replies to staged flash writes not yet read.  Each is
+   * a two byte STK500 reply, Resp_STK_INSYNC then Resp_STK_OK.
+   */
+  unsigned int queueSize;
+  unsigned int stagedReplies;
+
+  /*
+   * Data passed to xbeedev_send() but not yet sent, held so that
+   * short writes share a FIRMWARE_DELIVER packet.  It is sent once a
+   * whole packet has built up, or before anything is received.  Only
+   * the first session's buffer is used, as every target is sent the
+   * same data.
+   */
+  size_t outLength;
+  unsigned char outBuffer[512];
+
   /*
    * XBee API frame sequence number.
    */
   unsigned char txSequence;
 
+  /*
+   * XBee API mode in use on the serial port, 2 (escaped) or 1, and
+   * the bytes sent and received on it, counting the 0x7d escapes
+   * separately.  Only the primary session's are used.
+   */
+  int apiMode;
+  unsigned long serialSent;
+  unsigned long serialSentEscapes;
+  unsigned long serialReceived;
+  unsigned long serialReceivedEscapes;
+
   /*
    * Set to non-zero if the transport is broken to the point it is
    * considered unusable.
@@ -217,13 +612,64 @@ struct XBeeBootSession {
 
   int xbeeResetPin;
 
+  /*
+   * The remote XBee's BD setting before XBEEBOOT_CMD_BAUD raised the
+   * rate, or -1 if unchanged.
+   */
+  int remoteBaud;
+
+  /*
+   * The local XBee's BD setting before xbeedev_localbaud() raised the
+   * rate, or -1 if unchanged.  Only the primary session's is used.
+   */
+  int localBaud;
+
   size_t inInIndex;
   size_t inOutIndex;
-  unsigned char inBuffer[256];
+  unsigned char inBuffer[1024];
+
+  /*
+   * Raw serial input read ahead of the frame parser.  Only the
+   * primary session's buffer is used.
+   */
+  size_t readIndex;
+  size_t readLength;
+  unsigned char readBuffer[512];
+
+  /*
+   * Frame parser state.  Only the primary session's parser is used.
+   */
+  struct XBeeFrameParser parser;
 
   int sourceRouteHops; /* -1 if unset */
   int sourceRouteChanged;
 
+  /*
+   * The most FIRMWARE_DELIVER data found to reach this target in one
+   * packet, before allowing for source routing.  The primary session
+   * also holds the payload its local XBee allows for an XBeeBoot
+   * packet, zero if unknown.
+   */
+  size_t maxChunk;
+  unsigned int localPayload;
+
+  /*
+   * The AT command in progress, local on the primary session or
+   * remote to this target: its frame sequence number while awaiting
+   * the response, otherwise zero, the command itself for resending,
+   * how many times it has been sent, and when to send it again.  Then
+   * the status from the response, -1 if none, and any value.
+   */
+  unsigned char atSequence;
+  int atRemote;
+  unsigned char atCommand[3];
+  size_t atLength;
+  char const *atDetail;
+  int atTries;
+  struct timeval atDeadline;
+  int atStatus;
+  unsigned int atValue;
+
   /*
    * The source route is an array of intermediate 16 bit addresses,
    * starting with the address nearest to the target address, and
@@ -231,8 +677,62 @@ struct XBeeBootSession {
    */
   unsigned char sourceRoute[2 * XBEE_MAX_INTERMEDIATE_HOPS];
 
+  /*
+   * A copy of the flash image most recently written, and which bytes
+   * of it are known, so that it can be verified by CRC rather than by
+   * reading it back.  verifiedStart and verifiedEnd bound the range
+   * most recently found to match.
+   */
+  unsigned char *shadow;
+  unsigned char *shadowValid;
+  unsigned int shadowSize;
+  unsigned int verifiedStart;
+  unsigned int verifiedEnd;
+
+  /*
+   * CRCs of the flash pages already on the device, fetched a range at
+   * a time so that unchanged pages need not be written.
+   */
+  unsigned long *pageCrc;
+  unsigned char *pageCrcValid;
+  unsigned int pageCrcCount;
+  unsigned int pagesWritten;
+  unsigned int pagesSkipped;
+  unsigned long bytesSkipped;
+
+  /* Flash bytes written, the bytes it took to send them, and how long */
+  unsigned int pagesErased;
+  unsigned long bytesWritten;
+  unsigned long bytesSent;
+  struct timeval writeTime;
+
+  /*
+   * Fleet mode.  The primary session holds the image broadcast so
+   * far, which chunks of it have been sent, and whether they still
+   * need checking.  Each session holds the chunks its target reported
+   * missing, and its latest FLEET_NACK.
+   */
+  unsigned char *fleetImage;
+  unsigned char *fleetSent;
+  unsigned int fleetChunks;
+  int fleetPending;
+  unsigned long fleetBroadcasts;
+  unsigned long fleetRebroadcasts;
+  unsigned long fleetUnicasts;
+  unsigned char *fleetMissing;
+  unsigned char fleetNack[3 + XBEEBOOT_FLEET_NACK];
+  int fleetNackValid;
+
   struct XBeeSequenceStatistics sequenceStatistics[256 * XBEE_STATS_GROUPS];
   struct XBeeStaticticsSummary groupSummary[XBEE_STATS_GROUPS];
+
+  /*
+   * Smoothed round trip time and round trip time variation for
+   * TRANSMIT requests, in microseconds.  srtt is zero until the first
+   * sample is taken.
+   */
+  long srtt;
+  long rttvar;
 };
 
 static void xbeeStatsReset(struct XBeeStaticticsSummary *summary)
@@ -274,6 +774,11 @@ static void xbeeStatsAdd(struct XBeeStaticticsSummary *summary,
 
 static void xbeeStatsSummarise(struct XBeeStaticticsSummary const *summary)
 {
+  if (summary->samples == 0) {
+    avrdude_message(MSG_NOTICE, "%s:   No samples\n", progname);
+    return;
+  }
+
   avrdude_message(MSG_NOTICE, "%s:   Minimum response time: %lu.%06lu\n",
                   progname, summary->minimum.tv_sec, summary->minimum.tv_usec);
   avrdude_message(MSG_NOTICE, "%s:   Maximum response time: %lu.%06lu\n",
@@ -296,22 +801,89 @@ static void xbeeStatsSummarise(struct XBeeStaticticsSummary const *summary)
 
 static void XBeeBootSessionInit(struct XBeeBootSession *xbs) {
   xbs->serialDevice = &serial_serdev;
+  xbs->primary = xbs;
+  xbs->nextSession = NULL;
   xbs->directMode = 1;
   xbs->xbeeResetPin = XBEE_DEFAULT_RESET_PIN;
+  xbs->remoteBaud = -1;
+  xbs->localBaud = -1;
   xbs->outSequence = 0;
   xbs->inSequence = 0;
+  xbs->lastAckSequence = 0;
+  xbs->capabilities = 0;
+  xbs->piggyback = 0;
+  xbs->ackPending = 0;
+  xbs->window = 1;
+  xbs->windowUsed = 0;
+  xbs->queueSize = 0;
+  xbs->stagedReplies = 0;
+  xbs->sendData = NULL;
+  xbs->sendLength = 0;
+  xbs->outLength = 0;
+  xbs->pending = XBEE_PENDING_NONE;
+  xbs->retries = 0;
   xbs->txSequence = 0;
+  xbs->apiMode = 2;
+  xbs->serialSent = 0;
+  xbs->serialSentEscapes = 0;
+  xbs->serialReceived = 0;
+  xbs->serialReceivedEscapes = 0;
   xbs->transportUnusable = 0;
   xbs->inInIndex = 0;
   xbs->inOutIndex = 0;
+  xbs->readIndex = 0;
+  xbs->readLength = 0;
+  xbs->parser.inFrame = 0;
+  xbs->parser.escaped = 0;
+  xbs->parser.index = 0;
+  xbs->parser.frameSize = XBEE_LENGTH_LEN;
   xbs->sourceRouteHops = -1;
   xbs->sourceRouteChanged = 0;
+  xbs->maxChunk = XBEEBOOT_MAX_CHUNK;
+  xbs->localPayload = 0;
+  xbs->atSequence = 0;
+  xbs->atRemote = 0;
+  xbs->atLength = 0;
+  xbs->atDetail = NULL;
+  xbs->atTries = 0;
+  xbs->atStatus = -1;
+  xbs->atValue = 0;
+  xbs->srtt = 0;
+  xbs->rttvar = 0;
+  xbs->shadow = NULL;
+  xbs->shadowValid = NULL;
+  xbs->shadowSize = 0;
+  xbs->verifiedStart = 0;
+  xbs->verifiedEnd = 0;
+  xbs->pageCrc = NULL;
+  xbs->pageCrcValid = NULL;
+  xbs->pageCrcCount = 0;
+  xbs->pagesWritten = 0;
+  xbs->pagesSkipped = 0;
+  xbs->bytesSkipped = 0;
+  xbs->pagesErased = 0;
+  xbs->bytesWritten = 0;
+  xbs->bytesSent = 0;
+  xbs->writeTime.tv_sec = 0;
+  xbs->writeTime.tv_usec = 0;
+  xbs->fleetImage = NULL;
+  xbs->fleetSent = NULL;
+  xbs->fleetChunks = 0;
+  xbs->fleetPending = 0;
+  xbs->fleetBroadcasts = 0;
+  xbs->fleetRebroadcasts = 0;
+  xbs->fleetUnicasts = 0;
+  xbs->fleetMissing = NULL;
+  xbs->fleetNackValid = 0;
 
   int group;
   for (group = 0; group < 3; group++) {
     int index;
     for (index = 0; index < 256; index++)
+    {
       xbs->sequenceStatistics[group * 256 + index].sendTime.tv_sec = (time_t)0;
+      xbs->sequenceStatistics[group * 256 + index].rttValid = 0;
+    }
     xbeeStatsReset(&xbs->groupSummary[group]);
   }
 }
@@ -320,8 +892,9 @@ static void XBeeBootSessionInit(struct XBeeBootSession *xbs) {
 
 static void xbeedev_setresetpin(union filedescriptor *fdp, int xbeeResetPin)
 {
-  struct XBeeBootSession *xbs = xbeebootsession(fdp);
-  xbs->xbeeResetPin = xbeeResetPin;
+  struct XBeeBootSession *xbs;
+  for (xbs = xbeebootsession(fdp); xbs != NULL; xbs = xbs->nextSession)
+    xbs->xbeeResetPin = xbeeResetPin;
 }
 
 enum xbee_stat_is_retry_enum {XBEE_STATS_NOT_RETRY, XBEE_STATS_IS_RETRY};
@@ -337,8 +910,16 @@ static void xbeedev_stats_send(struct XBeeBootSession *xbs,
   struct XBeeSequenceStatistics *stats =
     &xbs->sequenceStatistics[group * 256 + sequence];
 
-  if (retry == XBEE_STATS_NOT_RETRY)
+  if (retry == XBEE_STATS_NOT_RETRY) {
     stats->sendTime = *sendTime;
+    stats->rttValid = 1;
+  } else {
+    /*
+     * A response to a retried request is ambiguous, so never use it
+     * to estimate the round trip time (Karn's algorithm).
+     */
+    stats->rttValid = 0;
+  }
 
   if (detailSequence >= 0) {
     avrdude_message(MSG_NOTICE2,
@@ -397,75 +978,233 @@ static void xbeedev_stats_receive(struct XBeeBootSession *xbs,
                   detail);
 
   xbeeStatsAdd(&xbs->groupSummary[group], &delay);
-}
 
-static int sendAPIRequest(struct XBeeBootSession *xbs,
-                          unsigned char apiType,
-                          int txSequence,
-                          int apiOption,
-                          int prePayload1,
-                          int prePayload2,
-                          int packetType,
-                          int sequence,
-                          int appType,
-                          char const *detail,
-                          int detailSequence,
-                          unsigned int frameGroup,
-                          xbee_stat_is_retry retry,
-                          unsigned int dataLength,
-                          const unsigned char *data)
-{
-  unsigned char frame[256];
+  if (group == XBEE_STATS_TRANSMIT && stats->rttValid) {
+    /*
+     * Update the round trip time estimate as per RFC 6298, using the
+     * same gains of 1/8 and 1/4.
+     */
+    const long sample = (long)secs * 1000000 + usecs;
+    if (xbs->srtt == 0) {
+      xbs->srtt = sample;
+      xbs->rttvar = sample / 2;
+    } else {
+      const long error = sample - xbs->srtt;
+      xbs->rttvar += ((error < 0 ? -error : error) - xbs->rttvar) / 4;
+      xbs->srtt += error / 8;
+    }
 
-  unsigned char *fp = &frame[5];
-  unsigned char *dataStart = fp;
-  unsigned char checksum = 0xff;
-  unsigned char length = 0;
-  struct timeval time;
+    /* Only the first response is a valid sample */
+    stats->rttValid = 0;
+  }
+}
 
-  gettimeofday(&time, NULL);
+/*
+ * Return the receive timeout to use in milliseconds, after "backoff"
+ * consecutive timeouts.  Each timeout doubles the previous value.
+ */
+static int xbeedev_timeout(struct XBeeBootSession *xbs, int backoff)
+{
+  long timeout = XBEE_MAX_TIMEOUT_MS;
 
-  avrdude_message(MSG_NOTICE2,
-                  "%s: sendAPIRequest(): %lu.%06lu %d, %d, %d, %d %s\n",
-                  progname, (unsigned long)time.tv_sec,
-                  (unsigned long)time.tv_usec,
-                  (int)packetType, (int)sequence, appType,
-                  data == NULL ? -1 : (int)*data, detail);
+  if (xbs->srtt > 0)
+    timeout = (xbs->srtt + 4 * xbs->rttvar + 999) / 1000;
 
-#define fpput(x)                                                \
-  do {                                                          \
-    const unsigned char v = (x);                                \
-    if (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13) {     \
-      *fp++ = 0x7d;                                             \
-      *fp++ = v ^ 0x20;                                         \
-    } else {                                                    \
-      *fp++ = v;                                                \
-    }                                                           \
-    checksum -= v;                                              \
-    length++;                                                   \
-  } while (0)
+  if (timeout < XBEE_MIN_TIMEOUT_MS)
+    timeout = XBEE_MIN_TIMEOUT_MS;
 
-  fpput(apiType); /* ZigBee Receive Packet or ZigBee Transmit Request */
+  while (backoff-- > 0 && timeout < XBEE_MAX_TIMEOUT_MS)
+    timeout *= 2;
 
-  if (apiOption >= 0)
-    fpput(apiOption); /* Receive options (RX) */
+  if (timeout > XBEE_MAX_TIMEOUT_MS)
+    timeout = XBEE_MAX_TIMEOUT_MS;
 
-  if (txSequence >= 0) {
-    fpput(txSequence); /* Delivery sequence (TX/AT) */
+  return (int)timeout;
+}
 
-    /*
-     * Record the frame send time.  Note that frame sequences are
-     * never retries.
-     */
-    xbeedev_stats_send(xbs, detail, detailSequence,
-                       frameGroup, txSequence, 0, &time);
+/*
+ * Set when to ms milliseconds after now.
+ */
+static void xbeedev_add_ms(struct timeval *when, struct timeval const *now,
+                           long ms)
+{
+  when->tv_sec = now->tv_sec + ms / 1000;
+  when->tv_usec = now->tv_usec + (ms % 1000) * 1000;
+  if (when->tv_usec >= 1000000) {
+    when->tv_usec -= 1000000;
+    when->tv_sec++;
+  }
+}
+
+/*
+ * Return the milliseconds remaining until when, or zero if it has
+ * already passed.
+ */
+static long xbeedev_until(struct timeval const *when,
+                          struct timeval const *now)
+{
+  const long remaining =
+    (long)(when->tv_sec - now->tv_sec) * 1000 +
+    (when->tv_usec - now->tv_usec) / 1000;
+
+  return remaining > 0 ? remaining : 0;
+}
+
+/*
+ * Start the session timer, expiring after the current timeout.
+ */
+static void xbeedev_set_deadline(struct XBeeBootSession *xbs,
+                                 struct timeval const *now)
+{
+  xbeedev_add_ms(&xbs->deadline, now, xbeedev_timeout(xbs, xbs->retries));
+}
+
+/*
+ * The session has made progress: count retries afresh, and restart
+ * the session timer and the time allowed without progress.
+ */
+static void xbeedev_progress(struct XBeeBootSession *xbs,
+                             struct timeval const *now)
+{
+  xbs->retries = 0;
+  xbeedev_add_ms(&xbs->giveUp, now, XBEE_GIVE_UP_MS);
+  xbeedev_set_deadline(xbs, now);
+}
+
+/*
+ * Return the milliseconds remaining until the session timer expires,
+ * or zero if it has already expired.
+ */
+static long xbeedev_remaining(struct XBeeBootSession const *xbs,
+                              struct timeval const *now)
+{
+  return xbeedev_until(&xbs->deadline, now);
+}
+
+/*
+ * Retire the outstanding packets covered by the cumulative ACK in
+ * lastAckSequence.  XBeeBoot only ever accepts packets in sequence,
+ * so an ACK also acknowledges every packet sent before it.  Return
+ * non-zero if any packet was retired.
+ */
+static int xbeedev_window_ack(struct XBeeBootSession *xbs)
+{
+  unsigned int index;
+  for (index = 0; index < xbs->windowUsed; index++) {
+    if (xbs->windowEntries[index].sequence == xbs->lastAckSequence) {
+      const unsigned int retired = index + 1;
+      xbs->windowUsed -= retired;
+      memmove(&xbs->windowEntries[0], &xbs->windowEntries[retired],
+              xbs->windowUsed * sizeof(xbs->windowEntries[0]));
+      return 1;
+    }
+  }
+
+  /* Duplicate or stale ACK */
+  return 0;
+}
+
+/*
+ * Return the number of received bytes buffered for the session.
+ */
+static size_t xbeedev_available(struct XBeeBootSession const *xbs)
+{
+  return (xbs->inInIndex + sizeof(xbs->inBuffer) - xbs->inOutIndex) %
+    sizeof(xbs->inBuffer);
+}
+
+/*
+ * Find the session for the given 64-bit source address, or NULL if
+ * the address doesn't belong to any of our target devices.
+ */
+static struct XBeeBootSession *xbeedev_find(struct XBeeBootSession *xbs,
+                                            const unsigned char *address)
+{
+  for (xbs = xbs->primary; xbs != NULL; xbs = xbs->nextSession)
+    if (memcmp(address, xbs->xbee_address, XBEE_ADDRESS_64BIT_LEN) == 0)
+      return xbs;
+
+  return NULL;
+}
+
+/*
+ * Send an API frame to the session's target, or to address if it is
+ * not NULL.
+ */
+static int sendAPIRequest(struct XBeeBootSession *xbs,
+                          const unsigned char *address,
+                          unsigned char apiType,
+                          int txSequence,
+                          int apiOption,
+                          int prePayload1,
+                          int prePayload2,
+                          int packetType,
+                          int sequence,
+                          int appType,
+                          char const *detail,
+                          int detailSequence,
+                          unsigned int frameGroup,
+                          xbee_stat_is_retry retry,
+                          unsigned int dataLength,
+                          const unsigned char *data)
+{
+  unsigned char frame[256];
+
+  unsigned char *fp = &frame[5];
+  unsigned char *dataStart = fp;
+  unsigned char checksum = 0xff;
+  unsigned char length = 0;
+  struct timeval time;
+  struct XBeeBootSession *primary = xbs->primary;
+  const int escape = primary->apiMode == 2;
+
+  gettimeofday(&time, NULL);
+
+  avrdude_message(MSG_NOTICE2,
+                  "%s: sendAPIRequest(): %lu.%06lu %d, %d, %d, %d %s\n",
+                  progname, (unsigned long)time.tv_sec,
+                  (unsigned long)time.tv_usec,
+                  (int)packetType, (int)sequence, appType,
+                  data == NULL ? -1 : (int)*data, detail);
+
+#define fpput(x)                                                \
+  do {                                                          \
+    const unsigned char v = (x);                                \
+    if (escape &&                                               \
+        (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13)) {   \
+      *fp++ = 0x7d;                                             \
+      *fp++ = v ^ 0x20;                                         \
+    } else {                                                    \
+      *fp++ = v;                                                \
+    }                                                           \
+    checksum -= v;                                              \
+    length++;                                                   \
+  } while (0)
+
+  fpput(apiType); /* ZigBee Receive Packet or ZigBee Transmit Request */
+
+  if (apiOption >= 0)
+    fpput(apiOption); /* Receive options (RX) */
+
+  if (txSequence >= 0) {
+    fpput(txSequence); /* Delivery sequence (TX/AT) */
+
+    /*
+     * Record the frame send time.  Note that frame sequences are
+     * never retries.
+     */
+    xbeedev_stats_send(xbs->primary, detail, detailSequence,
+                       frameGroup, txSequence, 0, &time);
   }
 
   if (apiType != 0x08) {
     /* Automatically inhibit addressing for local AT command requests. */
+    if (address == NULL)
+      address = xbs->xbee_address;
+
     size_t index;
     for (index = 0; index < 10; index++) {
-      const unsigned char val = xbs->xbee_address[index];
+      const unsigned char val = address[index];
       fpput(val);
     }
 
@@ -474,12 +1213,13 @@ static int sendAPIRequest(struct XBeeBootSession *xbs,
      * Source Route request, consider prefixing it with source routing
      * instructions.
      */
-    if (apiType != 0x21 && xbs->sourceRouteChanged) {
+    if (apiType != 0x21 && address == xbs->xbee_address &&
+        xbs->sourceRouteChanged) {
       avrdude_message(MSG_NOTICE2, "%s: sendAPIRequest(): "
                       "Issuing Create Source Route request with %d hops\n",
                       progname, xbs->sourceRouteHops);
 
-      int rc = sendAPIRequest(xbs, 0x21, /* Create Source Route */
+      int rc = sendAPIRequest(xbs, NULL, 0x21, /* Create Source Route */
                               0, -1, 0, xbs->sourceRouteHops,
                               -1, -1, -1,
                               "Create Source Route for FRAME_REMOTE",
@@ -507,8 +1247,12 @@ static int sendAPIRequest(struct XBeeBootSession *xbs,
   if (sequence >= 0) {
     fpput(sequence);
 
-    /* Record the send time */
-    if (packetType == XBEEBOOT_PACKET_TYPE_REQUEST)
+    /*
+     * Record the send time of FIRMWARE_DELIVER data, which when
+     * piggybacking goes out as DELIVER_ACK.
+     */
+    if (packetType == XBEEBOOT_PACKET_TYPE_REQUEST ||
+        packetType == XBEEBOOT_PACKET_TYPE_DELIVER_ACK)
       xbeedev_stats_send(xbs, detail, sequence, XBEE_STATS_TRANSMIT,
                          sequence, retry, &time);
   }
@@ -538,6 +1282,11 @@ static int sendAPIRequest(struct XBeeBootSession *xbs,
   unsigned char *frameStart = dataStart - prefixLength;
   memmove(frameStart, frame, prefixLength);
 
+  /* Everything beyond the delimiter, length and checksum is escapes */
+  primary->serialSent += finalLength + prefixLength;
+  primary->serialSentEscapes +=
+    finalLength + prefixLength - (unescapedLength + 4);
+
   return xbs->serialDevice->send(&xbs->serialDescriptor,
                                  frameStart, finalLength + prefixLength);
 }
@@ -575,8 +1324,9 @@ static int sendPacket(struct XBeeBootSession *xbs,
     prePayload2 = 0;
   }
 
-  while ((++xbs->txSequence & 0xff) == 0);
-  return sendAPIRequest(xbs, apiType, xbs->txSequence, -1,
+  struct XBeeBootSession *primary = xbs->primary;
+  while ((++primary->txSequence & 0xff) == 0);
+  return sendAPIRequest(xbs, NULL, apiType, primary->txSequence, -1,
                         prePayload1, prePayload2, packetType,
                         sequence, appType,
                         detail, sequence,
@@ -584,15 +1334,32 @@ static int sendPacket(struct XBeeBootSession *xbs,
                         dataLength, data);
 }
 
-#define XBEE_LENGTH_LEN 2
-#define XBEE_CHECKSUM_LEN 1
-#define XBEE_APITYPE_LEN 1
-#define XBEE_APISEQUENCE_LEN 1
-#define XBEE_ADDRESS_64BIT_LEN 8
-#define XBEE_ADDRESS_16BIT_LEN 2
-#define XBEE_RADIUS_LEN 1
-#define XBEE_TXOPTIONS_LEN 1
-#define XBEE_RXOPTIONS_LEN 1
+/*
+ * Send a fleet mode packet to the session's target, or broadcast it
+ * to every XBee on the network.  value is sent least significant byte
+ * first, after the packet type.
+ */
+static int sendFleetPacket(struct XBeeBootSession *xbs,
+                           int broadcast,
+                           const char *detail,
+                           unsigned char packetType,
+                           unsigned int value,
+                           unsigned int dataLength,
+                           const unsigned char *data)
+{
+  static const unsigned char broadcastAddress[10] =
+    { 0, 0, 0, 0, 0, 0, 0xff, 0xff, /* 64-bit broadcast */
+      0xff, 0xfe /* 16-bit address unknown */ };
+
+  /* Frame ID zero, nothing is waiting on the transmit status */
+  return sendAPIRequest(xbs, broadcast ? broadcastAddress : NULL,
+                        0x10, /* ZigBee Transmit Request */
+                        0, -1, 0, 0,
+                        packetType, value & 0xff, (value >> 8) & 0xff,
+                        detail, -1, XBEE_STATS_FRAME_REMOTE,
+                        XBEE_STATS_NOT_RETRY,
+                        dataLength, data);
+}
 
 static void xbeedev_record16Bit(struct XBeeBootSession *xbs,
                                 const unsigned char *rx16Bit)
@@ -615,333 +1382,535 @@ static void xbeedev_record16Bit(struct XBeeBootSession *xbs,
 }
 
 /*
- * Return 0 on success.
- * Return -1 on generic error (normally serial timeout).
- * Return -512 + XBee AT Response code
+ * Read whatever serial input has already arrived, up to length bytes,
+ * in one read() without waiting.  Returns the bytes read, zero if
+ * there are none or on WIN32NATIVE, where there is no select() on a
+ * serial HANDLE.
  */
-#define XBEE_AT_RETURN_CODE(x) (((x) >= -512 && (x) <= -256) ? (x) + 512 : -1)
-static int xbeedev_poll(struct XBeeBootSession *xbs,
-                        unsigned char **buf, size_t *buflen,
-                        int waitForAck,
-                        int waitForSequence)
+static size_t xbeedev_read_ready(struct XBeeBootSession *primary,
+                                 unsigned char *buf, size_t length)
 {
-  for (;;) {
-    unsigned char byte;
-    unsigned char frame[256];
-    unsigned int frameSize;
+#ifdef WIN32NATIVE
+  return 0;
+#else
+  const int fd = primary->serialDescriptor.ifd;
+
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 0;
+
+  if (select(fd + 1, &rfds, NULL, NULL, &timeout) <= 0)
+    /* Nothing yet, or EINTR; the serial layer then waits */
+    return 0;
+
+  const ssize_t rc = read(fd, buf, length);
+  if (rc < 0 && errno != EINTR && errno != EAGAIN)
+    avrdude_message(MSG_INFO, "%s: xbeedev_read_ready(): read(): %s\n",
+                    progname, strerror(errno));
+
+  return rc > 0 ? (size_t)rc : 0;
+#endif
+}
+
+/*
+ * Read the next byte from the serial port, waiting up to
+ * serial_recv_timeout.  Rather than a read per byte, take everything
+ * that has already arrived in one read, so that it can all be
+ * dispatched in one pass of xbeedev_events(), and only block in the
+ * serial layer when nothing has.
+ */
+static int xbeedev_getbyte(struct XBeeBootSession *xbs, unsigned char *byte)
+{
+  struct XBeeBootSession *primary = xbs->primary;
+
+  if (primary->readIndex == primary->readLength) {
+    primary->readIndex = 0;
+    primary->readLength = xbeedev_read_ready(primary, primary->readBuffer,
+                                             sizeof(primary->readBuffer));
 
-  before_frame:
-    do {
-      const int rc = xbs->serialDevice->recv(&xbs->serialDescriptor, &byte, 1);
+    if (primary->readLength == 0) {
+      /* Nothing waiting, so block in the serial layer for a byte */
+      const int rc = primary->serialDevice->recv(&primary->serialDescriptor,
+                                                 primary->readBuffer, 1);
       if (rc < 0)
         return rc;
-    } while (byte != 0x7e);
 
-  start_of_frame:
-    {
-      size_t index = 0;
-      int escaped = 0;
-      frameSize = XBEE_LENGTH_LEN;
-      do {
-        const int rc = xbs->serialDevice->recv(&xbs->serialDescriptor,
-                                               &byte, 1);
-        if (rc < 0)
-          return rc;
-
-        if (byte == 0x7e)
-          /*
-           * No matter when we receive a frame start byte, we should
-           * abort parsing and start a fresh frame.
-           */
-          goto start_of_frame;
-
-        if (escaped) {
-          byte ^= 0x20;
-          escaped = 0;
-        } else if (byte == 0x7d) {
-          escaped = 1;
-          continue;
-        }
+      primary->readLength = 1 +
+        xbeedev_read_ready(primary, primary->readBuffer + 1,
+                           sizeof(primary->readBuffer) - 1);
+    }
+  }
 
-        if (index >= sizeof(frame))
-          goto before_frame;
+  *byte = primary->readBuffer[primary->readIndex++];
+  return 0;
+}
 
-        frame[index++] = byte;
+/*
+ * Feed one byte to the frame parser.
+ *
+ * @return
+ *          the size of the frame now complete in the parser's frame
+ *          buffer, or zero if there is no complete frame yet.
+ */
+static unsigned int xbeedev_parse(struct XBeeBootSession *xbs,
+                                  unsigned char byte)
+{
+  struct XBeeBootSession *primary = xbs->primary;
+  struct XBeeFrameParser *parser = &primary->parser;
 
-        if (index == XBEE_LENGTH_LEN) {
-          /* Length plus the two length bytes, plus the checksum byte */
-          frameSize = (frame[0] << 8 | frame[1]) +
-            XBEE_LENGTH_LEN + XBEE_CHECKSUM_LEN;
+  primary->serialReceived++;
 
-          if (frameSize >= sizeof(frame))
-            /* Too long - immediately give up on this frame */
-            goto before_frame;
-        }
-      } while (index < frameSize);
+  /*
+   * In API mode 1 a frame start byte may be data within a frame, so
+   * only look for one between frames, and rely on the length and
+   * checksum to find the end of each frame.
+   */
+  if (byte == 0x7e && (primary->apiMode == 2 || !parser->inFrame)) {
+    /*
+     * In API mode 2, no matter when we receive a frame start byte, we
+     * should abort parsing and start a fresh frame.
+     */
+    parser->inFrame = 1;
+    parser->escaped = 0;
+    parser->index = 0;
+    parser->frameSize = XBEE_LENGTH_LEN;
+    return 0;
+  }
 
-      /* End of frame */
-      unsigned char checksum = 1;
-      size_t cIndex;
-      for (cIndex = 2; cIndex < index; cIndex++) {
-        checksum += frame[cIndex];
-      }
+  if (!parser->inFrame)
+    return 0;
 
-      if (checksum) {
-        /* Checksum didn't match */
-        avrdude_message(MSG_NOTICE2,
-                        "%s: xbeedev_poll(): Bad checksum %d\n",
-                        progname, (int)checksum);
-        continue;
-      }
+  if (parser->escaped) {
+    byte ^= 0x20;
+    parser->escaped = 0;
+  } else if (byte == 0x7d && primary->apiMode == 2) {
+    parser->escaped = 1;
+    primary->serialReceivedEscapes++;
+    return 0;
+  }
+
+  if (parser->index >= sizeof(parser->frame)) {
+    parser->inFrame = 0;
+    return 0;
+  }
+
+  parser->frame[parser->index++] = byte;
+
+  if (parser->index == XBEE_LENGTH_LEN) {
+    /* Length plus the two length bytes, plus the checksum byte */
+    parser->frameSize = (parser->frame[0] << 8 | parser->frame[1]) +
+      XBEE_LENGTH_LEN + XBEE_CHECKSUM_LEN;
+
+    if (parser->frameSize >= sizeof(parser->frame)) {
+      /* Too long - immediately give up on this frame */
+      parser->inFrame = 0;
+      return 0;
     }
+  }
+
+  if (parser->index < parser->frameSize)
+    return 0;
 
-    const unsigned char frameType = frame[2];
+  /* End of frame */
+  parser->inFrame = 0;
 
-    struct timeval receiveTime;
-    gettimeofday(&receiveTime, NULL);
+  unsigned char checksum = 1;
+  size_t cIndex;
+  for (cIndex = 2; cIndex < parser->index; cIndex++) {
+    checksum += parser->frame[cIndex];
+  }
 
+  if (checksum) {
+    /* Checksum didn't match */
     avrdude_message(MSG_NOTICE2,
-                    "%s: xbeedev_poll(): %lu.%06lu Received frame type %x\n",
-                    progname, (unsigned long)receiveTime.tv_sec,
-                    (unsigned long)receiveTime.tv_usec,
-                    (unsigned int)frameType);
-
-    if (frameType == 0x97 && frameSize > 16) {
-      /* Remote command response */
-      unsigned char txSequence = frame[3];
-      unsigned char resultCode = frame[16];
-
-      xbeedev_stats_receive(xbs, "Remote AT command response",
-                            XBEE_STATS_FRAME_REMOTE, txSequence, &receiveTime);
-
-      avrdude_message(MSG_NOTICE,
-                      "%s: xbeedev_poll(): Remote command %d result code %d\n",
-                      progname, (int)txSequence, (int)resultCode);
-
-      if (waitForSequence >= 0 && waitForSequence == frame[3])
-        /* Received result for our sequence numbered request */
-        return -512 + resultCode;
-    } else if (frameType == 0x88 && frameSize > 6) {
-      /* Local command response */
-      unsigned char txSequence = frame[3];
-
-      xbeedev_stats_receive(xbs, "Local AT command response",
-                            XBEE_STATS_FRAME_LOCAL, txSequence, &receiveTime);
-
-      avrdude_message(MSG_NOTICE,
-                      "%s: xbeedev_poll(): Local command %c%c result code %d\n",
-                      progname, frame[4], frame[5], (int)frame[6]);
-
-      if (waitForSequence >= 0 && waitForSequence == txSequence)
-        /* Received result for our sequence numbered request */
-        return 0;
-    } else if (frameType == 0x8b && frameSize > 7) {
-      /* Transmit status */
-      unsigned char txSequence = frame[3];
-
-      xbeedev_stats_receive(xbs, "Transmit status", XBEE_STATS_FRAME_REMOTE,
-                            txSequence, &receiveTime);
-
-      avrdude_message(MSG_NOTICE2,
-                      "%s: xbeedev_poll(): Transmit status %d result code %d\n",
-                      progname, (int)frame[3], (int)frame[7]);
-    } else if (frameType == 0xa1 &&
-               frameSize >= XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
-               XBEE_ADDRESS_64BIT_LEN +
-               XBEE_ADDRESS_16BIT_LEN + 2 + XBEE_CHECKSUM_LEN) {
-      /* Route Record Indicator */
-      if (memcmp(&frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN],
-                 xbs->xbee_address, XBEE_ADDRESS_64BIT_LEN) != 0) {
-        /* Not from our target device */
-        avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
-                        "Route Record Indicator from other XBee\n");
-        continue;
-      }
+                    "%s: xbeedev_parse(): Bad checksum %d\n",
+                    progname, (int)checksum);
+    return 0;
+  }
 
-      /*
-       * We don't start out knowing what the 16-bit device address is,
-       * but we should receive it on the return packets, and re-use it
-       * from that point on.
-       */
-      {
-        const unsigned char *rx16Bit =
-          &frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
-                 XBEE_ADDRESS_64BIT_LEN];
-        xbeedev_record16Bit(xbs, rx16Bit);
-      }
+  return parser->frameSize;
+}
+
+/*
+ * Find the session awaiting the response to the local or remote AT
+ * command with the given frame sequence number, or NULL.
+ */
+static struct XBeeBootSession *xbeedev_at_find(struct XBeeBootSession *xbs,
+                                               unsigned char sequence,
+                                               int remote)
+{
+  for (xbs = xbs->primary; xbs != NULL; xbs = xbs->nextSession) {
+    if (xbs->atSequence != 0 && xbs->atSequence == sequence &&
+        xbs->atRemote == remote)
+      return xbs;
+  }
+
+  return NULL;
+}
+
+/*
+ * Returned by xbeedev_dispatch() when the frame was not the one
+ * being waited for.
+ */
+#define XBEE_DISPATCH_CONTINUE 1
+
+/*
+ * Act on one complete frame.  ACKs and replies are routed to the
+ * session they came from, whichever session we are waiting on.
+ *
+ * Return XBEE_DISPATCH_CONTINUE if this was not what we wait for.
+ * Return 0 on success.
+ * Return -1 on generic error.
+ * Return -512 + XBee AT Response code
+ */
+#define XBEE_AT_RETURN_CODE(x) (((x) >= -512 && (x) <= -256) ? (x) + 512 : -1)
+static int xbeedev_dispatch(struct XBeeBootSession *xbs,
+                            unsigned char *frame, unsigned int frameSize,
+                            int waitForAck, int waitForSequence)
+{
+  const unsigned char frameType = frame[2];
+
+  struct timeval receiveTime;
+  gettimeofday(&receiveTime, NULL);
 
-      const unsigned int header = XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
-        XBEE_ADDRESS_64BIT_LEN +
-        XBEE_ADDRESS_16BIT_LEN;
+  avrdude_message(MSG_NOTICE2,
+                  "%s: xbeedev_poll(): %lu.%06lu Received frame type %x\n",
+                  progname, (unsigned long)receiveTime.tv_sec,
+                  (unsigned long)receiveTime.tv_usec,
+                  (unsigned int)frameType);
+
+  if (frameType == 0x97 && frameSize > 16) {
+    /* Remote command response */
+    unsigned char txSequence = frame[3];
+    unsigned char resultCode = frame[16];
+
+    xbeedev_stats_receive(xbs->primary, "Remote AT command response",
+                          XBEE_STATS_FRAME_REMOTE, txSequence, &receiveTime);
+
+    avrdude_message(MSG_NOTICE,
+                    "%s: xbeedev_poll(): Remote command %d result code %d\n",
+                    progname, (int)txSequence, (int)resultCode);
+
+    struct XBeeBootSession *target = xbeedev_at_find(xbs, txSequence, 1);
+    if (target != NULL) {
+      /* Received result for the session's sequence numbered request */
+      target->atSequence = 0;
+      target->atStatus = resultCode;
+      target->atValue = 0;
+
+      /* Any value follows the status, before the checksum */
+      unsigned int index;
+      for (index = 17; index + XBEE_CHECKSUM_LEN < frameSize; index++)
+        target->atValue = target->atValue << 8 | frame[index];
+
+      if (waitForAck == XBEE_WAIT_ANY)
+        return 0;
+    }
+  } else if (frameType == 0x88 && frameSize > 6) {
+    /* Local command response */
+    unsigned char txSequence = frame[3];
+
+    xbeedev_stats_receive(xbs->primary, "Local AT command response",
+                          XBEE_STATS_FRAME_LOCAL, txSequence, &receiveTime);
+
+    avrdude_message(MSG_NOTICE,
+                    "%s: xbeedev_poll(): Local command %c%c result code %d\n",
+                    progname, frame[4], frame[5], (int)frame[6]);
+
+    struct XBeeBootSession *primary = xbeedev_at_find(xbs, txSequence, 0);
+    if (primary != NULL) {
+      /* Received result for our sequence numbered request */
+      primary->atSequence = 0;
+      primary->atStatus = frame[6];
+      primary->atValue = 0;
+
+      /* Any value follows the status, before the checksum */
+      unsigned int index;
+      for (index = 7; index + XBEE_CHECKSUM_LEN < frameSize; index++)
+        primary->atValue = primary->atValue << 8 | frame[index];
+
+      if (waitForAck == XBEE_WAIT_ANY)
+        return 0;
+    }
+  } else if (frameType == 0x8b && frameSize > 7) {
+    /* Transmit status */
+    unsigned char txSequence = frame[3];
 
-      const unsigned char receiveOptions = frame[header];
-      const unsigned char hops = frame[header + 1];
+    xbeedev_stats_receive(xbs->primary, "Transmit status",
+                          XBEE_STATS_FRAME_REMOTE,
+                          txSequence, &receiveTime);
 
+    avrdude_message(MSG_NOTICE2,
+                    "%s: xbeedev_poll(): Transmit status %d result code %d\n",
+                    progname, (int)frame[3], (int)frame[7]);
+
+    if (waitForSequence >= 0 && waitForSequence == txSequence)
+      /* Delivery status for our sequence numbered request */
+      return -512 + frame[7];
+  } else if (frameType == 0xa1 &&
+             frameSize >= XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
+             XBEE_ADDRESS_64BIT_LEN +
+             XBEE_ADDRESS_16BIT_LEN + 2 + XBEE_CHECKSUM_LEN) {
+    /* Route Record Indicator */
+    struct XBeeBootSession *target =
+      xbeedev_find(xbs, &frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN]);
+    if (target == NULL) {
+      /* Not from our target device */
       avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
-                      "Route Record Indicator from target XBee: "
-                      "hops=%d options=%d\n",
-                      progname, (int)hops, (int)receiveOptions);
+                      "Route Record Indicator from other XBee\n");
+      return XBEE_DISPATCH_CONTINUE;
+    }
 
-      if (frameSize < header + 2 + hops * 2 + XBEE_CHECKSUM_LEN)
-        /* Bounds check: Frame is too small */
-        continue;
+    /*
+     * We don't start out knowing what the 16-bit device address is,
+     * but we should receive it on the return packets, and re-use it
+     * from that point on.
+     */
+    {
+      const unsigned char *rx16Bit =
+        &frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
+               XBEE_ADDRESS_64BIT_LEN];
+      xbeedev_record16Bit(target, rx16Bit);
+    }
 
-      const unsigned int tableOffset = header + 2;
+    const unsigned int header = XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
+      XBEE_ADDRESS_64BIT_LEN +
+      XBEE_ADDRESS_16BIT_LEN;
 
-      unsigned char index;
-      for (index = 0; index < hops; index++) {
-        avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
-                        "Route Intermediate Hop %d : %02x%02x\n",
-                        progname, (int)index,
-                        (int)frame[tableOffset + index * 2],
-                        (int)frame[tableOffset + index * 2 + 1]);
-      }
+    const unsigned char receiveOptions = frame[header];
+    const unsigned char hops = frame[header + 1];
 
-      if (hops <= XBEE_MAX_INTERMEDIATE_HOPS) {
-        if (xbs->sourceRouteHops != (int)hops ||
-            memcmp(&frame[tableOffset], xbs->sourceRoute, hops * 2) != 0) {
-          memcpy(xbs->sourceRoute, &frame[tableOffset], hops * 2);
-          xbs->sourceRouteHops = hops;
-          xbs->sourceRouteChanged = 1;
+    avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
+                    "Route Record Indicator from target XBee: "
+                    "hops=%d options=%d\n",
+                    progname, (int)hops, (int)receiveOptions);
 
-          avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
-                          "Route has changed\n",
-                          progname);
-        }
+    if (frameSize < header + 2 + hops * 2 + XBEE_CHECKSUM_LEN)
+      /* Bounds check: Frame is too small */
+      return XBEE_DISPATCH_CONTINUE;
+
+    const unsigned int tableOffset = header + 2;
+
+    unsigned char index;
+    for (index = 0; index < hops; index++) {
+      avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
+                      "Route Intermediate Hop %d : %02x%02x\n",
+                      progname, (int)index,
+                      (int)frame[tableOffset + index * 2],
+                      (int)frame[tableOffset + index * 2 + 1]);
+    }
+
+    if (hops <= XBEE_MAX_INTERMEDIATE_HOPS) {
+      if (target->sourceRouteHops != (int)hops ||
+          memcmp(&frame[tableOffset], target->sourceRoute, hops * 2) != 0) {
+        memcpy(target->sourceRoute, &frame[tableOffset], hops * 2);
+        target->sourceRouteHops = hops;
+        target->sourceRouteChanged = 1;
+
+        avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
+                        "Route has changed\n",
+                        progname);
       }
-    } else if (frameType == 0x10 || frameType == 0x90) {
-      unsigned char *dataStart;
-      unsigned int dataLength;
-
-      if (frameType == 0x10) {
-        /* Direct mode frame */
-        const unsigned int header = XBEE_LENGTH_LEN +
-          XBEE_APITYPE_LEN + XBEE_APISEQUENCE_LEN +
-          XBEE_ADDRESS_64BIT_LEN + XBEE_ADDRESS_16BIT_LEN +
-          XBEE_RADIUS_LEN + XBEE_TXOPTIONS_LEN;
-
-        if (frameSize <= header + XBEE_CHECKSUM_LEN)
-          /* Bounds check: Frame is too small */
-          continue;
-
-        dataLength = frameSize - header - XBEE_CHECKSUM_LEN;
-        dataStart = &frame[header];
-      } else {
-        /* Remote reply frame */
-        const unsigned int header = XBEE_LENGTH_LEN +
-          XBEE_APITYPE_LEN + XBEE_ADDRESS_64BIT_LEN + XBEE_ADDRESS_16BIT_LEN +
-          XBEE_RXOPTIONS_LEN;
+    }
+  } else if (frameType == 0x10 || frameType == 0x90) {
+    struct XBeeBootSession *target = xbs;
+    unsigned char *dataStart;
+    unsigned int dataLength;
+
+    if (frameType == 0x10) {
+      /* Direct mode frame */
+      const unsigned int header = XBEE_LENGTH_LEN +
+        XBEE_APITYPE_LEN + XBEE_APISEQUENCE_LEN +
+        XBEE_ADDRESS_64BIT_LEN + XBEE_ADDRESS_16BIT_LEN +
+        XBEE_RADIUS_LEN + XBEE_TXOPTIONS_LEN;
+
+      if (frameSize <= header + XBEE_CHECKSUM_LEN)
+        /* Bounds check: Frame is too small */
+        return XBEE_DISPATCH_CONTINUE;
 
-        if (frameSize <= header + XBEE_CHECKSUM_LEN)
-          /* Bounds check: Frame is too small */
-          continue;
+      dataLength = frameSize - header - XBEE_CHECKSUM_LEN;
+      dataStart = &frame[header];
+    } else {
+      /* Remote reply frame */
+      const unsigned int header = XBEE_LENGTH_LEN +
+        XBEE_APITYPE_LEN + XBEE_ADDRESS_64BIT_LEN + XBEE_ADDRESS_16BIT_LEN +
+        XBEE_RXOPTIONS_LEN;
 
-        dataLength = frameSize - header - XBEE_CHECKSUM_LEN;
-        dataStart = &frame[header];
+      if (frameSize <= header + XBEE_CHECKSUM_LEN)
+        /* Bounds check: Frame is too small */
+        return XBEE_DISPATCH_CONTINUE;
 
-        if (memcmp(&frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN],
-                   xbs->xbee_address, XBEE_ADDRESS_64BIT_LEN) != 0) {
-          /*
-           * This packet is not from our target device.  Unlikely
-           * to ever happen, but if it does we have to ignore
-           * it.
-           */
-          continue;
-        }
+      dataLength = frameSize - header - XBEE_CHECKSUM_LEN;
+      dataStart = &frame[header];
 
+      target = xbeedev_find(xbs, &frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN]);
+      if (target == NULL) {
         /*
-         * We don't start out knowing what the 16-bit device address
-         * is, but we should receive it on the return packets, and
-         * re-use it from that point on.
+         * This packet is not from any of our target devices.
+         * Unlikely to ever happen, but if it does we have to
+         * ignore it.
          */
-        {
-          const unsigned char *rx16Bit =
-            &frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
-                   XBEE_ADDRESS_64BIT_LEN];
-          xbeedev_record16Bit(xbs, rx16Bit);
-        }
+        return XBEE_DISPATCH_CONTINUE;
       }
 
-      if (dataLength >= 2) {
-        const unsigned char protocolType = dataStart[0];
-        const unsigned char sequence = dataStart[1];
+      /*
+       * We don't start out knowing what the 16-bit device address
+       * is, but we should receive it on the return packets, and
+       * re-use it from that point on.
+       */
+      {
+        const unsigned char *rx16Bit =
+          &frame[XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
+                 XBEE_ADDRESS_64BIT_LEN];
+        xbeedev_record16Bit(target, rx16Bit);
+      }
+    }
 
-        avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
-                        "%lu.%06lu Packet %d #%d\n",
-                        progname, (unsigned long)receiveTime.tv_sec,
-                        (unsigned long)receiveTime.tv_usec,
-                        (int)protocolType, (int)sequence);
+    if (dataLength >= 2) {
+      const unsigned char protocolType = dataStart[0];
+      const unsigned char sequence = dataStart[1];
 
-        if (protocolType == XBEEBOOT_PACKET_TYPE_ACK) {
-          /* ACK */
-          xbeedev_stats_receive(xbs, "XBeeBoot ACK",
-                                XBEE_STATS_TRANSMIT, sequence,
-                                &receiveTime);
+      avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
+                      "%lu.%06lu Packet %d #%d\n",
+                      progname, (unsigned long)receiveTime.tv_sec,
+                      (unsigned long)receiveTime.tv_usec,
+                      (int)protocolType, (int)sequence);
+
+      /* A REPLY_ACK carries an ACK in its last byte */
+      int ackSequence = -1;
+      if (protocolType == XBEEBOOT_PACKET_TYPE_ACK)
+        ackSequence = sequence;
+      else if (protocolType == XBEEBOOT_PACKET_TYPE_REPLY_ACK &&
+               dataLength >= 5)
+        ackSequence = dataStart[--dataLength];
+
+      int acked = 0;
+      if (ackSequence >= 0) {
+        /* ACK */
+        xbeedev_stats_receive(target, "XBeeBoot ACK",
+                              XBEE_STATS_TRANSMIT, ackSequence,
+                              &receiveTime);
 
-          /*
-           * We can't update outSequence here, we already do that
-           * somewhere else.
-           */
-          if (waitForAck >= 0 && waitForAck == sequence)
-            return 0;
-        } else if (protocolType == XBEEBOOT_PACKET_TYPE_REQUEST &&
-                   dataLength >= 4 && dataStart[2] == 24) {
-          /* REQUEST FRAME_REPLY */
-          xbeedev_stats_receive(xbs, "XBeeBoot Receive", XBEE_STATS_RECEIVE,
-                                sequence, &receiveTime);
+        /*
+         * We can't update outSequence here, we already do that
+         * somewhere else.
+         */
+        target->lastAckSequence = ackSequence;
+        if (xbeedev_window_ack(target))
+          xbeedev_progress(target, &receiveTime);
 
-          unsigned char nextSequence = xbs->inSequence;
-          while ((++nextSequence & 0xff) == 0);
-          if (sequence == nextSequence) {
-            xbs->inSequence = nextSequence;
-
-            const size_t textLength = dataLength - 3;
-            size_t index;
-            for (index = 0; index < textLength; index++) {
-              const unsigned char data = dataStart[3 + index];
-              if (buflen != NULL && *buflen > 0) {
-                /* If we are receiving right now, and have a buffer... */
-                *(*buf)++ = data;
-                (*buflen)--;
-              } else {
-                xbs->inBuffer[xbs->inInIndex++] = data;
-                if (xbs->inInIndex == sizeof(xbs->inBuffer))
-                  xbs->inInIndex = 0;
-                if (xbs->inInIndex == xbs->inOutIndex) {
-                  /* Should be impossible */
-                  avrdude_message(MSG_INFO, "%s: Buffer overrun\n", progname);
-                  xbs->transportUnusable = 1;
-                  return -1;
-                }
-              }
+        acked = waitForAck == XBEE_WAIT_ANY ||
+          (target == xbs && waitForAck >= 0 && waitForAck == ackSequence);
+      }
+
+      if (protocolType == XBEEBOOT_PACKET_TYPE_ACK) {
+        if (acked)
+          return 0;
+      } else if ((protocolType == XBEEBOOT_PACKET_TYPE_REQUEST ||
+                  protocolType == XBEEBOOT_PACKET_TYPE_REPLY_ACK) &&
+                 dataLength >= 4 && dataStart[2] == 24) {
+        /* REQUEST FRAME_REPLY */
+        xbeedev_stats_receive(target, "XBeeBoot Receive",
+                              XBEE_STATS_RECEIVE,
+                              sequence, &receiveTime);
+
+        unsigned char nextSequence = target->inSequence;
+        while ((++nextSequence & 0xff) == 0);
+        if (sequence == nextSequence) {
+          target->inSequence = nextSequence;
+
+          const size_t textLength = dataLength - 3;
+          size_t index;
+          for (index = 0; index < textLength; index++) {
+            target->inBuffer[target->inInIndex++] = dataStart[3 + index];
+            if (target->inInIndex == sizeof(target->inBuffer))
+              target->inInIndex = 0;
+            if (target->inInIndex == target->inOutIndex) {
+              /* Should be impossible */
+              avrdude_message(MSG_INFO, "%s: Buffer overrun\n", progname);
+              target->transportUnusable = 1;
+              return -1;
             }
+          }
 
+          if (target->piggyback) {
+            /* Hold the ACK back for our next FIRMWARE_DELIVER */
+            target->ackPending = 1;
+            xbeedev_add_ms(&target->ackDeadline, &receiveTime,
+                           XBEE_ACK_DELAY_MS);
+          } else {
             /*avrdude_message(MSG_INFO, "ACK %x\n", (unsigned int)sequence);*/
-            sendPacket(xbs, "Transmit Request ACK for RECEIVE",
+            sendPacket(target, "Transmit Request ACK for RECEIVE",
                        XBEEBOOT_PACKET_TYPE_ACK, sequence,
                        XBEE_STATS_NOT_RETRY,
                        -1, 0, NULL);
-
-            if (buf != NULL && *buflen == 0)
-              /* Input buffer has been filled */
-              return 0;
-
-            /*
-             * Input buffer has NOT been filled, we are still in a
-             * receive.  Not a retry, this is the first point we know
-             * for sure for this sequence number.
-             */
-            while ((++nextSequence & 0xff) == 0);
-            xbeedev_stats_send(xbs, "poll() implies pending RECEIVE",
-                               nextSequence,
-                               XBEE_STATS_RECEIVE,
-                               nextSequence, XBEE_STATS_NOT_RETRY,
-                               &receiveTime);
           }
+
+          xbeedev_progress(target, &receiveTime);
+
+          /*
+           * There may be more to come.  Not a retry, this is the
+           * first point we know for sure for this sequence number.
+           */
+          while ((++nextSequence & 0xff) == 0);
+          xbeedev_stats_send(target, "poll() implies pending RECEIVE",
+                             nextSequence,
+                             XBEE_STATS_RECEIVE,
+                             nextSequence, XBEE_STATS_NOT_RETRY,
+                             &receiveTime);
+
+          if (waitForAck == XBEE_WAIT_ANY)
+            return 0;
         }
+
+        if (acked)
+          return 0;
+      } else if (protocolType == XBEEBOOT_PACKET_TYPE_FLEET_NACK &&
+                 dataLength == sizeof(target->fleetNack)) {
+        /* FLEET_NACK, not ACK'd */
+        memcpy(target->fleetNack, dataStart, dataLength);
+        target->fleetNackValid = 1;
+
+        if (waitForAck == XBEE_WAIT_ANY)
+          return 0;
       }
     }
   }
+
+  return XBEE_DISPATCH_CONTINUE;
+}
+
+/*
+ * Read and dispatch frames until the one being waited for arrives.
+ *
+ * Return 0 on success.
+ * Return -1 on generic error (normally serial timeout).
+ * Return -512 + XBee AT Response code
+ */
+static int xbeedev_poll(struct XBeeBootSession *xbs,
+                        int waitForAck,
+                        int waitForSequence)
+{
+  for (;;) {
+    unsigned char byte;
+    const int rc = xbeedev_getbyte(xbs, &byte);
+    if (rc < 0)
+      return rc;
+
+    const unsigned int frameSize = xbeedev_parse(xbs, byte);
+    if (frameSize == 0)
+      continue;
+
+    const int dispatchRc = xbeedev_dispatch(xbs, xbs->primary->parser.frame,
+                                            frameSize,
+                                            waitForAck, waitForSequence);
+    if (dispatchRc != XBEE_DISPATCH_CONTINUE)
+      return dispatchRc;
+  }
 }
 
 /*
@@ -962,8 +1931,9 @@ static int localAsyncAT(struct XBeeBootSession *xbs, char const *detail,
      */
     return 0;
 
-  while ((++xbs->txSequence & 0xff) == 0);
-  const unsigned char sequence = xbs->txSequence;
+  struct XBeeBootSession *primary = xbs->primary;
+  while ((++primary->txSequence & 0xff) == 0);
+  const unsigned char sequence = primary->txSequence;
 
   unsigned char buf[3];
   size_t length = 0;
@@ -978,7 +1948,8 @@ static int localAsyncAT(struct XBeeBootSession *xbs, char const *detail,
                   progname, at1, at2);
 
   /* Local AT command 0x08 */
-  int rc = sendAPIRequest(xbs, 0x08, sequence, -1, -1, -1, -1, -1, -1,
+  int rc = sendAPIRequest(xbs, NULL, 0x08, sequence,
+                          -1, -1, -1, -1, -1, -1,
                           detail, -1, XBEE_STATS_FRAME_LOCAL,
                           XBEE_STATS_NOT_RETRY,
                           length, buf);
@@ -990,77 +1961,220 @@ static int localAsyncAT(struct XBeeBootSession *xbs, char const *detail,
   return (int)sequence;
 }
 
-static int localAT(struct XBeeBootSession *xbs, char const *detail,
-                   unsigned char at1, unsigned char at2, int value)
+/*
+ * Send the session's AT command, or send it again.
+ */
+static int xbeedev_at_transmit(struct XBeeBootSession *xbs,
+                               xbee_stat_is_retry retry)
+{
+  if (xbs->atRemote)
+    /* Remote AT command 0x17 with Apply Changes 0x02 */
+    return sendAPIRequest(xbs, NULL, 0x17, xbs->atSequence, -1,
+                          -1, -1, -1,
+                          0x02, -1,
+                          xbs->atDetail, -1, XBEE_STATS_FRAME_REMOTE,
+                          retry, xbs->atLength, xbs->atCommand);
+
+  /* Local AT command 0x08 */
+  return sendAPIRequest(xbs, NULL, 0x08, xbs->atSequence,
+                        -1, -1, -1, -1, -1, -1,
+                        xbs->atDetail, -1, XBEE_STATS_FRAME_LOCAL,
+                        retry, xbs->atLength, xbs->atCommand);
+}
+
+/*
+ * Start an AT command, local on the primary session or remote to the
+ * session's target.  xbeedev_events() resends it until the response
+ * arrives, or gives up, leaving atSequence zero either way.
+ */
+static int xbeedev_at_start(struct XBeeBootSession *xbs, int remote,
+                            char const *detail,
+                            unsigned char at1, unsigned char at2, int value)
 {
-  int result = localAsyncAT(xbs, detail, at1, at2, value);
+  if (!remote)
+    xbs = xbs->primary;
 
-  if (result <= 0)
-    /* Failure, or success without a sequence number */
-    return result;
+  struct XBeeBootSession *primary = xbs->primary;
+  while ((++primary->txSequence & 0xff) == 0);
 
-  unsigned char sequence = (unsigned char)result;
+  xbs->atSequence = primary->txSequence;
+  xbs->atRemote = remote;
+  xbs->atDetail = detail;
+  xbs->atTries = 1;
+  xbs->atStatus = -1;
+  xbs->atValue = 0;
 
-  int retries;
-  for (retries = 0; retries < 5; retries++) {
-    const int rc = xbeedev_poll(xbs, NULL, NULL, -1, sequence);
-    if (rc == 0)
-      return 0;
+  xbs->atLength = 0;
+  xbs->atCommand[xbs->atLength++] = at1;
+  xbs->atCommand[xbs->atLength++] = at2;
+
+  if (value >= 0)
+    xbs->atCommand[xbs->atLength++] = (unsigned char)value;
+
+  avrdude_message(MSG_NOTICE, "%s: %s AT command: %c%c\n",
+                  progname, remote ? "Remote" : "Local", at1, at2);
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  xbeedev_add_ms(&xbs->atDeadline, &now,
+                 remote ? XBEE_REMOTE_AT_TIMEOUT_MS : XBEE_LOCAL_AT_TIMEOUT_MS);
+
+  const int rc = xbeedev_at_transmit(xbs, XBEE_STATS_NOT_RETRY);
+  if (rc < 0)
+    xbs->atSequence = 0;
+
+  return rc;
+}
+
+/*
+ * The AT command's response is overdue: send it again, or give up
+ * once it has been sent often enough.
+ */
+static int xbeedev_at_retry(struct XBeeBootSession *xbs,
+                            struct timeval const *now)
+{
+  if (xbs->atTries++ >= (xbs->atRemote ? XBEE_REMOTE_AT_TRIES :
+                         XBEE_LOCAL_AT_TRIES)) {
+    xbs->atSequence = 0;
+    return 0;
   }
 
-  return -1;
+  xbeedev_add_ms(&xbs->atDeadline, now,
+                 xbs->atRemote ? XBEE_REMOTE_AT_TIMEOUT_MS :
+                 XBEE_LOCAL_AT_TIMEOUT_MS);
+
+  const int rc = xbeedev_at_transmit(xbs, XBEE_STATS_IS_RETRY);
+  if (rc < 0)
+    xbs->atSequence = 0;
+
+  return rc;
+}
+
+static int xbeedev_events(struct XBeeBootSession *xbs);
+
+/*
+ * Run the session engine until every session's AT command has been
+ * answered or given up on.
+ */
+static int xbeedev_at_wait(struct XBeeBootSession *xbs)
+{
+  xbs = xbs->primary;
+
+  for (;;) {
+    struct XBeeBootSession *session;
+    for (session = xbs; session != NULL; session = session->nextSession) {
+      if (session->atSequence != 0)
+        break;
+    }
+
+    if (session == NULL)
+      return 0;
+
+    const int rc = xbeedev_events(xbs);
+    if (rc < 0)
+      return rc;
+  }
 }
 
 /*
+ * The outcome of the session's last AT command.
  * Return 0 on success.
  * Return -1 on generic error (normally serial timeout).
  * Return -512 + XBee AT Response code
  */
-static int sendAT(struct XBeeBootSession *xbs, char const *detail,
-                  unsigned char at1, unsigned char at2, int value)
+static int xbeedev_at_result(struct XBeeBootSession const *xbs)
+{
+  if (xbs->atStatus < 0)
+    return -1;
+
+  return xbs->atStatus == 0 ? 0 : -512 + xbs->atStatus;
+}
+
+/*
+ * Return 0 once the local XBee has responded, whatever the status.
+ * Return -1 on failure.
+ */
+static int localAT(struct XBeeBootSession *xbs, char const *detail,
+                   unsigned char at1, unsigned char at2, int value)
 {
   if (xbs->directMode)
     /*
-     * Remote XBee AT commands make no sense in direct mode - there is
+     * Local XBee AT commands make no sense in direct mode - there is
      * no XBee device to communicate with.
      */
     return 0;
 
-  while ((++xbs->txSequence & 0xff) == 0);
-  const unsigned char sequence = xbs->txSequence;
+  const int startRc = xbeedev_at_start(xbs, 0, detail, at1, at2, value);
+  if (startRc < 0)
+    return startRc;
 
-  unsigned char buf[3];
-  size_t length = 0;
+  const int waitRc = xbeedev_at_wait(xbs);
+  if (waitRc < 0)
+    return waitRc;
 
-  buf[length++] = at1;
-  buf[length++] = at2;
+  return xbs->primary->atStatus < 0 ? -1 : 0;
+}
 
-  if (value >= 0)
-    buf[length++] = (unsigned char)value;
+/*
+ * Query a local XBee register, returning its value, or a negative
+ * value on failure.
+ */
+static long localATValue(struct XBeeBootSession *xbs, char const *detail,
+                         unsigned char at1, unsigned char at2)
+{
+  struct XBeeBootSession *primary = xbs->primary;
+  primary->atStatus = -1;
 
-  avrdude_message(MSG_NOTICE,
-                  "%s: Remote AT command: %c%c\n", progname, at1, at2);
+  const int rc = localAT(xbs, detail, at1, at2, -1);
+  if (rc < 0)
+    return rc;
 
-  /* Remote AT command 0x17 with Apply Changes 0x02 */
-  sendAPIRequest(xbs, 0x17, sequence, -1,
-                 -1, -1, -1,
-                 0x02, -1,
-                 detail, -1, XBEE_STATS_FRAME_REMOTE,
-                 XBEE_STATS_NOT_RETRY,
-                 length, buf);
+  if (primary->atStatus != 0)
+    return -1;
 
-  int retries;
-  for (retries = 0; retries < 30; retries++) {
-    const int rc = xbeedev_poll(xbs, NULL, NULL, -1, sequence);
-    const int xbeeRc = XBEE_AT_RETURN_CODE(rc);
-    if (xbeeRc == 0)
-      /* Translate to normal success code */
-      return 0;
-    if (rc != -1)
+  return primary->atValue;
+}
+
+/*
+ * Wait for the remote AT commands started on every target.  Returns
+ * as xbeedev_at_result(), with the first failure of any target.
+ */
+static int xbeedev_at_wait_all(struct XBeeBootSession *xbs)
+{
+  const int waitRc = xbeedev_at_wait(xbs);
+  if (waitRc < 0)
+    return waitRc;
+
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    const int rc = xbeedev_at_result(session);
+    if (rc < 0)
       return rc;
   }
 
-  return -1;
+  return 0;
+}
+
+/*
+ * Send the same remote AT command to every target at once, so that a
+ * slow target holds up the others no longer than it takes itself.
+ * Returns as xbeedev_at_result().
+ */
+static int sendATAll(struct XBeeBootSession *xbs, char const *detail,
+                     unsigned char at1, unsigned char at2, int value)
+{
+  if (xbs->directMode)
+    return 0;
+
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    const int startRc =
+      xbeedev_at_start(session, 1, detail, at1, at2, value);
+    if (startRc < 0)
+      return startRc;
+  }
+
+  return xbeedev_at_wait_all(xbs);
 }
 
 /*
@@ -1094,10 +2208,91 @@ static int xbeeATError(int rc) {
   return 1;
 }
 
+static void xbeedev_free_sessions(struct XBeeBootSession *xbs)
+{
+  while (xbs != NULL) {
+    struct XBeeBootSession *next = xbs->nextSession;
+    free(xbs->shadow);
+    free(xbs->shadowValid);
+    free(xbs->pageCrc);
+    free(xbs->pageCrcValid);
+    free(xbs->fleetImage);
+    free(xbs->fleetSent);
+    free(xbs->fleetMissing);
+    free(xbs);
+    xbs = next;
+  }
+}
+
 static void xbeedev_free(struct XBeeBootSession *xbs)
 {
   xbs->serialDevice->close(&xbs->serialDescriptor);
-  free(xbs);
+  xbeedev_free_sessions(xbs);
+}
+
+/*
+ * Format the session's 64-bit XBee address as hexadecimal into text,
+ * of XBEE_ADDRESS_STRING_LEN characters, and return it.
+ */
+static const char *xbeedev_address_string(struct XBeeBootSession const *xbs,
+                                          char *text)
+{
+  size_t index;
+  for (index = 0; index < XBEE_ADDRESS_64BIT_LEN; index++)
+    sprintf(&text[2 * index], "%02x", (unsigned int)xbs->xbee_address[index]);
+
+  return text;
+}
+
+/*
+ * Parse a 16 character hexadecimal 64-bit XBee address, which must
+ * span exactly from start to end.
+ */
+static int xbeedev_parse_address(struct XBeeBootSession *xbs,
+                                 char const *start, char const *end)
+{
+  size_t addrIndex = 0;
+  int nybble = -1;
+  char const *address = start;
+  while (address != end) {
+    char hex = *address++;
+    unsigned int val;
+    if (hex >= '0' && hex <= '9') {
+      val = hex - '0';
+    } else if (hex >= 'A' && hex <= 'F') {
+      val = hex - 'A' + 10;
+    } else if  (hex >= 'a' && hex <= 'f') {
+      val = hex - 'a' + 10;
+    } else {
+      break;
+    }
+    if (nybble == -1) {
+      nybble = val;
+    } else {
+      xbs->xbee_address[addrIndex++] = (nybble * 16) | val;
+      nybble = -1;
+      if (addrIndex == 8)
+        break;
+    }
+  }
+
+  if (addrIndex != 8 || address != end || nybble != -1) {
+    avrdude_message(MSG_INFO,
+                    "%s: XBee: Bad XBee address: "
+                    "require 16-character hexadecimal address\"\n",
+                    progname);
+    return -1;
+  }
+
+  /* Unknown 16 bit address */
+  xbs->xbee_address[8] = 0xff;
+  xbs->xbee_address[9] = 0xfe;
+
+  char text[XBEE_ADDRESS_STRING_LEN];
+  avrdude_message(MSG_TRACE, "%s: XBee address: %s\n",
+                  progname, xbeedev_address_string(xbs, text));
+
+  return 0;
 }
 
 static void xbeedev_close(union filedescriptor *fdp)
@@ -1114,6 +2309,10 @@ static int xbeedev_open(char *port, union pinfo pinfo,
    *
    * -P <XBeeAddress>@[serialdevice]
    *
+   * ... or, to program several targets in lockstep ...
+   *
+   * -P <XBeeAddress>,<XBeeAddress>[,...]@[serialdevice]
+   *
    * ... or ...
    *
    * -P @[serialdevice]
@@ -1143,61 +2342,47 @@ static int xbeedev_open(char *port, union pinfo pinfo,
   if (ttySeparator == port) {
     /* Direct connection */
     memset(xbs->xbee_address, 0, 8);
+    xbs->xbee_address[8] = 0xff;
+    xbs->xbee_address[9] = 0xfe;
     xbs->directMode = 1;
   } else {
-    size_t addrIndex = 0;
-    int nybble = -1;
+    xbs->directMode = 0;
+
+    struct XBeeBootSession *session = xbs;
     char const *address = port;
-    while (address != ttySeparator) {
-      char hex = *address++;
-      unsigned int val;
-      if (hex >= '0' && hex <= '9') {
-        val = hex - '0';
-      } else if (hex >= 'A' && hex <= 'F') {
-        val = hex - 'A' + 10;
-      } else if  (hex >= 'a' && hex <= 'f') {
-        val = hex - 'a' + 10;
-      } else {
-        break;
-      }
-      if (nybble == -1) {
-        nybble = val;
-      } else {
-        xbs->xbee_address[addrIndex++] = (nybble * 16) | val;
-        nybble = -1;
-        if (addrIndex == 8)
-          break;
+    for (;;) {
+      char const *end = strchr(address, ',');
+      if (end == NULL || end > ttySeparator)
+        end = ttySeparator;
+
+      if (xbeedev_parse_address(session, address, end) < 0) {
+        xbeedev_free_sessions(xbs);
+        return -1;
       }
-    }
 
-    if (addrIndex != 8 || address != ttySeparator || nybble != -1) {
-      avrdude_message(MSG_INFO,
-                      "%s: XBee: Bad XBee address: "
-                      "require 16-character hexadecimal address\"\n",
-                      progname);
-      free(xbs);
-      return -1;
-    }
+      if (end == ttySeparator)
+        break;
 
-    xbs->directMode = 0;
-  }
+      /* Another target, to be programmed in lockstep */
+      address = end + 1;
 
-  /* Unknown 16 bit address */
-  xbs->xbee_address[8] = 0xff;
-  xbs->xbee_address[9] = 0xfe;
+      struct XBeeBootSession *next = malloc(sizeof(struct XBeeBootSession));
+      if (next == NULL) {
+        avrdude_message(MSG_INFO, "%s: xbeedev_open(): out of memory\n",
+                        progname);
+        xbeedev_free_sessions(xbs);
+        return -1;
+      }
 
-  avrdude_message(MSG_TRACE,
-                  "%s: XBee address: %02x%02x%02x%02x%02x%02x%02x%02x\n",
-                  progname,
-                  (unsigned int)xbs->xbee_address[0],
-                  (unsigned int)xbs->xbee_address[1],
-                  (unsigned int)xbs->xbee_address[2],
-                  (unsigned int)xbs->xbee_address[3],
-                  (unsigned int)xbs->xbee_address[4],
-                  (unsigned int)xbs->xbee_address[5],
-                  (unsigned int)xbs->xbee_address[6],
-                  (unsigned int)xbs->xbee_address[7]);
+      XBeeBootSessionInit(next);
+      next->primary = xbs;
+      next->directMode = 0;
+      session->nextSession = next;
+      session = next;
+    }
+  }
 
+  int defaultBaud = 0;
   if (pinfo.baud) {
     /*
      * User supplied the correct baud rate.
@@ -1233,8 +2418,12 @@ static int xbeedev_open(char *port, union pinfo pinfo,
      * to the XBee device, not the far-end device, so it's the local
      * XBee baud rate we should select.  The baud rate of the AVR
      * device is irrelevant.
+     *
+     * Given xbeelocalbaud, once it answers, xbeedev_localbaud()
+     * moves the XBee and the port to a faster rate for the session.
      */
     pinfo.baud = 9600;
+    defaultBaud = 1;
   }
 
   avrdude_message(MSG_NOTICE, "%s: Baud %ld\n", progname, (long)pinfo.baud);
@@ -1243,15 +2432,38 @@ static int xbeedev_open(char *port, union pinfo pinfo,
     const int rc = xbs->serialDevice->open(tty, pinfo,
                                            &xbs->serialDescriptor);
     if (rc < 0) {
-      free(xbs);
+      xbeedev_free_sessions(xbs);
       return rc;
     }
+
+    /* All targets share the one serial port */
+    struct XBeeBootSession *session;
+    for (session = xbs->nextSession; session != NULL;
+         session = session->nextSession) {
+      session->serialDevice = xbs->serialDevice;
+      session->serialDescriptor = xbs->serialDescriptor;
+    }
   }
 
   if (!xbs->directMode) {
     /* Attempt to ensure the local XBee is in API mode 2 */
     {
-      const int rc = localAT(xbs, "AT AP=2", 'A', 'P', 2);
+      int rc = localAT(xbs, "AT AP=2", 'A', 'P', 2);
+      if (rc < 0 && defaultBaud && xbs->serialDevice->setspeed != NULL &&
+          xbs->serialDevice->setspeed(&xbs->serialDescriptor,
+                                      xbeeBaudRates[XBEE_MAX_BD]) == 0) {
+        /*
+         * A session that raised BD but never got to put it back
+         * leaves the XBee at the fastest rate.  Put it back this time.
+         */
+        rc = localAT(xbs, "AT AP=2", 'A', 'P', 2);
+        if (rc == 0) {
+          avrdude_message(MSG_INFO, "%s: Local XBee found at %ld baud\n",
+                          progname, xbeeBaudRates[XBEE_MAX_BD]);
+          xbs->localBaud = 3; /* 9600 */
+        }
+      }
+
       if (rc < 0) {
         avrdude_message(MSG_INFO, "%s: Local XBee is not responding.\n",
                         progname);
@@ -1260,6 +2472,29 @@ static int xbeedev_open(char *port, union pinfo pinfo,
       }
     }
 
+    /*
+     * Find the largest packet the local XBee will send unfragmented.
+     * NP allows for network encryption (EE), but not for APS
+     * encryption, which applies to every packet when the TO transmit
+     * options say so.  Older firmware lacks TO, and only encrypts
+     * packets that ask for it, as ours don't.
+     */
+    {
+      const long np = localATValue(xbs, "AT NP", 'N', 'P');
+      const long to = localATValue(xbs, "AT TO", 'T', 'O');
+
+      if (np > 3) {
+        xbs->localPayload = np - 3 /* XBeeBoot header */;
+        if (to > 0 && (to & 0x20) != 0 &&
+            xbs->localPayload > XBEE_APS_OVERHEAD)
+          xbs->localPayload -= XBEE_APS_OVERHEAD;
+      }
+
+      avrdude_message(MSG_NOTICE, "%s: Local XBee NP=%ld TO=%ld, "
+                      "up to %u bytes per packet\n",
+                      progname, np, to, xbs->localPayload);
+    }
+
     /*
      * At this point we want to set the remote XBee parameters as
      * required for talking to XBeeBoot.  Ideally we would start with
@@ -1303,14 +2538,15 @@ static int xbeedev_open(char *port, union pinfo pinfo,
 
     /*
      * Disable RTS input on the remote XBee, just in case it is
-     * enabled by default.  XBeeBoot doesn't attempt to support flow
-     * control, and so it may not correctly drive this pin if RTS mode
-     * is the default configuration.
+     * enabled by default.  Most XBeeBoot builds don't support flow
+     * control, and so may not correctly drive this pin if RTS mode
+     * is the default configuration.  Those that do are found by
+     * xbee_getcapabilities().
      *
      * XBee IO port 6 is the only pin that supports RTS mode, so there
      * is no need to support any alternative pin.
      */
-    const int rc = sendAT(xbs, "AT D6=0", 'D', '6', 0);
+    const int rc = sendATAll(xbs, "AT D6=0", 'D', '6', 0);
     if (rc < 0) {
       xbeedev_free(xbs);
 
@@ -1328,312 +2564,1956 @@ static int xbeedev_open(char *port, union pinfo pinfo,
   return 0;
 }
 
-static int xbeedev_send(union filedescriptor *fdp,
-                        const unsigned char *buf, size_t buflen)
+/*
+ * Check that the local XBee still answers on the serial port, in the
+ * API mode we expect.
+ */
+static int xbeedev_check_local(struct XBeeBootSession *xbs)
+{
+  return localATValue(xbs, "AT AP", 'A', 'P') == xbs->apiMode ? 0 : -1;
+}
+
+/*
+ * Raise the rate of the serial port to the local XBee to that of BD
+ * setting bd, if it is currently lower.  The XBee answers the AT BD
+ * at the old rate, then changes.  If it can't be found at the new
+ * rate, we go back to the old one.  xbee_close() restores the BD.
+ */
+static int xbeedev_localbaud(union filedescriptor *fdp, int bd)
 {
   struct XBeeBootSession *xbs = xbeebootsession(fdp);
 
-  if (xbs->transportUnusable)
-    /* Don't attempt to continue on an unusable transport layer */
-    return -1;
+  if (bd < 0 || xbs->directMode || xbs->serialDevice->setspeed == NULL)
+    return 0;
 
-  while (buflen > 0) {
-    unsigned char sequence = xbs->outSequence;
-    while ((++sequence & 0xff) == 0);
-    xbs->outSequence = sequence;
+  /* Larger values are non-standard rates, best left alone */
+  const long current = localATValue(xbs, "AT BD", 'B', 'D');
+  if (current < 0 || current >= bd)
+    return 0;
 
-    /*
-     * We are about to send some data, and that might lead potentially
-     * to received data before we see the ACK for this transmission.
-     * As this might be the trigger seen before the next "recv"
-     * operation, record that we have delivered this potential
-     * trigger.
-     */
-    {
-      unsigned char nextSequence = xbs->inSequence;
-      while ((++nextSequence & 0xff) == 0);
+  const int rc = localAT(xbs, "AT BD", 'B', 'D', bd);
+  if (rc < 0 || xbs->atStatus != 0) {
+    avrdude_message(MSG_NOTICE, "%s: Local XBee rejected AT BD=%d\n",
+                    progname, bd);
+    return 0;
+  }
+
+  xbs->localBaud = (int)current;
+
+  if (xbs->serialDevice->setspeed(&xbs->serialDescriptor,
+                                  xbeeBaudRates[bd]) == 0 &&
+      xbeedev_check_local(xbs) == 0) {
+    avrdude_message(MSG_NOTICE, "%s: Local XBee serial link raised to "
+                    "%ld baud\n", progname, xbeeBaudRates[bd]);
+    return 0;
+  }
+
+  /* Perhaps the XBee never changed, or this port can't keep up */
+  if (xbs->serialDevice->setspeed(&xbs->serialDescriptor,
+                                  xbeeBaudRates[current]) == 0 &&
+      xbeedev_check_local(xbs) == 0) {
+    avrdude_message(MSG_INFO, "%s: Local XBee not found at %ld baud, "
+                    "staying at %ld baud\n",
+                    progname, xbeeBaudRates[bd], xbeeBaudRates[current]);
+    localAT(xbs, "AT BD", 'B', 'D', current);
+    xbs->localBaud = -1;
+    return 0;
+  }
+
+  avrdude_message(MSG_INFO, "%s: Local XBee is not responding.\n",
+                  progname);
+  return -1;
+}
+
+/*
+ * Switch the local XBee and the remote XBees to API mode 1, so that
+ * nothing needs escaping.  XBeeBoot must be built with XBEEBOOT_API1
+ * to match.  The AT FR in xbee_close() restores the remote XBees.
+ */
+static int xbeedev_api1(union filedescriptor *fdp)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+
+  {
+    const int rc = localAT(xbs, "AT AP=1", 'A', 'P', 1);
+    if (rc < 0) {
+      avrdude_message(MSG_INFO, "%s: Local XBee is not responding.\n",
+                      progname);
+      return rc;
+    }
+  }
+
+  xbs->apiMode = 1;
+
+  {
+    const int rc = sendATAll(xbs, "AT AP=1", 'A', 'P', 1);
+    if (rc < 0) {
+      if (xbeeATError(rc))
+        return -1;
+
+      avrdude_message(MSG_INFO, "%s: Remote XBee is not responding.\n",
+                      progname);
+      return rc;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * The most data we can send in one FIRMWARE_DELIVER packet.
+ */
+static size_t xbeedev_max_chunk(struct XBeeBootSession const *xbs)
+{
+  /*
+   * Source routing incurs a two byte fixed overhead, plus a two
+   * byte additional cost per intermediate hop.
+   *
+   * We are attempting to avoid fragmentation here, so resize our
+   * maximum size to anticipate the overhead of the current number
+   * of hops.  If our maximum chunk would be less than one, just
+   * give up and hope fragmentation will somehow save us.
+   */
+  const int hops = xbs->sourceRouteHops;
+  if (hops > 0 && (size_t)(hops * 2 + 2) < xbs->maxChunk)
+    return xbs->maxChunk - (hops * 2 + 2);
+
+  return xbs->maxChunk;
+}
+
+/*
+ * Send a packet carrying chunk bytes of padding, which XBeeBoot
+ * ignores, and ask the local XBee whether it was delivered.  Returns
+ * 1 if it was, 0 if not, or a negative value on failure.
+ */
+static int xbeedev_probe(struct XBeeBootSession *xbs, size_t chunk)
+{
+  unsigned char padding[1 + XBEE_LARGEST_CHUNK];
+  memset(padding, 0, sizeof(padding));
+
+  struct XBeeBootSession *primary = xbs->primary;
+  while ((++primary->txSequence & 0xff) == 0);
+  const unsigned char txSequence = primary->txSequence;
+
+  /*
+   * An ACK with data after the sequence is dropped by XBeeBoot, and
+   * is the same size as FIRMWARE_DELIVER with the chunk.
+   */
+  const int sendRc =
+    sendAPIRequest(xbs, NULL, 0x10, /* ZigBee Transmit Request */
+                   txSequence, -1, 0, 0,
+                   XBEEBOOT_PACKET_TYPE_ACK, xbs->inSequence, -1,
+                   "Transmit Request probe", -1, XBEE_STATS_FRAME_REMOTE,
+                   XBEE_STATS_NOT_RETRY, 1 + chunk, padding);
+  if (sendRc < 0)
+    return sendRc;
+
+  const long savedTimeout = serial_recv_timeout;
+  serial_recv_timeout = XBEE_MAX_TIMEOUT_MS;
+
+  int result = 0;
+  int retries;
+  for (retries = 0; retries < 5; retries++) {
+    const int rc = xbeedev_poll(xbs, -1, txSequence);
+    const int status = XBEE_AT_RETURN_CODE(rc);
+    if (status >= 0) {
+      avrdude_message(MSG_NOTICE2, "%s: xbeedev_probe(): %u bytes, "
+                      "delivery status 0x%02x\n",
+                      progname, (unsigned int)chunk, (unsigned int)status);
+      result = status == 0;
+      break;
+    }
+  }
+
+  /* With no transmit status at all, result assumes the worst */
+  serial_recv_timeout = savedTimeout;
+  return result;
+}
+
+/*
+ * Choose the chunk size for each target, given the most that XBeeBoot
+ * will accept.  Without an XBee in the way that is all there is to
+ * it.  Otherwise go no larger than the local XBee allows, and step up
+ * from XBEEBOOT_MAX_CHUNK until a packet fails to arrive.
+ */
+static int xbeedev_size_chunks(struct XBeeBootSession *xbs,
+                               size_t receiveLimit)
+{
+  if (receiveLimit > XBEE_LARGEST_CHUNK)
+    receiveLimit = XBEE_LARGEST_CHUNK;
+
+  if (xbs->directMode) {
+    if (receiveLimit > XBEEBOOT_MAX_CHUNK)
+      xbs->maxChunk = receiveLimit;
+    return 0;
+  }
+
+  size_t limit = xbs->primary->localPayload;
+  if (limit > receiveLimit)
+    limit = receiveLimit;
+
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    /* Probes must allow for the current source route too */
+    const size_t route = session->maxChunk - xbeedev_max_chunk(session);
+    size_t chunk = XBEEBOOT_MAX_CHUNK;
+
+    for (;;) {
+      size_t next = chunk + XBEE_PROBE_STEP;
+      if (next > limit)
+        next = limit;
+      if (next <= chunk)
+        break;
+
+      const int probeRc = xbeedev_probe(session, next - route);
+      if (probeRc < 0)
+        return probeRc;
+      if (probeRc == 0)
+        break;
+
+      chunk = next;
+    }
+
+    session->maxChunk = chunk;
+
+    char text[XBEE_ADDRESS_STRING_LEN];
+    avrdude_message(MSG_NOTICE, "%s: XBee: Up to %u bytes per packet "
+                    "to %s\n", progname, (unsigned int)chunk,
+                    xbeedev_address_string(session, text));
+  }
+
+  return 0;
+}
+
+/*
+ * Send the next chunk of buf as a FIRMWARE_DELIVER packet, recording
+ * it as outstanding in the window.  Return the number of bytes
+ * consumed, or a negative value on failure.
+ */
+static int xbeedev_send_chunk(struct XBeeBootSession *xbs,
+                              const unsigned char *buf, size_t buflen)
+{
+  unsigned char sequence = xbs->outSequence;
+  while ((++sequence & 0xff) == 0);
+  xbs->outSequence = sequence;
+
+  /*
+   * We are about to send some data, and that might lead potentially
+   * to received data before we see the ACK for this transmission.
+   * As this might be the trigger seen before the next "recv"
+   * operation, record that we have delivered this potential
+   * trigger.
+   */
+  {
+    unsigned char nextSequence = xbs->inSequence;
+    while ((++nextSequence & 0xff) == 0);
+
+    struct timeval sendTime;
+    gettimeofday(&sendTime, NULL);
+
+    /*
+     * Optimistic records should never be treated as retries,
+     * because they might simply be guessing too optimistically.
+     */
+    xbeedev_stats_send(xbs, "send() hints possible triggered RECEIVE",
+                       nextSequence,
+                       XBEE_STATS_RECEIVE,
+                       nextSequence, 0, &sendTime);
+  }
+
+  /*
+   * Chunk the data into chunks of up to XBEEBOOT_MAX_CHUNK bytes,
+   * less one for the ACK if one is being held back.
+   */
+  const size_t maximum_chunk = xbeedev_max_chunk(xbs) -
+    (xbs->ackPending ? 1 : 0);
+
+  const unsigned char blockLength =
+    (buflen > maximum_chunk) ? maximum_chunk : buflen;
+
+  struct XBeeWindowEntry *entry = &xbs->windowEntries[xbs->windowUsed++];
+  entry->data = buf;
+  entry->length = blockLength;
+  entry->sequence = sequence;
+
+  int sendRc;
+  if (xbs->ackPending) {
+    /*
+     * Only the first send carries the ACK.  Should it need resending,
+     * xbeedev_retry() resends the ACK on its own.
+     */
+    unsigned char packet[XBEE_LARGEST_CHUNK + 1];
+    memcpy(packet, buf, blockLength);
+    packet[blockLength] = xbs->inSequence;
+    xbs->ackPending = 0;
+
+    sendRc = sendPacket(xbs,
+                        "Transmit Request Data and ACK for RECEIVE, "
+                        "expect ACK for TRANSMIT",
+                        XBEEBOOT_PACKET_TYPE_DELIVER_ACK, sequence,
+                        XBEE_STATS_NOT_RETRY,
+                        23 /* FIRMWARE_DELIVER */,
+                        blockLength + 1, packet);
+  } else {
+    sendRc = sendPacket(xbs,
+                        "Transmit Request Data, expect ACK for TRANSMIT",
+                        XBEEBOOT_PACKET_TYPE_REQUEST, sequence,
+                        XBEE_STATS_NOT_RETRY,
+                        23 /* FIRMWARE_DELIVER */,
+                        blockLength, buf);
+  }
+  if (sendRc < 0)
+    return sendRc;
+
+  return blockLength;
+}
+
+/*
+ * Send any ACK being held back for piggybacking on its own, if force
+ * is set or it has been held back for long enough.
+ */
+static int xbeedev_send_ack(struct XBeeBootSession *xbs, int force,
+                            struct timeval const *now)
+{
+  if (!xbs->ackPending ||
+      (!force && xbeedev_until(&xbs->ackDeadline, now) > 0))
+    return 0;
+
+  xbs->ackPending = 0;
+  return sendPacket(xbs, "Transmit Request ACK for RECEIVE",
+                    XBEEBOOT_PACKET_TYPE_ACK, xbs->inSequence,
+                    XBEE_STATS_NOT_RETRY,
+                    -1, 0, NULL);
+}
+
+/*
+ * Send the ACKs held back for every session.
+ */
+static int xbeedev_send_acks(struct XBeeBootSession *xbs, int force)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  for (; xbs != NULL; xbs = xbs->nextSession) {
+    const int ackRc = xbeedev_send_ack(xbs, force, &now);
+    if (ackRc < 0)
+      return ackRc;
+  }
+
+  return 0;
+}
+
+/*
+ * The session timer has expired without progress.  Resend anything
+ * that might have been lost, returning a negative value once we have
+ * gone XBEE_GIVE_UP_MS without progress.
+ */
+static int xbeedev_retry(struct XBeeBootSession *xbs, const char *detail,
+                         struct timeval const *now)
+{
+  if (++xbs->retries >= XBEE_MAX_RETRIES &&
+      xbeedev_until(&xbs->giveUp, now) == 0)
+    return -1;
+
+  /*
+   * Test the connection to the local XBee by requesting local
+   * configuration details.  This functionally has no effect, but
+   * will allow us to measure any reliability issues on this link.
+   * A lost packet or two says nothing about the local XBee, so
+   * don't add to the traffic until the remote end has been quiet
+   * for a while.
+   */
+  if (xbs->retries % XBEE_PING_RETRIES == 0)
+    localAsyncAT(xbs, detail, 'A', 'P', -1);
+
+  /*
+   * If we don't receive an ACK it might be because the chip
+   * missed an ACK from us.  Resend that too after a timeout,
+   * unless it's zero which is an illegal sequence number.
+   */
+  if (xbs->inSequence != 0) {
+    xbs->ackPending = 0;
+    int ackRc = sendPacket(xbs,
+                           "Transmit Request ACK [Retry] for RECEIVE",
+                           XBEEBOOT_PACKET_TYPE_ACK,
+                           xbs->inSequence,
+                           XBEE_STATS_IS_RETRY,
+                           -1, 0, NULL);
+    if (ackRc < 0)
+      return ackRc;
+  }
+
+  /*
+   * Go back N: XBeeBoot discards anything out of sequence, so
+   * resend everything still outstanding, oldest first.
+   */
+  unsigned int index;
+  for (index = 0; index < xbs->windowUsed; index++) {
+    const struct XBeeWindowEntry *entry = &xbs->windowEntries[index];
+    int sendRc =
+      sendPacket(xbs,
+                 "Transmit Request Data, expect ACK for TRANSMIT",
+                 XBEEBOOT_PACKET_TYPE_REQUEST, entry->sequence,
+                 XBEE_STATS_IS_RETRY,
+                 23 /* FIRMWARE_DELIVER */,
+                 entry->length, entry->data);
+    if (sendRc < 0)
+      return sendRc;
+  }
+
+  xbeedev_set_deadline(xbs, now);
+  return 0;
+}
+
+/*
+ * Run one pass of the session engine over every session: fire any
+ * expired timers, then wait for input no later than the next timer
+ * and dispatch every frame that has arrived.  Returns a negative
+ * value once a session has given up.
+ */
+static int xbeedev_events(struct XBeeBootSession *xbs)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  long timeout = XBEE_MAX_TIMEOUT_MS;
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    /*
+     * XBeeBoot does nothing more until its reply is ACK'd, not even
+     * take more data once its queue is full, so don't hold the ACK
+     * back while waiting on this session for anything.
+     */
+    const int ackRc =
+      xbeedev_send_ack(session, session->pending != XBEE_PENDING_NONE,
+                       &now);
+    if (ackRc < 0)
+      return ackRc;
+
+    if (session->ackPending &&
+        xbeedev_until(&session->ackDeadline, &now) < timeout)
+      timeout = xbeedev_until(&session->ackDeadline, &now);
+
+    if (session->atSequence != 0 &&
+        xbeedev_until(&session->atDeadline, &now) == 0) {
+      const int atRc = xbeedev_at_retry(session, &now);
+      if (atRc < 0)
+        return atRc;
+    }
+
+    if (session->atSequence != 0 &&
+        xbeedev_until(&session->atDeadline, &now) < timeout)
+      timeout = xbeedev_until(&session->atDeadline, &now);
+
+    if (session->pending == XBEE_PENDING_NONE)
+      continue;
+
+    if (xbeedev_remaining(session, &now) == 0) {
+      /*
+       * For RECEIVE, the chip may have missed an ACK from us;
+       * resending it after a timeout will prompt XBeeBoot to resend
+       * its reply.
+       */
+      const int retryRc =
+        xbeedev_retry(session,
+                      session->pending == XBEE_PENDING_SEND ?
+                      "Local XBee ping [send]" : "Local XBee ping [recv]",
+                      &now);
+      if (retryRc < 0) {
+        if (session->pending == XBEE_PENDING_SEND)
+          /* There is no way to recover from a failure mid-send */
+          session->transportUnusable = 1;
+        return retryRc;
+      }
+    }
+
+    const long remaining = xbeedev_remaining(session, &now);
+    if (remaining < timeout)
+      timeout = remaining;
+  }
+
+  /* A zero timeout would never read anything at all */
+  serial_recv_timeout = timeout > 0 ? timeout : 1;
+  if (xbeedev_poll(xbs, XBEE_WAIT_ANY, -1) < 0)
+    /* Timeout; the timer fires on the next pass */
+    return 0;
+
+  /*
+   * Dispatch whatever else has already been read without waiting, so
+   * that events for every session are handled in the same pass.
+   */
+  struct XBeeBootSession *primary = xbs->primary;
+  while (primary->readIndex < primary->readLength) {
+    const unsigned int frameSize =
+      xbeedev_parse(xbs, primary->readBuffer[primary->readIndex++]);
+    if (frameSize > 0 &&
+        xbeedev_dispatch(xbs, primary->parser.frame, frameSize, -1, -1) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Send buf to every target, returning once all of it has been ACK'd.
+ */
+static int xbeedev_transmit(struct XBeeBootSession *xbs,
+                            const unsigned char *buf, size_t buflen)
+{
+  struct XBeeBootSession *session;
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    if (session->transportUnusable)
+      /* Don't attempt to continue on an unusable transport layer */
+      return -1;
+
+    session->sendData = buf;
+    session->sendLength = buflen;
+    session->windowUsed = 0;
+    xbeedev_progress(session, &start);
+  }
+
+  /*
+   * The same data goes to every target.  Each session proceeds at its
+   * own pace, and we are done once all of them have been ACK'd.
+   */
+  for (;;) {
+    int pending = 0;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    for (session = xbs; session != NULL; session = session->nextSession) {
+      /*
+       * Keep up to "window" packets in flight.  With a window of one
+       * this is the original stop-and-wait behaviour.
+       */
+      while (session->sendLength > 0 &&
+             session->windowUsed < session->window) {
+        if (session->windowUsed == 0)
+          xbeedev_set_deadline(session, &now);
+
+        const int sendRc = xbeedev_send_chunk(session, session->sendData,
+                                              session->sendLength);
+        if (sendRc < 0) {
+          /* There is no way to recover from a failure mid-send */
+          session->transportUnusable = 1;
+          return sendRc;
+        }
+
+        session->sendLength -= sendRc;
+        session->sendData += sendRc;
+      }
+
+      if (session->windowUsed > 0) {
+        session->pending = XBEE_PENDING_SEND;
+        pending = 1;
+      } else {
+        session->pending = XBEE_PENDING_NONE;
+      }
+    }
+
+    if (!pending)
+      return 0;
+
+    const int eventsRc = xbeedev_events(xbs);
+    if (eventsRc < 0)
+      return eventsRc;
+  }
+}
+
+/*
+ * Send whatever xbeedev_send() is holding back.
+ */
+static int xbeedev_flush(struct XBeeBootSession *xbs)
+{
+  const size_t length = xbs->outLength;
+  if (length == 0)
+    /* Nothing to carry any ACK held back, so send it once it is due */
+    return xbeedev_send_acks(xbs, 0);
+
+  xbs->outLength = 0;
+  return xbeedev_transmit(xbs, xbs->outBuffer, length);
+}
+
+/*
+ * STK500 commands are often written a few bytes at a time, and a
+ * command's reply may not be read until the next command has been
+ * written.  Hold data back until there is a whole packet's worth, so
+ * that those writes share packets rather than each costing a round
+ * trip.
+ */
+static int xbeedev_send(union filedescriptor *fdp,
+                        const unsigned char *buf, size_t buflen)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+  struct XBeeBootSession *session;
+
+  if (xbs->outLength + buflen > sizeof(xbs->outBuffer)) {
+    const int flushRc = xbeedev_flush(xbs);
+    if (flushRc < 0)
+      return flushRc;
+
+    if (buflen > sizeof(xbs->outBuffer))
+      return xbeedev_transmit(xbs, buf, buflen);
+  }
+
+  memcpy(&xbs->outBuffer[xbs->outLength], buf, buflen);
+  xbs->outLength += buflen;
+
+  /* Every target must be sent the same packets */
+  size_t chunk = xbeedev_max_chunk(xbs);
+  for (session = xbs->nextSession; session != NULL;
+       session = session->nextSession) {
+    if (xbeedev_max_chunk(session) < chunk)
+      chunk = xbeedev_max_chunk(session);
+  }
+
+  const size_t whole = xbs->outLength - xbs->outLength % chunk;
+  if (whole == 0)
+    return xbeedev_send_acks(xbs, 0);
+
+  const int sendRc = xbeedev_transmit(xbs, xbs->outBuffer, whole);
+  xbs->outLength -= whole;
+  memmove(xbs->outBuffer, &xbs->outBuffer[whole], xbs->outLength);
+  return sendRc;
+}
+
+static int xbeedev_read(struct XBeeBootSession *xbs,
+                        unsigned char *buf, size_t buflen)
+{
+  struct XBeeBootSession *session;
+
+  const int flushRc = xbeedev_flush(xbs);
+  if (flushRc < 0)
+    return flushRc;
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    xbeedev_progress(session, &now);
+
+    if (xbeedev_available(session) >= buflen)
+      /* Previously received in a chunk that couldn't be delivered */
+      continue;
+
+    if (session->transportUnusable)
+      /* Don't attempt to continue on an unusable transport layer */
+      return -1;
+
+    /*
+     * When we expect to receive data, that is the time to start the
+     * clock.
+     */
+    unsigned char nextSequence = session->inSequence;
+    while ((++nextSequence & 0xff) == 0);
+
+    /*
+     * Not a retry - in fact this is the first stage we know for sure
+     * a RECEIVE is due.
+     */
+    xbeedev_stats_send(session, "recv() implies pending RECEIVE",
+                       nextSequence,
+                       XBEE_STATS_RECEIVE,
+                       nextSequence,
+                       XBEE_STATS_NOT_RETRY,
+                       &now);
+  }
+
+  for (;;) {
+    int pending = 0;
+
+    for (session = xbs; session != NULL; session = session->nextSession) {
+      if (xbeedev_available(session) >= buflen) {
+        session->pending = XBEE_PENDING_NONE;
+        continue;
+      }
+
+      if (session->transportUnusable)
+        /* Don't attempt to continue on an unusable transport layer */
+        return -1;
+
+      session->pending = XBEE_PENDING_RECV;
+      pending = 1;
+    }
+
+    if (!pending)
+      break;
+
+    if (xbeedev_events(xbs) < 0)
+      return -1;
+  }
+
+  /*
+   * Every target is sent the same commands, so should reply
+   * identically.  If not, the targets are no longer in lockstep.
+   */
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    size_t index;
+    for (index = 0; index < buflen; index++) {
+      const unsigned char data = session->inBuffer[session->inOutIndex++];
+      if (session->inOutIndex == sizeof(session->inBuffer))
+        session->inOutIndex = 0;
+
+      if (session == xbs) {
+        buf[index] = data;
+      } else if (buf[index] != data) {
+        char text[XBEE_ADDRESS_STRING_LEN];
+        char primaryText[XBEE_ADDRESS_STRING_LEN];
+        avrdude_message(MSG_INFO, "%s: XBee: Reply from %s differs "
+                        "from %s\n",
+                        progname, xbeedev_address_string(session, text),
+                        xbeedev_address_string(xbs, primaryText));
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Read and check the replies to staged flash writes until no more
+ * than leave of them are outstanding.
+ */
+static int xbeedev_collect(struct XBeeBootSession *xbs, unsigned int leave)
+{
+  while (xbs->stagedReplies > leave) {
+    unsigned char reply[2];
+    const int readRc = xbeedev_read(xbs, reply, sizeof(reply));
+    if (readRc < 0)
+      return readRc;
+
+    xbs->stagedReplies--;
+    if (reply[0] != Resp_STK_INSYNC || reply[1] != Resp_STK_OK) {
+      avrdude_message(MSG_INFO, "%s: xbeedev_collect(): protocol error "
+                      "in staged flash write: resp=0x%02x 0x%02x\n",
+                      progname,
+                      (unsigned int)reply[0], (unsigned int)reply[1]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Anything read comes after the replies to staged flash writes, so
+ * those are checked first.
+ */
+static int xbeedev_recv(union filedescriptor *fdp,
+                        unsigned char *buf, size_t buflen)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+
+  const int collectRc = xbeedev_collect(xbs, 0);
+  if (collectRc < 0)
+    return collectRc;
+
+  return xbeedev_read(xbs, buf, buflen);
+}
+
+static int xbeedev_drain(union filedescriptor *fdp, int display)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+  struct XBeeBootSession *session;
+
+  if (xbs->transportUnusable)
+    /* Don't attempt to continue on an unusable transport layer */
+    return -1;
+
+  const int collectRc = xbeedev_collect(xbs, 0);
+  if (collectRc < 0)
+    return collectRc;
+
+  const int flushRc = xbeedev_flush(xbs);
+  if (flushRc < 0)
+    return flushRc;
+
+  /* Don't leave XBeeBoot waiting for an ACK */
+  const int ackRc = xbeedev_send_acks(xbs, 1);
+  if (ackRc < 0)
+    return ackRc;
+
+  /*
+   * Flushing the local serial buffer is unhelpful under this
+   * protocol.
+   */
+  serial_recv_timeout = xbeedev_timeout(xbs, 0);
+  xbs->primary->readIndex = 0;
+  xbs->primary->readLength = 0;
+  xbs->primary->parser.inFrame = 0;
+  xbs->primary->parser.escaped = 0;
+  do {
+    for (session = xbs; session != NULL; session = session->nextSession)
+      session->inOutIndex = session->inInIndex = 0;
+  } while (xbeedev_poll(xbs, -1, -1) == 0);
+
+  return 0;
+}
+
+static int xbeedev_set_dtr_rts(union filedescriptor *fdp, int is_on)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+
+  if (xbs->directMode)
+    /* Correct for direct mode */
+    return xbs->serialDevice->set_dtr_rts(&xbs->serialDescriptor, is_on);
+
+  /*
+   * For non-direct mode (Over-The-Air) we need to issue XBee commands
+   * to the remote XBee in order to reset the AVR CPU and initiate the
+   * XBeeBoot bootloader.
+   */
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    /* Each target may use its own reset pin */
+    const int startRc =
+      xbeedev_at_start(session, 1, is_on ? "AT [DTR]=low" : "AT [DTR]=high",
+                       'D', '0' + session->xbeeResetPin, is_on ? 5 : 4);
+    if (startRc < 0)
+      return startRc;
+  }
+
+  const int rc = xbeedev_at_wait_all(xbs);
+  if (rc < 0) {
+    if (xbeeATError(rc))
+      return -1;
+
+    avrdude_message(MSG_INFO,
+                    "%s: Remote XBee is not responding.\n", progname);
+    return rc;
+  }
+
+  return 0;
+}
+
+/*
+ * Device descriptor for XBee framing.
+ */
+static struct serial_device xbee_serdev_frame = {
+  .open = xbeedev_open,
+  .close = xbeedev_close,
+  .send = xbeedev_send,
+  .recv = xbeedev_recv,
+  .drain = xbeedev_drain,
+  .set_dtr_rts = xbeedev_set_dtr_rts,
+  .flags = SERDEV_FL_NONE,
+};
+
+static int xbee_getsync(PROGRAMMER *pgm)
+{
+  unsigned char buf[2], resp[2];
+
+  /*
+   * Issue sync request as per STK500.  Unlike stk500_getsync(), don't
+   * retry here - the underlying protocol will deal with retries for
+   * us in xbeedev_send() and should be reliable.
+   */
+  buf[0] = Cmnd_STK_GET_SYNC;
+  buf[1] = Sync_CRC_EOP;
+
+  int sendRc = serial_send(&pgm->fd, buf, 2);
+  if (sendRc < 0) {
+    avrdude_message(MSG_INFO,
+                    "%s: xbee_getsync(): failed to deliver STK_GET_SYNC "
+                    "to the remote XBeeBoot bootloader\n",
+                    progname);
+    return sendRc;
+  }
+
+  /*
+   * The same is true of the receive - it will retry on timeouts until
+   * the response buffer is full.
+   */
+  int recvRc = serial_recv(&pgm->fd, resp, 2);
+  if (recvRc < 0) {
+    avrdude_message(MSG_INFO,
+                    "%s: xbee_getsync(): no response to STK_GET_SYNC "
+                    "from the remote XBeeBoot bootloader\n",
+                    progname);
+    return recvRc;
+  }
+
+  if (resp[0] != Resp_STK_INSYNC) {
+    avrdude_message(MSG_INFO, "%s: xbee_getsync(): not in sync: resp=0x%02x\n",
+                    progname, (unsigned int)resp[0]);
+    return -1;
+  }
+
+  if (resp[1] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_getsync(): in sync, not OK: "
+                    "resp=0x%02x\n",
+                    progname, (unsigned int)resp[1]);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Read an STK500 parameter from the remote bootloader.  Returns the
+ * parameter value, or a negative value on failure.
+ */
+static int xbee_getparm(PROGRAMMER *pgm, unsigned char parm)
+{
+  unsigned char buf[3];
+
+  buf[0] = Cmnd_STK_GET_PARAMETER;
+  buf[1] = parm;
+  buf[2] = Sync_CRC_EOP;
+
+  int sendRc = serial_send(&pgm->fd, buf, 3);
+  if (sendRc < 0)
+    return sendRc;
+
+  int recvRc = serial_recv(&pgm->fd, buf, 3);
+  if (recvRc < 0)
+    return recvRc;
+
+  if (buf[0] != Resp_STK_INSYNC || buf[2] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_getparm(): protocol error "
+                    "for parameter 0x%02x: resp=0x%02x 0x%02x\n",
+                    progname, (unsigned int)parm,
+                    (unsigned int)buf[0], (unsigned int)buf[2]);
+    return -1;
+  }
+
+  return buf[1];
+}
+
+/*
+ * Discover the optional features supported by the remote XBeeBoot
+ * bootloader, and size the transmit window accordingly.
+ */
+static int xbee_getcapabilities(PROGRAMMER *pgm)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  const int capabilities = xbee_getparm(pgm, XBEEBOOT_PARM_CAPABILITIES);
+  if (capabilities < 0)
+    return capabilities;
+
+  if ((capabilities & XBEEBOOT_CAP_VALID) == 0) {
+    /* Bootloader predates capability discovery */
+    avrdude_message(MSG_NOTICE, "%s: XBeeBoot bootloader does not "
+                    "report capabilities\n", progname);
+    return 0;
+  }
+
+  int queueSize = 0;
+  int piggyback = 0;
+
+  if (capabilities & XBEEBOOT_CAP_WINDOW) {
+    queueSize = xbee_getparm(pgm, XBEEBOOT_PARM_WINDOW);
+    if (queueSize < 0)
+      return queueSize;
+
+    if (queueSize == 255) {
+      /*
+       * Larger queues are given in 64 byte units.  The 0x03 answered
+       * by bootloaders that don't know the parameter is smaller.
+       */
+      const int queueUnits = xbee_getparm(pgm, XBEEBOOT_PARM_QUEUE);
+      if (queueUnits < 0)
+        return queueUnits;
+
+      if (queueUnits * 64 > queueSize + 1)
+        queueSize = queueUnits * 64 - 1;
+    }
+
+    /*
+     * Bootloaders that don't know the parameter answer 0x03, which
+     * is no use to us anyway.
+     */
+    const int maxChunk = xbee_getparm(pgm, XBEEBOOT_PARM_MAX_CHUNK);
+    if (maxChunk < 0)
+      return maxChunk;
+
+    if (maxChunk > XBEEBOOT_MAX_CHUNK) {
+      const int sizeRc = xbeedev_size_chunks(xbs, maxChunk);
+      if (sizeRc < 0)
+        return sizeRc;
+    }
+  }
+
+  if (capabilities & XBEEBOOT_CAP_PIGGYBACK) {
+    /*
+     * Reading the parameter tells the bootloader that we understand
+     * REPLY_ACK, and it carries its ACKs in its replies from then on.
+     */
+    const int rc = xbee_getparm(pgm, XBEEBOOT_PARM_PIGGYBACK);
+    if (rc < 0)
+      return rc;
+
+    /* It then also takes our ACKs in DELIVER_ACK packets */
+    piggyback = rc == 1;
+  }
+
+  /*
+   * Targets programmed in lockstep must all have given the same
+   * answer, otherwise xbeedev_recv() would have failed.
+   */
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    int window = 1;
+
+    if (queueSize > 0) {
+      /*
+       * Only send as many full packets as the bootloader can buffer,
+       * otherwise the excess will simply be dropped and resent.
+       */
+      window = queueSize / (session->maxChunk + XBEEBOOT_PACKET_OVERHEAD);
+      const int requested =
+        (pgm->flag & XBEE_FLAG_WINDOW_MASK) >> XBEE_FLAG_WINDOW_SHIFT;
+      if (requested > 0 && requested < window)
+        window = requested;
+      if (window > XBEE_MAX_WINDOW)
+        window = XBEE_MAX_WINDOW;
+      if (window < 1)
+        window = 1;
+    }
+
+    session->capabilities = capabilities;
+    session->piggyback = piggyback;
+    session->window = window;
+    session->queueSize = queueSize;
+
+    avrdude_message(MSG_NOTICE, "%s: XBeeBoot capabilities 0x%02x, "
+                    "window %d, chunk %u\n",
+                    progname, (unsigned int)capabilities, window,
+                    (unsigned int)session->maxChunk);
+  }
+
+  if (capabilities & XBEEBOOT_CAP_RTS) {
+    /*
+     * XBeeBoot drives the remote XBee's RTS input, and deasserts it
+     * while flash is busy.  The AT FR in xbee_close() puts D6 back.
+     */
+    const int rc = sendATAll(xbs, "AT D6=1", 'D', '6', 1);
+    if (rc < 0) {
+      if (xbeeATError(rc))
+        return -1;
+
+      avrdude_message(MSG_INFO, "%s: Remote XBee is not responding.\n",
+                      progname);
+      return rc;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Raise the rate of the serial links between the remote XBees and
+ * XBeeBoot, to the fastest both support up to the xbeebaud limit.
+ * XBeeBoot switches once it has our ACK for its reply, then we set
+ * each remote XBee to match.  xbee_close() puts the XBees back.
+ */
+static int xbee_upshift(PROGRAMMER *pgm)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  const int limit =
+    ((pgm->flag & XBEE_FLAG_BAUD_MASK) >> XBEE_FLAG_BAUD_SHIFT) - 1;
+  if (limit < 0 || xbs->directMode)
+    return 0;
+
+  const int bauds = xbee_getparm(pgm, XBEEBOOT_PARM_BAUDS);
+  if (bauds < 0)
+    return bauds;
+
+  if (bauds == 0x03) {
+    /* The answer of bootloaders that don't know the parameter */
+    avrdude_message(MSG_NOTICE, "%s: XBeeBoot bootloader can't change "
+                    "baud rate\n", progname);
+    return 0;
+  }
+
+  int bd = limit;
+  while (bd >= 0 && (bauds & (1 << bd)) == 0)
+    bd--;
+
+  /*
+   * Targets programmed in lockstep are all switched together, so
+   * only when it is an upshift for all of them.
+   */
+  int upshift = bd >= 0;
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL && upshift;
+       session = session->nextSession) {
+    const int startRc = xbeedev_at_start(session, 1, "AT BD", 'B', 'D', -1);
+    if (startRc < 0)
+      return startRc;
+  }
+
+  const int waitRc = xbeedev_at_wait(xbs);
+  if (waitRc < 0)
+    return waitRc;
+
+  for (session = xbs; session != NULL && upshift;
+       session = session->nextSession) {
+    const long current =
+      session->atStatus == 0 ? (long)session->atValue : -1;
+    if (current < 0)
+      avrdude_message(MSG_NOTICE, "%s: Remote XBee baud rate unknown, "
+                      "leaving it unchanged\n", progname);
+
+    upshift = current >= 0 && current < bd;
+    session->remoteBaud = (int)current;
+  }
+
+  if (!upshift) {
+    for (session = xbs; session != NULL; session = session->nextSession)
+      session->remoteBaud = -1;
+    return 0;
+  }
+
+  unsigned char buf[3];
+  buf[0] = XBEEBOOT_CMD_BAUD;
+  buf[1] = (unsigned char)bd;
+  buf[2] = Sync_CRC_EOP;
+
+  const int sendRc = serial_send(&pgm->fd, buf, 3);
+  if (sendRc < 0)
+    return sendRc;
+
+  const int recvRc = serial_recv(&pgm->fd, buf, 2);
+  if (recvRc < 0)
+    return recvRc;
+
+  if (buf[0] != Resp_STK_INSYNC || buf[1] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_upshift(): protocol error: "
+                    "resp=0x%02x 0x%02x\n",
+                    progname, (unsigned int)buf[0], (unsigned int)buf[1]);
+    return -1;
+  }
+
+  /* The ACK must reach XBeeBoot before the remote XBee changes rate */
+  const int ackRc = xbeedev_send_acks(xbs, 1);
+  if (ackRc < 0)
+    return ackRc;
+
+  usleep(XBEE_BAUD_SETTLE_MS * 1000);
+
+  {
+    const int rc = sendATAll(xbs, "AT BD", 'B', 'D', bd);
+    if (rc < 0) {
+      if (!xbeeATError(rc))
+        avrdude_message(MSG_INFO, "%s: Remote XBee is not responding.\n",
+                        progname);
+
+      /*
+       * Put back any remote XBee that did follow.  XBeeBoot goes back
+       * to its old rate on the framing errors that then reach it, and
+       * the transport's retries get through at that rate.
+       */
+      for (session = xbs; session != NULL; session = session->nextSession)
+        xbeedev_at_start(session, 1, "AT BD", 'B', 'D', session->remoteBaud);
+      xbeedev_at_wait(xbs);
+
+      for (session = xbs; session != NULL; session = session->nextSession)
+        session->remoteBaud = -1;
+
+      if (xbee_getparm(pgm, XBEEBOOT_PARM_CAPABILITIES) < 0) {
+        avrdude_message(MSG_INFO, "%s: XBeeBoot lost after failing to "
+                        "change to %ld baud\n", progname, xbeeBaudRates[bd]);
+        return -1;
+      }
+
+      avrdude_message(MSG_INFO, "%s: Remote XBee serial link left at its "
+                      "old rate\n", progname);
+      return 0;
+    }
+  }
+
+  /* Check that XBeeBoot is still with us at the new rate */
+  if (xbee_getparm(pgm, XBEEBOOT_PARM_CAPABILITIES) < 0) {
+    avrdude_message(MSG_INFO, "%s: XBeeBoot lost after changing to "
+                    "%ld baud\n", progname, xbeeBaudRates[bd]);
+    return -1;
+  }
+
+  avrdude_message(MSG_NOTICE, "%s: XBeeBoot serial link raised to "
+                  "%ld baud\n", progname, xbeeBaudRates[bd]);
+  return 0;
+}
+
+/*
+ * The STK500 implementations of paged_write() and paged_load(), which
+ * ours wrap.
+ */
+static int (*stk500_paged_write)(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                                 unsigned int page_size,
+                                 unsigned int addr, unsigned int n_bytes);
+static int (*stk500_paged_load)(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                                unsigned int page_size,
+                                unsigned int addr, unsigned int n_bytes);
+
+/* CRC-32 (IEEE 802.3), as computed by XBeeBoot */
+static unsigned long xbee_crc32(const unsigned char *data, size_t length)
+{
+  unsigned long crc = 0xffffffffUL;
+
+  while (length-- > 0) {
+    crc ^= *data++;
+
+    int bit;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xedb88320UL & -(crc & 1));
+  }
+
+  return ~crc & 0xffffffffUL;
+}
+
+/*
+ * Can the next command be sent before the reply to the last one has
+ * been read?  A windowed XBeeBoot queues whatever arrives while it is
+ * busy, but the classic one has room for only a single packet.
+ */
+static int xbee_pipelined(PROGRAMMER *pgm)
+{
+  struct XBeeBootSession *xbs;
+  for (xbs = xbeebootsession(&pgm->fd); xbs != NULL; xbs = xbs->nextSession) {
+    if (xbs->window < 2)
+      return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Load a flash byte address for the XBeeBoot specific commands, and
+ * check the reply separately.
+ */
+static int xbee_loadaddr_send(PROGRAMMER *pgm, unsigned int addr)
+{
+  unsigned char buf[4];
+
+  /* Flash is word addressed */
+  buf[0] = Cmnd_STK_LOAD_ADDRESS;
+  buf[1] = (addr >> 1) & 0xff;
+  buf[2] = (addr >> 9) & 0xff;
+  buf[3] = Sync_CRC_EOP;
+
+  return serial_send(&pgm->fd, buf, 4);
+}
+
+static int xbee_loadaddr_reply(PROGRAMMER *pgm, unsigned int addr)
+{
+  unsigned char buf[2];
+
+  const int recvRc = serial_recv(&pgm->fd, buf, 2);
+  if (recvRc < 0)
+    return recvRc;
+
+  if (buf[0] != Resp_STK_INSYNC || buf[1] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_loadaddr_reply(): protocol error "
+                    "loading address 0x%04x: resp=0x%02x 0x%02x\n",
+                    progname, addr,
+                    (unsigned int)buf[0], (unsigned int)buf[1]);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Send a command that acts on flash at addr, after loading the
+ * address, and read replyLength bytes of its reply.  When pipelined,
+ * the two commands go out together and their replies come back
+ * together, saving a round trip.
+ */
+static int xbee_command(PROGRAMMER *pgm, unsigned int addr,
+                        const unsigned char *command, size_t commandLength,
+                        unsigned char *reply, size_t replyLength)
+{
+  const int pipelined = xbee_pipelined(pgm);
+
+  const int loadRc = xbee_loadaddr_send(pgm, addr);
+  if (loadRc < 0)
+    return loadRc;
+
+  if (!pipelined) {
+    const int replyRc = xbee_loadaddr_reply(pgm, addr);
+    if (replyRc < 0)
+      return replyRc;
+  }
+
+  const int sendRc = serial_send(&pgm->fd, command, commandLength);
+  if (sendRc < 0)
+    return sendRc;
+
+  if (pipelined) {
+    const int replyRc = xbee_loadaddr_reply(pgm, addr);
+    if (replyRc < 0)
+      return replyRc;
+  }
+
+  return serial_recv(&pgm->fd, reply, replyLength);
+}
+
+/*
+ * Ask XBeeBoot for count CRC-32s covering a range of flash.
+ */
+static int xbee_getcrc(PROGRAMMER *pgm, unsigned int addr,
+                       unsigned int length, unsigned char type,
+                       unsigned long *crc, unsigned int count)
+{
+  unsigned char buf[2 + 4 * XBEE_CRC_MAX_PAGES];
+
+  buf[0] = XBEEBOOT_CMD_CRC;
+  buf[1] = (length >> 8) & 0xff;
+  buf[2] = length & 0xff;
+  buf[3] = type;
+  buf[4] = Sync_CRC_EOP;
+
+  const size_t replyLength = 2 + 4 * count;
+  const int recvRc = xbee_command(pgm, addr, buf, 5, buf, replyLength);
+  if (recvRc < 0)
+    return recvRc;
+
+  if (buf[0] != Resp_STK_INSYNC || buf[replyLength - 1] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_getcrc(): protocol error "
+                    "for range 0x%04x+%u: resp=0x%02x 0x%02x\n",
+                    progname, addr, length, (unsigned int)buf[0],
+                    (unsigned int)buf[replyLength - 1]);
+    return -1;
+  }
+
+  unsigned int index;
+  for (index = 0; index < count; index++) {
+    const unsigned char *value = &buf[1 + 4 * index];
+    crc[index] = (unsigned long)value[0] | (unsigned long)value[1] << 8 |
+      (unsigned long)value[2] << 16 | (unsigned long)value[3] << 24;
+  }
+
+  return 0;
+}
+
+/*
+ * Is this page of flash already on the device?  Only asked of a
+ * single target; targets programmed in lockstep must all be sent the
+ * same traffic.
+ */
+static int xbee_page_unchanged(PROGRAMMER *pgm, AVRMEM *m,
+                               unsigned int page_size,
+                               unsigned int addr, unsigned int n_bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  if (xbs->nextSession != NULL || page_size == 0 ||
+      n_bytes != page_size || addr % page_size != 0 ||
+      XBEE_CRC_RANGE % page_size != 0 ||
+      XBEE_CRC_RANGE / page_size > XBEE_CRC_MAX_PAGES)
+    return 0;
+
+  if (xbs->pageCrc == NULL) {
+    xbs->pageCrcCount = m->size / page_size;
+    xbs->pageCrc = malloc(xbs->pageCrcCount * sizeof(*xbs->pageCrc));
+    xbs->pageCrcValid = calloc(xbs->pageCrcCount, 1);
+    if (xbs->pageCrc == NULL || xbs->pageCrcValid == NULL) {
+      /* Not fatal, we just write everything */
+      free(xbs->pageCrc);
+      free(xbs->pageCrcValid);
+      xbs->pageCrc = NULL;
+      xbs->pageCrcValid = NULL;
+      return 0;
+    }
+  }
+
+  const unsigned int page = addr / page_size;
+  if (page >= xbs->pageCrcCount)
+    return 0;
+
+  if (!xbs->pageCrcValid[page]) {
+    /* Fetch the CRCs of every page in this aligned range */
+    const unsigned int base = addr - addr % XBEE_CRC_RANGE;
+    unsigned int length = m->size - base;
+    if (length > XBEE_CRC_RANGE)
+      length = XBEE_CRC_RANGE;
+
+    const unsigned int first = base / page_size;
+    const unsigned int count = length / page_size;
+    if (xbee_getcrc(pgm, base, length, XBEEBOOT_CRC_PAGES,
+                    &xbs->pageCrc[first], count) < 0)
+      return 0;
+
+    memset(&xbs->pageCrcValid[first], 1, count);
+  }
+
+  return xbs->pageCrc[page] == xbee_crc32(m->buf + addr, n_bytes);
+}
+
+/*
+ * Compress a page for XBEEBOOT_CMD_PROG_PAGE_LZ, greedily taking the
+ * longest copy available at each point.  Returns the compressed
+ * length, which may exceed the page length for incompressible data;
+ * out must allow for that, XBEE_LZ_MAX_OUTPUT bytes for a whole page.
+ */
+static size_t xbee_lz_compress(const unsigned char *page, size_t length,
+                               unsigned char *out)
+{
+  size_t outLength = 0;
+  size_t literalStart = 0;
+  size_t position = 0;
+
+  while (position < length) {
+    size_t bestLength = 0;
+    size_t bestDistance = 0;
+    size_t distance;
+    for (distance = 1; distance <= position &&
+           distance <= XBEE_LZ_MAX_DISTANCE; distance++) {
+      size_t matchLength = 0;
+      while (position + matchLength < length &&
+             matchLength < XBEE_LZ_MAX_MATCH &&
+             page[position + matchLength] ==
+             page[position + matchLength - distance])
+        matchLength++;
+      if (matchLength > bestLength) {
+        bestLength = matchLength;
+        bestDistance = distance;
+      }
+    }
+
+    const size_t literals = position - literalStart;
+    if (bestLength >= XBEE_LZ_MIN_MATCH ||
+        literals == XBEE_LZ_MAX_LITERAL) {
+      if (literals > 0) {
+        out[outLength++] = literals - 1;
+        memcpy(&out[outLength], &page[literalStart], literals);
+        outLength += literals;
+      }
+      literalStart = position;
+    }
+
+    if (bestLength >= XBEE_LZ_MIN_MATCH) {
+      out[outLength++] = 0x80 | (bestLength - XBEE_LZ_MIN_MATCH);
+      out[outLength++] = bestDistance - 1;
+      position += bestLength;
+      literalStart = position;
+    } else {
+      position++;
+    }
+  }
+
+  const size_t literals = position - literalStart;
+  if (literals > 0) {
+    out[outLength++] = literals - 1;
+    memcpy(&out[outLength], &page[literalStart], literals);
+    outLength += literals;
+  }
+
+  return outLength;
+}
+
+/*
+ * Erase a page of flash, leaving it blank.  Returns the bytes sent,
+ * or negative on failure.
+ */
+static int xbee_erase_page(PROGRAMMER *pgm, unsigned int addr)
+{
+  unsigned char buf[2];
+
+  buf[0] = XBEEBOOT_CMD_ERASE_PAGE;
+  buf[1] = Sync_CRC_EOP;
+
+  const int recvRc = xbee_command(pgm, addr, buf, 2, buf, 2);
+  if (recvRc < 0)
+    return recvRc;
+
+  if (buf[0] != Resp_STK_INSYNC || buf[1] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_erase_page(): protocol error "
+                    "erasing 0x%04x: resp=0x%02x 0x%02x\n",
+                    progname, addr,
+                    (unsigned int)buf[0], (unsigned int)buf[1]);
+    return -1;
+  }
+
+  return 2;
+}
+
+/*
+ * Flash page writes are staged, sent without waiting for their
+ * replies, when every target's bootloader can queue more than one of
+ * them while it writes flash (XBEEBOOT_STAGING).  Returns how many
+ * may be outstanding, or zero if they can't be staged.
+ */
+static unsigned int xbee_stage_limit(PROGRAMMER *pgm,
+                                     unsigned int page_size)
+{
+  if (!xbee_pipelined(pgm))
+    return 0;
+
+  unsigned int limit = 0;
+  struct XBeeBootSession *xbs;
+  for (xbs = xbeebootsession(&pgm->fd); xbs != NULL; xbs = xbs->nextSession) {
+    /* LOAD_ADDRESS, then the write with its header and Sync_CRC_EOP */
+    const unsigned int writes = xbs->queueSize / (4 + 5 + page_size);
+    if (limit == 0 || writes < limit)
+      limit = writes;
+  }
+
+  return limit < 2 ? 0 : limit;
+}
+
+/*
+ * Write a page of flash: just erased if it is blank, otherwise
+ * compressed if that is any smaller, otherwise as it is.  Returns the
+ * bytes sent, or negative on failure.
+ */
+static int xbee_write_page(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                           unsigned int page_size,
+                           unsigned int addr, unsigned int n_bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  if ((xbs->capabilities & XBEEBOOT_CAP_ERASE) != 0 &&
+      n_bytes == page_size) {
+    unsigned int index = 0;
+    while (index < n_bytes && m->buf[addr + index] == 0xff)
+      index++;
+
+    if (index == n_bytes) {
+      xbs->pagesErased++;
+      return xbee_erase_page(pgm, addr);
+    }
+  }
+
+  /* Command, length, type and CRC_EOP around the page */
+  unsigned char buf[5 + XBEE_LZ_MAX_OUTPUT];
+
+  size_t compressedLength = 0;
+  if ((xbs->capabilities & XBEEBOOT_CAP_COMPRESS) != 0 &&
+      n_bytes == page_size && n_bytes <= XBEE_LZ_MAX_PAGE)
+    compressedLength = xbee_lz_compress(m->buf + addr, n_bytes, &buf[4]);
+
+  if (compressedLength == 0 || compressedLength >= n_bytes) {
+    if (n_bytes != page_size || n_bytes > XBEE_LZ_MAX_PAGE) {
+      const int rc = stk500_paged_write(pgm, p, m, page_size, addr, n_bytes);
+      return rc < 0 ? rc : (int)n_bytes;
+    }
+
+    /* As stk500_paged_write() would, but pipelined if we can */
+    buf[0] = Cmnd_STK_PROG_PAGE;
+    memcpy(&buf[4], m->buf + addr, n_bytes);
+    compressedLength = n_bytes;
+  } else {
+    buf[0] = XBEEBOOT_CMD_PROG_PAGE_LZ;
+  }
+
+  buf[1] = (n_bytes >> 8) & 0xff;
+  buf[2] = n_bytes & 0xff;
+  buf[3] = 'F';
+  buf[4 + compressedLength] = Sync_CRC_EOP;
+
+  const unsigned int stageLimit = xbee_stage_limit(pgm, page_size);
+  if (stageLimit > 0) {
+    /*
+     * Don't wait for the replies to this LOAD_ADDRESS and write, so
+     * that the next page follows straight on.  They are checked once
+     * stageLimit writes are outstanding, or before anything else is
+     * read.
+     */
+    int rc = xbee_loadaddr_send(pgm, addr);
+    if (rc >= 0)
+      rc = serial_send(&pgm->fd, buf, 5 + compressedLength);
+    if (rc < 0)
+      return rc;
+
+    xbs->stagedReplies += 2;
+    rc = xbeedev_collect(xbs, 2 * (stageLimit - 1));
+    return rc < 0 ? rc : (int)compressedLength;
+  }
+
+  const int recvRc =
+    xbee_command(pgm, addr, buf, 5 + compressedLength, buf, 2);
+  if (recvRc < 0)
+    return recvRc;
+
+  if (buf[0] != Resp_STK_INSYNC || buf[1] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_write_page(): protocol error "
+                    "writing 0x%04x: resp=0x%02x 0x%02x\n",
+                    progname, addr,
+                    (unsigned int)buf[0], (unsigned int)buf[1]);
+    return -1;
+  }
+
+  return compressedLength;
+}
+
+/*
+ * Fleet mode is used to write flash to several targets at once, when
+ * every one of them supports it.
+ */
+static int xbee_fleet_usable(PROGRAMMER *pgm, unsigned int page_size,
+                             unsigned int addr, unsigned int n_bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  if (xbs->nextSession == NULL || xbs->directMode ||
+      (pgm->flag & XBEE_FLAG_FLEET_MASK) == 0 ||
+      n_bytes != page_size || addr % XBEEBOOT_FLEET_CHUNK != 0 ||
+      n_bytes % XBEEBOOT_FLEET_CHUNK != 0)
+    return 0;
+
+  struct XBeeBootSession *session;
+  for (session = xbs; session != NULL; session = session->nextSession)
+    if ((session->capabilities & XBEEBOOT_CAP_FLEET) == 0)
+      return 0;
+
+  return 1;
+}
+
+/*
+ * Send one chunk of the fleet image, broadcast or to a single target,
+ * then give the mesh and XBeeBoot time to deal with it.
+ */
+static int xbee_fleet_send_chunk(PROGRAMMER *pgm,
+                                 struct XBeeBootSession *xbs,
+                                 int broadcast, unsigned int chunk)
+{
+  struct XBeeBootSession *primary = xbs->primary;
+
+  const int rc = sendFleetPacket(xbs, broadcast,
+                                 broadcast ? "FLEET_CHUNK broadcast" :
+                                 "FLEET_CHUNK repair",
+                                 XBEEBOOT_PACKET_TYPE_FLEET_CHUNK, chunk,
+                                 XBEEBOOT_FLEET_CHUNK,
+                                 primary->fleetImage +
+                                 chunk * XBEEBOOT_FLEET_CHUNK);
+
+  usleep(1000 * ((pgm->flag & XBEE_FLAG_FLEET_MASK) >>
+                 XBEE_FLAG_FLEET_SHIFT));
+  return rc;
+}
+
+/*
+ * Broadcast a page of flash to every target.  Returns the bytes sent,
+ * or negative on failure.
+ */
+static int xbee_fleet_broadcast(PROGRAMMER *pgm, AVRMEM *m,
+                                unsigned int addr, unsigned int n_bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  if (xbs->fleetImage == NULL) {
+    xbs->fleetChunks = m->size / XBEEBOOT_FLEET_CHUNK;
+    xbs->fleetImage = malloc(m->size);
+    xbs->fleetSent = calloc(xbs->fleetChunks, 1);
+
+    struct XBeeBootSession *session;
+    for (session = xbs; session != NULL; session = session->nextSession) {
+      session->fleetMissing = calloc(xbs->fleetChunks, 1);
+      if (session->fleetMissing == NULL)
+        break;
+    }
+
+    if (xbs->fleetImage == NULL || xbs->fleetSent == NULL ||
+        session != NULL) {
+      avrdude_message(MSG_INFO, "%s: xbee_fleet_broadcast(): "
+                      "out of memory\n", progname);
+
+      /* Leave nothing half allocated for the next page to find */
+      free(xbs->fleetImage);
+      xbs->fleetImage = NULL;
+      free(xbs->fleetSent);
+      xbs->fleetSent = NULL;
+      for (session = xbs; session != NULL; session = session->nextSession) {
+        free(session->fleetMissing);
+        session->fleetMissing = NULL;
+      }
+      return -1;
+    }
+  }
+
+  if (addr + n_bytes > xbs->fleetChunks * XBEEBOOT_FLEET_CHUNK)
+    return -1;
 
-      struct timeval sendTime;
-      gettimeofday(&sendTime, NULL);
+  memcpy(xbs->fleetImage + addr, m->buf + addr, n_bytes);
 
-      /*
-       * Optimistic records should never be treated as retries,
-       * because they might simply be guessing too optimistically.
-       */
-      xbeedev_stats_send(xbs, "send() hints possible triggered RECEIVE",
-                         nextSequence,
-                         XBEE_STATS_RECEIVE,
-                         nextSequence, 0, &sendTime);
-    }
+  unsigned int chunk;
+  for (chunk = addr / XBEEBOOT_FLEET_CHUNK;
+       chunk < (addr + n_bytes) / XBEEBOOT_FLEET_CHUNK; chunk++) {
+    const int rc = xbee_fleet_send_chunk(pgm, xbs, 1, chunk);
+    if (rc < 0)
+      return rc;
+    xbs->fleetSent[chunk] = 1;
+    xbs->fleetBroadcasts++;
+  }
 
-    /*
-     * Chunk the data into chunks of up to XBEEBOOT_MAX_CHUNK bytes.
-     */
-    unsigned char maximum_chunk = XBEEBOOT_MAX_CHUNK;
+  xbs->fleetPending = 1;
+  return n_bytes;
+}
 
-    /*
-     * Source routing incurs a two byte fixed overhead, plus a two
-     * byte additional cost per intermediate hop.
-     *
-     * We are attempting to avoid fragmentation here, so resize our
-     * maximum size to anticipate the overhead of the current number
-     * of hops.  If our maximum chunk would be less than one, just
-     * give up and hope fragmentation will somehow save us.
-     */
-    const int hops = xbs->sourceRouteHops;
-    if (hops > 0 && (hops * 2 + 2) < XBEEBOOT_MAX_CHUNK)
-      maximum_chunk -= hops * 2 + 2;
+/*
+ * Ask one target which fleet chunks it is missing, noting those that
+ * were sent in its fleetMissing.  Returns how many, or negative on
+ * failure.
+ */
+static int xbee_fleet_query(struct XBeeBootSession *primary,
+                            struct XBeeBootSession *target)
+{
+  unsigned int start = 0;
+  int missing = 0;
 
-    const unsigned char blockLength =
-      (buflen > maximum_chunk) ? maximum_chunk : buflen;
+  memset(target->fleetMissing, 0, primary->fleetChunks);
 
-    int pollRc = 0;
+  /* Only ask about chunks up to the last one broadcast */
+  unsigned int end = primary->fleetChunks;
+  while (end > 0 && !primary->fleetSent[end - 1])
+    end--;
+
+  while (start < end) {
+    const unsigned char endBytes[2] = { end & 0xff, (end >> 8) & 0xff };
+    unsigned int first = end;
 
-    /* Repeatedly send whilst timing out waiting for ACK responses. */
     int retries;
-    for (retries = 0; retries < XBEE_MAX_RETRIES; retries++) {
-      int sendRc =
-        sendPacket(xbs,
-                   "Transmit Request Data, expect ACK for TRANSMIT",
-                   XBEEBOOT_PACKET_TYPE_REQUEST, sequence,
-                   retries > 0 ? XBEE_STATS_IS_RETRY : XBEE_STATS_NOT_RETRY,
-                   23 /* FIRMWARE_DELIVER */,
-                   blockLength, buf);
-      if (sendRc < 0) {
-        /* There is no way to recover from a failure mid-send */
-        xbs->transportUnusable = 1;
-        return sendRc;
+    for (retries = 0; ; retries++) {
+      if (retries == XBEE_MAX_RETRIES) {
+        avrdude_message(MSG_INFO, "%s: xbee_fleet_query(): no reply "
+                        "to FLEET_QUERY\n", progname);
+        return -1;
       }
 
-      pollRc = xbeedev_poll(xbs, NULL, NULL, sequence, -1);
-      if (pollRc == 0) {
-        /* Send was ACK'd */
-        buflen -= blockLength;
-        buf += blockLength;
-        break;
-      }
+      target->fleetNackValid = 0;
+      const int sendRc = sendFleetPacket(target, 0, "FLEET_QUERY",
+                                         XBEEBOOT_PACKET_TYPE_FLEET_QUERY,
+                                         start, sizeof(endBytes), endBytes);
+      if (sendRc < 0)
+        return sendRc;
 
-      /*
-       * Test the connection to the local XBee by repeatedly
-       * requesting local configuration details.  This functionally
-       * has no effect, but will allow us to measure any reliability
-       * issues on this link.
-       */
-      localAsyncAT(xbs, "Local XBee ping [send]", 'A', 'P', -1);
+      serial_recv_timeout = XBEE_MAX_TIMEOUT_MS;
+      while (!target->fleetNackValid &&
+             xbeedev_poll(primary, XBEE_WAIT_ANY, -1) >= 0);
 
-      /*
-       * If we don't receive an ACK it might be because the chip
-       * missed an ACK from us.  Resend that too after a timeout,
-       * unless it's zero which is an illegal sequence number.
-       */
-      if (xbs->inSequence != 0) {
-        int ackRc = sendPacket(xbs,
-                               "Transmit Request ACK [Retry in send] "
-                               "for RECEIVE",
-                               XBEEBOOT_PACKET_TYPE_ACK,
-                               xbs->inSequence,
-                               XBEE_STATS_IS_RETRY,
-                               -1, 0, NULL);
-        if (ackRc < 0) {
-          /* There is no way to recover from a failure mid-send */
-          xbs->transportUnusable = 1;
-          return ackRc;
-        }
+      if (target->fleetNackValid) {
+        first = target->fleetNack[1] | target->fleetNack[2] << 8;
+        if (first >= start)
+          break;
+        /* A late reply to an earlier query */
       }
     }
 
-    if (pollRc < 0) {
-      /* There is no way to recover from a failure mid-send */
-      xbs->transportUnusable = 1;
-      return pollRc;
+    if (first >= end)
+      break;
+
+    unsigned int index;
+    for (index = 0; index < 8 * XBEEBOOT_FLEET_NACK; index++) {
+      const unsigned int chunk = first + index;
+      if (chunk < end && primary->fleetSent[chunk] &&
+          (target->fleetNack[3 + index / 8] & (1 << (index % 8)))) {
+        target->fleetMissing[chunk] = 1;
+        missing++;
+      }
     }
+
+    start = first + 8 * XBEEBOOT_FLEET_NACK;
   }
 
-  return 0;
+  return missing;
 }
 
-static int xbeedev_recv(union filedescriptor *fdp,
-                        unsigned char *buf, size_t buflen)
+/*
+ * Make sure every target has every chunk broadcast so far.  Chunks
+ * missed by more than one target are broadcast again, and chunks
+ * missed by one target are sent to it alone.  This must be done
+ * before any other flash access, as XBeeBoot gathers fleet chunks in
+ * the same buffer it uses for STK500 page writes.
+ */
+static int xbee_fleet_repair(PROGRAMMER *pgm)
 {
-  struct XBeeBootSession *xbs = xbeebootsession(fdp);
-
-  /*
-   * First de-buffer anything previously received in a chunk that
-   * couldn't be immediately delievered.
-   */
-  while (xbs->inInIndex != xbs->inOutIndex) {
-    *buf++ = xbs->inBuffer[xbs->inOutIndex++];
-    if (xbs->inOutIndex == sizeof(xbs->inBuffer))
-      xbs->inOutIndex = 0;
-    if (--buflen == 0)
-      return 0;
-  }
-
-  if (xbs->transportUnusable)
-    /* Don't attempt to continue on an unusable transport layer */
-    return -1;
-
-  /*
-   * When we expect to receive data, that is the time to start the
-   * clock.
-   */
-  {
-    unsigned char nextSequence = xbs->inSequence;
-    while ((++nextSequence & 0xff) == 0);
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
 
-    struct timeval sendTime;
-    gettimeofday(&sendTime, NULL);
+  if (!xbs->fleetPending)
+    return 0;
 
-    /*
-     * Not a retry - in fact this is the first stage we know for sure
-     * a RECEIVE is due.
-     */
-    xbeedev_stats_send(xbs, "recv() implies pending RECEIVE",
-                       nextSequence,
-                       XBEE_STATS_RECEIVE,
-                       nextSequence,
-                       XBEE_STATS_NOT_RETRY,
-                       &sendTime);
-  }
+  int round;
+  for (round = 0; round < XBEE_FLEET_ROUNDS; round++) {
+    struct XBeeBootSession *session;
+    int outstanding = 0;
+    for (session = xbs; session != NULL; session = session->nextSession) {
+      const int missing = xbee_fleet_query(xbs, session);
+      if (missing < 0)
+        return missing;
+      outstanding += missing;
+    }
 
-  int retries;
-  for (retries = 0; retries < XBEE_MAX_RETRIES; retries++) {
-    const int rc = xbeedev_poll(xbs, &buf, &buflen, -1, -1);
-    if (rc == 0)
+    if (outstanding == 0) {
+      xbs->fleetPending = 0;
+      avrdude_message(MSG_INFO, "%s: Fleet: %lu chunks broadcast, "
+                      "%lu broadcast again, %lu sent to single targets\n",
+                      progname, xbs->fleetBroadcasts,
+                      xbs->fleetRebroadcasts, xbs->fleetUnicasts);
       return 0;
+    }
 
-    if (xbs->transportUnusable)
-      /* Don't attempt to continue on an unusable transport layer */
-      return -1;
-
-    /*
-     * Test the connection to the local XBee by repeatedly
-     * requesting local configuration details.  This functionally
-     * has no effect, but will allow us to measure any reliability
-     * issues on this link.
-     */
-    localAsyncAT(xbs, "Local XBee ping [recv]", 'A', 'P', -1);
+    avrdude_message(MSG_NOTICE, "%s: Fleet repair round %d: "
+                    "%d chunks missing\n",
+                    progname, round + 1, outstanding);
+
+    unsigned int chunk;
+    for (chunk = 0; chunk < xbs->fleetChunks; chunk++) {
+      struct XBeeBootSession *lacking = NULL;
+      int count = 0;
+      for (session = xbs; session != NULL; session = session->nextSession) {
+        if (session->fleetMissing[chunk]) {
+          lacking = session;
+          count++;
+        }
+      }
 
-    /*
-     * The chip may have missed an ACK from us.  Resend after a
-     * timeout.
-     */
-    if (xbs->inSequence != 0)
-      sendPacket(xbs, "Transmit Request ACK [Retry in recv] for RECEIVE",
-                 XBEEBOOT_PACKET_TYPE_ACK, xbs->inSequence,
-                 XBEE_STATS_IS_RETRY,
-                 -1, 0, NULL);
+      int rc = 0;
+      if (count > 1) {
+        rc = xbee_fleet_send_chunk(pgm, xbs, 1, chunk);
+        xbs->fleetRebroadcasts++;
+      } else if (count == 1) {
+        rc = xbee_fleet_send_chunk(pgm, lacking, 0, chunk);
+        xbs->fleetUnicasts++;
+      }
+      if (rc < 0)
+        return rc;
+    }
   }
+
+  avrdude_message(MSG_INFO, "%s: xbee_fleet_repair(): targets still "
+                  "missing data after %d rounds\n",
+                  progname, XBEE_FLEET_ROUNDS);
   return -1;
 }
 
-static int xbeedev_drain(union filedescriptor *fdp, int display)
+/*
+ * Write flash as STK500 does, but skip pages the device already holds,
+ * and remember what was written so that the verify pass can compare
+ * CRCs.
+ */
+static int xbee_paged_write(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                            unsigned int page_size,
+                            unsigned int addr, unsigned int n_bytes)
 {
-  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
 
-  if (xbs->transportUnusable)
-    /* Don't attempt to continue on an unusable transport layer */
-    return -1;
+  const int fleet = strcmp(m->desc, "flash") == 0 &&
+    xbee_fleet_usable(pgm, page_size, addr, n_bytes);
 
-  /*
-   * Flushing the local serial buffer is unhelpful under this
-   * protocol.
-   */
-  do {
-    xbs->inOutIndex = xbs->inInIndex = 0;
-  } while (xbeedev_poll(xbs, NULL, NULL, -1, -1) == 0);
+  if (!fleet) {
+    const int repairRc = xbee_fleet_repair(pgm);
+    if (repairRc < 0)
+      return repairRc;
+  }
 
-  return 0;
-}
+  if (strcmp(m->desc, "flash") != 0 ||
+      (xbs->capabilities & (XBEEBOOT_CAP_WINDOW | XBEEBOOT_CAP_CRC |
+                            XBEEBOOT_CAP_COMPRESS | XBEEBOOT_CAP_ERASE |
+                            XBEEBOOT_CAP_FLEET)) == 0)
+    return stk500_paged_write(pgm, p, m, page_size, addr, n_bytes);
 
-static int xbeedev_set_dtr_rts(union filedescriptor *fdp, int is_on)
-{
-  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+  if ((xbs->capabilities & XBEEBOOT_CAP_CRC) != 0 &&
+      xbee_page_unchanged(pgm, m, page_size, addr, n_bytes)) {
+    xbs->pagesSkipped++;
+    xbs->bytesSkipped += n_bytes;
+  } else {
+    struct timeval start, end, elapsed;
+    gettimeofday(&start, NULL);
+
+    const int sent = fleet ?
+      xbee_fleet_broadcast(pgm, m, addr, n_bytes) :
+      xbee_write_page(pgm, p, m, page_size, addr, n_bytes);
+    if (sent < 0)
+      return sent;
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &elapsed);
+    timeradd(&xbs->writeTime, &elapsed, &xbs->writeTime);
+
+    xbs->pagesWritten++;
+    xbs->bytesWritten += n_bytes;
+    xbs->bytesSent += sent;
+  }
 
-  if (xbs->directMode)
-    /* Correct for direct mode */
-    return xbs->serialDevice->set_dtr_rts(&xbs->serialDescriptor, is_on);
+  const int rc = n_bytes;
+  if ((xbs->capabilities & XBEEBOOT_CAP_CRC) == 0)
+    return rc;
 
-  /*
-   * For non-direct mode (Over-The-Air) we need to issue XBee commands
-   * to the remote XBee in order to reset the AVR CPU and initiate the
-   * XBeeBoot bootloader.
-   */
-  const int rc = sendAT(xbs, is_on ? "AT [DTR]=low" : "AT [DTR]=high",
-                        'D', '0' + xbs->xbeeResetPin, is_on ? 5 : 4);
-  if (rc < 0) {
-    if (xbeeATError(rc))
-      return -1;
+  if (xbs->shadow == NULL) {
+    xbs->shadow = malloc(m->size);
+    xbs->shadowValid = calloc(m->size, 1);
+    if (xbs->shadow == NULL || xbs->shadowValid == NULL) {
+      /* Not fatal, we just verify the slow way */
+      free(xbs->shadow);
+      free(xbs->shadowValid);
+      xbs->shadow = NULL;
+      xbs->shadowValid = NULL;
+      return rc;
+    }
+    xbs->shadowSize = m->size;
+  }
 
-    avrdude_message(MSG_INFO,
-                    "%s: Remote XBee is not responding.\n", progname);
-    return rc;
+  if (addr + n_bytes <= xbs->shadowSize) {
+    memcpy(xbs->shadow + addr, m->buf + addr, n_bytes);
+    memset(xbs->shadowValid + addr, 1, n_bytes);
   }
 
-  return 0;
+  /* Anything previously verified may have changed */
+  xbs->verifiedStart = xbs->verifiedEnd = 0;
+
+  return rc;
 }
 
 /*
- * Device descriptor for XBee framing.
+ * Read flash back for verification.  Where we know what was written,
+ * compare a CRC computed by XBeeBoot instead of reading the flash
+ * back over the air, falling back to reading it on a mismatch.
  */
-static struct serial_device xbee_serdev_frame = {
-  .open = xbeedev_open,
-  .close = xbeedev_close,
-  .send = xbeedev_send,
-  .recv = xbeedev_recv,
-  .drain = xbeedev_drain,
-  .set_dtr_rts = xbeedev_set_dtr_rts,
-  .flags = SERDEV_FL_NONE,
-};
-
-static int xbee_getsync(PROGRAMMER *pgm)
+static int xbee_paged_load(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                           unsigned int page_size,
+                           unsigned int addr, unsigned int n_bytes)
 {
-  unsigned char buf[2], resp[2];
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
 
-  /*
-   * Issue sync request as per STK500.  Unlike stk500_getsync(), don't
-   * retry here - the underlying protocol will deal with retries for
-   * us in xbeedev_send() and should be reliable.
-   */
-  buf[0] = Cmnd_STK_GET_SYNC;
-  buf[1] = Sync_CRC_EOP;
+  const int repairRc = xbee_fleet_repair(pgm);
+  if (repairRc < 0)
+    return repairRc;
 
-  int sendRc = serial_send(&pgm->fd, buf, 2);
-  if (sendRc < 0) {
-    avrdude_message(MSG_INFO,
-                    "%s: xbee_getsync(): failed to deliver STK_GET_SYNC "
-                    "to the remote XBeeBoot bootloader\n",
-                    progname);
-    return sendRc;
-  }
+  if (xbs->shadow == NULL || strcmp(m->desc, "flash") != 0 ||
+      addr + n_bytes > xbs->shadowSize ||
+      memchr(xbs->shadowValid + addr, 0, n_bytes) != NULL)
+    /* We don't know what this range should hold */
+    return stk500_paged_load(pgm, p, m, page_size, addr, n_bytes);
 
-  /*
-   * The same is true of the receive - it will retry on timeouts until
-   * the response buffer is full.
-   */
-  int recvRc = serial_recv(&pgm->fd, resp, 2);
-  if (recvRc < 0) {
-    avrdude_message(MSG_INFO,
-                    "%s: xbee_getsync(): no response to STK_GET_SYNC "
-                    "from the remote XBeeBoot bootloader\n",
-                    progname);
-    return recvRc;
-  }
+  if (addr < xbs->verifiedStart || addr + n_bytes > xbs->verifiedEnd) {
+    /*
+     * Check as much as we can in one request: the rest of this
+     * aligned range, so long as we know what it should hold.
+     */
+    const unsigned int limit = (addr / XBEE_CRC_RANGE + 1) * XBEE_CRC_RANGE;
+    unsigned int end = addr + n_bytes;
+    while (end < limit && end < xbs->shadowSize && xbs->shadowValid[end])
+      end++;
 
-  if (resp[0] != Resp_STK_INSYNC) {
-    avrdude_message(MSG_INFO, "%s: xbee_getsync(): not in sync: resp=0x%02x\n",
-                    progname, (unsigned int)resp[0]);
-    return -1;
-  }
+    unsigned long crc;
+    if (xbee_getcrc(pgm, addr, end - addr, XBEEBOOT_CRC_RANGE, &crc, 1) < 0)
+      return -1;
 
-  if (resp[1] != Resp_STK_OK) {
-    avrdude_message(MSG_INFO, "%s: xbee_getsync(): in sync, not OK: "
-                    "resp=0x%02x\n",
-                    progname, (unsigned int)resp[1]);
-    return -1;
+    const unsigned long expected = xbee_crc32(xbs->shadow + addr,
+                                              end - addr);
+    if (crc != expected) {
+      avrdude_message(MSG_NOTICE, "%s: CRC mismatch for 0x%04x-0x%04x, "
+                      "reading back\n",
+                      progname, addr, end - 1);
+      return stk500_paged_load(pgm, p, m, page_size, addr, n_bytes);
+    }
+
+    xbs->verifiedStart = addr;
+    xbs->verifiedEnd = end;
   }
 
-  return 0;
+  memcpy(m->buf + addr, xbs->shadow + addr, n_bytes);
+  return n_bytes;
 }
 
 static int xbee_open(PROGRAMMER *pgm, char *port)
@@ -1642,8 +4522,12 @@ static int xbee_open(PROGRAMMER *pgm, char *port)
   strcpy(pgm->port, port);
   pinfo.baud = pgm->baudrate;
 
-  /* Wireless is lossier than normal serial */
-  serial_recv_timeout = 1000;
+  /*
+   * Wireless is lossier than normal serial.  This is only the
+   * starting point, once we have measured the round trip time to
+   * XBeeBoot the timeout is adapted to suit.
+   */
+  serial_recv_timeout = XBEE_MAX_TIMEOUT_MS;
 
   serdev = &xbee_serdev_frame;
 
@@ -1657,7 +4541,15 @@ static int xbee_open(PROGRAMMER *pgm, char *port)
    * can use the private "flag" field in the PROGRAMMER though, as
    * it's unused by stk500.c.
    */
-  xbeedev_setresetpin(&pgm->fd, pgm->flag);
+  xbeedev_setresetpin(&pgm->fd, pgm->flag & XBEE_FLAG_RESETPIN_MASK);
+
+  if (xbeedev_localbaud(&pgm->fd,
+                        ((pgm->flag & XBEE_FLAG_LOCALBAUD_MASK) >>
+                         XBEE_FLAG_LOCALBAUD_SHIFT) - 1) < 0)
+    return -1;
+
+  if ((pgm->flag & XBEE_FLAG_API1) != 0 && xbeedev_api1(&pgm->fd) < 0)
+    return -1;
 
   /* Clear DTR and RTS */
   serial_set_dtr_rts(&pgm->fd, 0);
@@ -1677,6 +4569,12 @@ static int xbee_open(PROGRAMMER *pgm, char *port)
   if (xbee_getsync(pgm) < 0)
     return -1;
 
+  if (xbee_getcapabilities(pgm) < 0)
+    return -1;
+
+  if (xbee_upshift(pgm) < 0)
+    return -1;
+
   return 0;
 }
 
@@ -1684,12 +4582,48 @@ static void xbee_close(PROGRAMMER *pgm)
 {
   struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
 
+  if (xbeedev_collect(xbs, 0) < 0)
+    avrdude_message(MSG_INFO, "%s: Staged flash writes may not have "
+                    "completed\n", progname);
+
+  /* Nothing else has checked what was broadcast, when not verifying */
+  if (xbee_fleet_repair(pgm) < 0)
+    avrdude_message(MSG_INFO, "%s: Fleet mode targets may not hold the "
+                    "complete image\n", progname);
+
   /*
    * NB: This request is for the target device, not the locally
    * connected serial device.
    */
   serial_set_dtr_rts(&pgm->fd, 0);
 
+  if (xbs->pagesSkipped > 0)
+    avrdude_message(MSG_INFO, "%s: %u of %u flash pages unchanged, "
+                    "%lu bytes not sent\n",
+                    progname, xbs->pagesSkipped,
+                    xbs->pagesSkipped + xbs->pagesWritten,
+                    xbs->bytesSkipped);
+
+  if (xbs->pagesErased > 0)
+    avrdude_message(MSG_INFO, "%s: %u blank flash pages erased without "
+                    "sending data\n",
+                    progname, xbs->pagesErased);
+
+  if (xbs->bytesSent < xbs->bytesWritten)
+    avrdude_message(MSG_INFO, "%s: %lu flash bytes sent as %lu, "
+                    "writing took %lu.%03lus\n",
+                    progname, xbs->bytesWritten, xbs->bytesSent,
+                    (unsigned long)xbs->writeTime.tv_sec,
+                    (unsigned long)xbs->writeTime.tv_usec / 1000);
+
+  if (xbs->bytesWritten > 0)
+    avrdude_message(MSG_INFO, "%s: XBee API mode %d, %lu serial bytes "
+                    "sent with %lu escapes, %lu received with %lu "
+                    "escapes\n",
+                    progname, xbs->apiMode,
+                    xbs->serialSent, xbs->serialSentEscapes,
+                    xbs->serialReceived, xbs->serialReceivedEscapes);
+
   /*
    * We have tweaked a few settings on the XBee, including the RTS
    * mode and the reset pin's configuration.  Do a soft full reset,
@@ -1699,22 +4633,57 @@ static void xbee_close(PROGRAMMER *pgm)
    * uncontactable until it has restarted and re-established
    * communications on the mesh.
    */
+  struct XBeeBootSession *session;
   if (!xbs->directMode) {
-    const int rc = sendAT(xbs, "AT FR", 'F', 'R', -1);
+    /*
+     * AT FR alone would restore BD, but setting it first leaves the
+     * XBee matching XBeeBoot after a reset even if the AT FR is lost.
+     */
+    for (session = xbs; session != NULL; session = session->nextSession) {
+      if (session->remoteBaud >= 0)
+        xbeeATError(xbeedev_at_start(session, 1, "AT BD", 'B', 'D',
+                                     session->remoteBaud));
+    }
+
+    xbeedev_at_wait(xbs);
+
+    for (session = xbs; session != NULL; session = session->nextSession) {
+      if (session->remoteBaud >= 0)
+        xbeeATError(xbeedev_at_result(session));
+    }
+
+    const int rc = sendATAll(xbs, "AT FR", 'F', 'R', -1);
     xbeeATError(rc);
   }
 
+  /* Leave the local XBee in API mode 2, as xbeedev_open() expects */
+  if (xbs->apiMode == 1 && !xbs->directMode &&
+      localAT(xbs, "AT AP=2", 'A', 'P', 2) == 0 && xbs->atStatus == 0)
+    /* Escape what follows, such as the BD below, to match */
+    xbs->apiMode = 2;
+
+  /* ... and at its original rate, taking effect after the reply */
+  if (xbs->localBaud >= 0)
+    localAT(xbs, "AT BD", 'B', 'D', xbs->localBaud);
+
   avrdude_message(MSG_NOTICE, "%s: Statistics for FRAME_LOCAL requests - %s->XBee(local)\n", progname, progname);
   xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_FRAME_LOCAL]);
 
   avrdude_message(MSG_NOTICE, "%s: Statistics for FRAME_REMOTE requests - %s->XBee(local)->XBee(target)\n", progname, progname);
   xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_FRAME_REMOTE]);
 
-  avrdude_message(MSG_NOTICE, "%s: Statistics for TRANSMIT requests - %s->XBee(local)->XBee(target)->XBeeBoot\n", progname, progname);
-  xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_TRANSMIT]);
+  for (session = xbs; session != NULL; session = session->nextSession) {
+    char text[XBEE_ADDRESS_STRING_LEN];
+    if (xbs->nextSession != NULL)
+      avrdude_message(MSG_NOTICE, "%s: Statistics for target %s\n",
+                      progname, xbeedev_address_string(session, text));
+
+    avrdude_message(MSG_NOTICE, "%s: Statistics for TRANSMIT requests - %s->XBee(local)->XBee(target)->XBeeBoot\n", progname, progname);
+    xbeeStatsSummarise(&session->groupSummary[XBEE_STATS_TRANSMIT]);
 
-  avrdude_message(MSG_NOTICE, "%s: Statistics for RECEIVE requests - XBeeBoot->XBee(target)->XBee(local)->%s\n", progname, progname);
-  xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_RECEIVE]);
+    avrdude_message(MSG_NOTICE, "%s: Statistics for RECEIVE requests - XBeeBoot->XBee(target)->XBee(local)->%s\n", progname, progname);
+    xbeeStatsSummarise(&session->groupSummary[XBEE_STATS_RECEIVE]);
+  }
 
   xbeedev_free(xbs);
 
@@ -1742,7 +4711,109 @@ static int xbee_parseextparms(PROGRAMMER *pgm, LISTID extparms)
         continue;
       }
 
-      pgm->flag = resetpin;
+      pgm->flag = (pgm->flag & ~XBEE_FLAG_RESETPIN_MASK) | resetpin;
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeewindow=", 11 /*strlen("xbeewindow=")*/) == 0) {
+      int window;
+      if (sscanf(extended_param, "xbeewindow=%i", &window) != 1 ||
+          window <= 0 || window > XBEE_MAX_WINDOW) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeewindow '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      pgm->flag = (pgm->flag & ~XBEE_FLAG_WINDOW_MASK) |
+        (window << XBEE_FLAG_WINDOW_SHIFT);
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeefleet=", 10 /*strlen("xbeefleet=")*/) == 0) {
+      int delay;
+      if (sscanf(extended_param, "xbeefleet=%i", &delay) != 1 ||
+          delay < 0 ||
+          delay > (XBEE_FLAG_FLEET_MASK >> XBEE_FLAG_FLEET_SHIFT)) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeefleet '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      pgm->flag = (pgm->flag & ~XBEE_FLAG_FLEET_MASK) |
+        (delay << XBEE_FLAG_FLEET_SHIFT);
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeeapimode=", 12 /*strlen("xbeeapimode=")*/) == 0) {
+      int apiMode;
+      if (sscanf(extended_param, "xbeeapimode=%i", &apiMode) != 1 ||
+          apiMode < 1 || apiMode > 2) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeeapimode '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      if (apiMode == 1)
+        pgm->flag |= XBEE_FLAG_API1;
+      else
+        pgm->flag &= ~XBEE_FLAG_API1;
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeebaud=", 9 /*strlen("xbeebaud=")*/) == 0) {
+      long baud;
+      int bd = XBEE_MAX_BD;
+      if (sscanf(extended_param, "xbeebaud=%li", &baud) == 1)
+        while (bd >= 0 && xbeeBaudRates[bd] != baud)
+          bd--;
+      else
+        baud = -1;
+
+      if (baud < 0 || (baud > 0 && bd < 0)) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeebaud '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      /* Zero leaves the rate alone */
+      pgm->flag = (pgm->flag & ~XBEE_FLAG_BAUD_MASK) |
+        ((baud > 0 ? bd + 1 : 0) << XBEE_FLAG_BAUD_SHIFT);
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeelocalbaud=", 14 /*strlen("xbeelocalbaud=")*/) == 0) {
+      long baud;
+      int bd = XBEE_MAX_BD;
+      if (sscanf(extended_param, "xbeelocalbaud=%li", &baud) == 1)
+        while (bd >= 0 && xbeeBaudRates[bd] != baud)
+          bd--;
+      else
+        baud = -1;
+
+      if (baud < 0 || (baud > 0 && bd < 0)) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeelocalbaud '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      /* Zero leaves the rate alone */
+      pgm->flag = (pgm->flag & ~XBEE_FLAG_LOCALBAUD_MASK) |
+        ((baud > 0 ? bd + 1 : 0) << XBEE_FLAG_LOCALBAUD_SHIFT);
       continue;
     }
 
@@ -1771,6 +4842,11 @@ void xbee_initpgm(PROGRAMMER *pgm)
   pgm->open = xbee_open;
   pgm->close = xbee_close;
 
+  stk500_paged_write = pgm->paged_write;
+  stk500_paged_load = pgm->paged_load;
+  pgm->paged_write = xbee_paged_write;
+  pgm->paged_load = xbee_paged_load;
+
   /*
    * NB: Because we are making use of the STK500 programmer
    * implementation, we can't readily use pgm->cookie ourselves, nor
@@ -1779,5 +4855,6 @@ void xbee_initpgm(PROGRAMMER *pgm)
    * stk500.c.
    */
   pgm->parseextparams = xbee_parseextparms;
-  pgm->flag = XBEE_DEFAULT_RESET_PIN;
+  pgm->flag = XBEE_DEFAULT_RESET_PIN |
+    (XBEE_FLEET_DEFAULT_DELAY_MS << XBEE_FLAG_FLEET_SHIFT);
 }
@@ -0,0 +1,124 @@
+#!/bin/sh
+#
+# Upload benchmark for the XBeeBoot host transport.
+#
+# Each image is written and verified through avrdude's xbee programmer
+# against xbeesim, a fresh emulated mesh per image, and one line of
+# results is printed per image:
+#
+#   bytes    data bytes in the image
+#   seconds  wall time of the avrdude run
+#   bytes/s  goodput, image bytes over wall time
+#   packets  ZigBee transmit requests issued by avrdude (data and ACKs)
+#   retrans  XBeeBoot data packets avrdude sent more than once
+#   rtts     STK500 command and reply round trips, pipelined or not
+#
+# All three counts are xbeesim's own statistics.  The chaucer images built
+# by the Makefile are packed sketch text, not compiled firmware, so
+# they measure the transport only: how well XBEEBOOT_COMPRESS or page
+# skipping with XBEEBOOT_CRC would do on real firmware can't be judged
+# from them.  Pass avr-gcc built images to measure that.
+#
+# Usage: bench.sh image.hex...
+#
+# Environment:
+#   AVRDUDE   avrdude built with xbeeboot/avrdude/xbee.c (default: avrdude)
+#   XBEESIM   xbeesim binary (default: ../xbeesim/xbeesim)
+#   SIMFLAGS  extra xbeesim options, for example "-W -h 3 -p 2"
+#   AVRFLAGS  extra avrdude options, for example "-x xbeewindow=2"
+#   ADDRESS   64-bit address of the emulated target
+
+here=$(dirname "$0")
+AVRDUDE=${AVRDUDE:-avrdude}
+XBEESIM=${XBEESIM:-$here/../xbeesim/xbeesim}
+ADDRESS=${ADDRESS:-0013A20000000001}
+
+if [ $# -eq 0 ]; then
+    echo "Usage: $0 image.hex..." >&2
+    exit 1
+fi
+
+if ! command -v "$AVRDUDE" >/dev/null 2>&1; then
+    echo "$0: $AVRDUDE not found, set AVRDUDE" >&2
+    exit 1
+fi
+
+if [ ! -x "$XBEESIM" ]; then
+    echo "$0: $XBEESIM not found, run make in xbeeboot/xbeesim" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Count the data bytes in an Intel HEX file
+imageBytes() {
+    awk 'function nibble(c) { return index("0123456789ABCDEF", c) - 1 }
+         function hex(s) { return nibble(substr(s, 1, 1)) * 16 + nibble(substr(s, 2, 1)) }
+         /^:/ && substr($0, 8, 2) == "00" { n += hex(toupper(substr($0, 2, 2))) }
+         END { print n + 0 }' "$1"
+}
+
+# Pick a value out of the xbeesim statistics
+simStat() {
+    sed -n "s/^xbeesim: $1: //p" "$tmp/sim.log"
+}
+
+failed=0
+
+printf "%-16s %-7s %7s %8s %8s %8s %8s %8s  %s\n" \
+       image part bytes seconds bytes/s packets retrans rtts result
+
+for image in "$@"; do
+    bytes=$(imageBytes "$image")
+
+    # Allow for the bootloader at the top of a 32kB part
+    if [ "$bytes" -le 31744 ]; then
+        part=m328p
+    else
+        part=m1284p
+    fi
+
+    rm -f "$tmp/xbee"
+    # shellcheck disable=SC2086
+    "$XBEESIM" -L "$tmp/xbee" -d $part $SIMFLAGS \
+               >/dev/null 2>"$tmp/sim.log" &
+    sim=$!
+
+    tries=0
+    while [ ! -e "$tmp/xbee" ] && [ $tries -lt 50 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+
+    start=$(date +%s.%N)
+    # shellcheck disable=SC2086
+    if "$AVRDUDE" -q -q -c xbee -p $part -b 115200 \
+                  -P "$ADDRESS@$tmp/xbee" $AVRFLAGS \
+                  -U "flash:w:$image:i" >"$tmp/avrdude.log" 2>&1; then
+        result=ok
+    else
+        result=FAILED
+        failed=1
+    fi
+    end=$(date +%s.%N)
+
+    kill -TERM $sim
+    wait $sim
+
+    seconds=$(awk "BEGIN { printf \"%.2f\", $end - $start }")
+    goodput=$(awk "BEGIN { printf \"%.0f\", $bytes / ($end - $start) }")
+    packets=$(simStat "transmit requests")
+    retrans=$(simStat "data retransmissions")
+    rtts=$(simStat "STK500 commands")
+
+    printf "%-16s %-7s %7s %8s %8s %8s %8s %8s  %s\n" \
+           "$(basename "$image" .hex)" $part "$bytes" "$seconds" \
+           "$goodput" "$packets" "$retrans" "$rtts" $result
+
+    if [ $result != ok ]; then
+        sed 's/^/    /' "$tmp/avrdude.log" >&2
+    fi
+done
+
+exit $failed
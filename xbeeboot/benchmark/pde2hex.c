@@ -0,0 +1,164 @@
+/*
+ * pde2hex - Pack the PROGMEM text of the chaucer examples into an
+ * Intel HEX image
+ * Copyright (C) 2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The chaucer sketches are almost entirely string data, so the bulk
+ * of a compiled image is that text.  Packing the string literals
+ * directly gives an upload of much the same size without needing an
+ * AVR toolchain (or an Arduino core old enough to accept prog_char).
+ * It has none of the machine code, though, so it is no guide to how
+ * a real image compresses or how much of it changes between builds.
+ *
+ * Each run of adjacent string literals becomes a NUL terminated
+ * array, in source order, starting at address zero.
+ *
+ * Usage: pde2hex sketch.pde image.hex
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned char image[256 * 1024];
+static unsigned long imageLength;
+
+static void emit(int byte)
+{
+  if (imageLength >= sizeof(image)) {
+    fprintf(stderr, "pde2hex: image too large\n");
+    exit(1);
+  }
+  image[imageLength++] = byte;
+}
+
+static int escape(FILE *in)
+{
+  const int ch = getc(in);
+  switch (ch) {
+  case 'n':
+    return '\n';
+  case 't':
+    return '\t';
+  case 'r':
+    return '\r';
+  case '0':
+    return 0;
+  default:
+    /* \\, \", \' */
+    return ch;
+  }
+}
+
+static void parse(FILE *in)
+{
+  int pending = 0;
+  int ch;
+
+  while ((ch = getc(in)) != EOF) {
+    if (ch == '/') {
+      const int next = getc(in);
+      if (next == '/') {
+        while ((ch = getc(in)) != EOF && ch != '\n');
+      } else if (next == '*') {
+        int last = 0;
+        while ((ch = getc(in)) != EOF && !(last == '*' && ch == '/'))
+          last = ch;
+      } else if (next != EOF) {
+        ungetc(next, in);
+      }
+    } else if (ch == '\'') {
+      /* Character constant */
+      ch = getc(in);
+      if (ch == '\\')
+        escape(in);
+      while ((ch = getc(in)) != EOF && ch != '\'');
+    } else if (ch == '"') {
+      while ((ch = getc(in)) != EOF && ch != '"') {
+        emit(ch == '\\' ? escape(in) : ch);
+      }
+      pending = 1;
+    } else if (ch == ';' && pending) {
+      /* End of the array */
+      emit(0);
+      pending = 0;
+    }
+  }
+}
+
+static void record(FILE *out, unsigned int type, unsigned int address,
+                   const unsigned char *data, unsigned int length)
+{
+  unsigned char checksum = length + (address >> 8) + address + type;
+  fprintf(out, ":%02X%04X%02X", length, address & 0xffff, type);
+
+  unsigned int index;
+  for (index = 0; index < length; index++) {
+    fprintf(out, "%02X", (unsigned int)data[index]);
+    checksum += data[index];
+  }
+  fprintf(out, "%02X\n", (unsigned int)(unsigned char)-checksum);
+}
+
+static void writeHex(FILE *out)
+{
+  unsigned long address;
+  for (address = 0; address < imageLength; address += 16) {
+    if ((address & 0xffff) == 0 && address > 0) {
+      /* Extended Linear Address */
+      const unsigned char upper[2] =
+        { (address >> 24) & 0xff, (address >> 16) & 0xff };
+      record(out, 4, 0, upper, 2);
+    }
+
+    const unsigned long remaining = imageLength - address;
+    record(out, 0, address, &image[address],
+           remaining < 16 ? remaining : 16);
+  }
+
+  /* End Of File */
+  record(out, 1, 0, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3) {
+    fprintf(stderr, "Usage: pde2hex sketch.pde image.hex\n");
+    return 1;
+  }
+
+  FILE *in = fopen(argv[1], "r");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  parse(in);
+  fclose(in);
+
+  FILE *out = fopen(argv[2], "w");
+  if (out == NULL) {
+    perror(argv[2]);
+    return 1;
+  }
+  writeHex(out);
+  if (fclose(out) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -41,6 +41,7 @@
 # define UART_SRB UCSR0B
 # define UART_SRC UCSR0C
 # define UART_SRL UBRR0L
+# define UART_SRH UBRR0H
 # define UART_UDR UDR0
 #elif UART == 1
 #if !defined(UDR1)
@@ -50,6 +51,7 @@
 # define UART_SRB UCSR1B
 # define UART_SRC UCSR1C
 # define UART_SRL UBRR1L
+# define UART_SRH UBRR1H
 # define UART_UDR UDR1
 #elif UART == 2
 #if !defined(UDR2)
@@ -59,6 +61,7 @@
 # define UART_SRB UCSR2B
 # define UART_SRC UCSR2C
 # define UART_SRL UBRR2L
+# define UART_SRH UBRR2H
 # define UART_UDR UDR2
 #elif UART == 3
 #if !defined(UDR1)
@@ -68,6 +71,7 @@
 # define UART_SRB UCSR3B
 # define UART_SRC UCSR3C
 # define UART_SRL UBRR3L
+# define UART_SRH UBRR3H
 # define UART_UDR UDR3
 #endif
 
@@ -793,3 +797,55 @@
 #error Unrecognized LED name.  Should be like "B5"
 #error -------------------------------------------
 #endif
+
+/*
+ * ------------------------------------------------------------------------
+ * XBEEBOOT_RTS names the pin wired to the XBee's RTS input (DIO6), in
+ * the same style as the LED, eg. "XBEEBOOT_RTS=D4".  Ports A to G of
+ * the newer megaAVRs are laid out as PINx, DDRx, PORTx from 0x20, so
+ * work out the registers rather than listing every pin again.
+ */
+#ifdef XBEEBOOT_RTS
+#if defined(__AVR_ATmega8__) || defined(__AVR_ATmega32__) || \
+    defined(__AVR_ATtiny84__) || XBEEBOOT_RTS < A0 || XBEEBOOT_RTS > G7
+#error Unsupported XBEEBOOT_RTS pin.  Should be like "D4"
+#endif
+#if ((XBEEBOOT_RTS >> 8) == 1 && !defined(PORTA)) || \
+    ((XBEEBOOT_RTS >> 8) == 2 && !defined(PORTB)) || \
+    ((XBEEBOOT_RTS >> 8) == 3 && !defined(PORTC)) || \
+    ((XBEEBOOT_RTS >> 8) == 4 && !defined(PORTD)) || \
+    ((XBEEBOOT_RTS >> 8) == 5 && !defined(PORTE)) || \
+    ((XBEEBOOT_RTS >> 8) == 6 && !defined(PORTF)) || \
+    ((XBEEBOOT_RTS >> 8) == 7 && !defined(PORTG))
+#error XBEEBOOT_RTS names a port this device doesn't have
+#endif
+#define RTS_DDR     _SFR_MEM8(0x21 + 3 * ((XBEEBOOT_RTS >> 8) - 1))
+#define RTS_PORT    _SFR_MEM8(0x22 + 3 * ((XBEEBOOT_RTS >> 8) - 1))
+#define RTS_BIT     (XBEEBOOT_RTS & 7)
+#endif
+
+/*
+ * ------------------------------------------------------------------------
+ * XBEEBOOT_AUTOBAUD times the first byte on the UART's receive pin.
+ */
+#ifdef XBEEBOOT_AUTOBAUD
+#if UART == 0 && (defined(__AVR_ATmega168__) || \
+                  defined(__AVR_ATmega168P__) || \
+                  defined(__AVR_ATmega328P__) || \
+                  defined(__AVR_ATmega88) || defined(__AVR_ATmega88__) || \
+                  defined(__AVR_ATmega644P__) || \
+                  defined(__AVR_ATmega1284P__))
+#define UART_RXD_PIN PIND
+#define UART_RXD_BIT 0
+#elif UART == 0 && defined(__AVR_ATmega1280__)
+#define UART_RXD_PIN PINE
+#define UART_RXD_BIT 0
+#elif UART == 1 && (defined(__AVR_ATmega644P__) || \
+                    defined(__AVR_ATmega1284P__) || \
+                    defined(__AVR_ATmega1280__))
+#define UART_RXD_PIN PIND
+#define UART_RXD_BIT 2
+#else
+#error XBEEBOOT_AUTOBAUD does not know the receive pin for this UART
+#endif
+#endif
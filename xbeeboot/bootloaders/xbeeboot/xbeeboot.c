@@ -128,6 +128,71 @@
 /* UART number (0..n) for devices with more than          */
 /* one hardware uart (644P, 1284P, etc)                   */
 /*                                                        */
+/* XBEEBOOT_WINDOW:                                       */
+/* Queue several in-sequence FIRMWARE_DELIVER packets so  */
+/* the programmer can keep more than one in flight.       */
+/* Needs a larger boot section than 1k (eg. 4k).          */
+/*                                                        */
+/* XBEEBOOT_CRC:                                          */
+/* Return the CRC-32 of a range of flash, so that the     */
+/* programmer can verify without reading it all back.     */
+/* Needs a larger boot section than 1k (eg. 4k).          */
+/*                                                        */
+/* XBEEBOOT_COMPRESS:                                     */
+/* Accept compressed flash pages, so fewer bytes need to  */
+/* cross the air.                                         */
+/* Needs a larger boot section than 1k (eg. 4k).          */
+/*                                                        */
+/* XBEEBOOT_ERASE:                                        */
+/* Accept a command erasing a page of flash, so blank     */
+/* pages need no data sent.                               */
+/* Needs a larger boot section than 1k (eg. 4k).          */
+/*                                                        */
+/* XBEEBOOT_FLEET:                                        */
+/* Accept firmware broadcast to many devices at once, and */
+/* report which parts of it were missed.                  */
+/* Needs a larger boot section than 1k (eg. 4k).          */
+/*                                                        */
+/* XBEEBOOT_UART_ISR:                                     */
+/* Receive from the UART by interrupt, with the vector    */
+/* table moved into the boot section, so that nothing is  */
+/* lost at high baud rates.  Needs XBEEBOOT_WINDOW.       */
+/*                                                        */
+/* XBEEBOOT_RTS:                                          */
+/* Pin driving the XBee's RTS input (DIO6), eg. D4.  The  */
+/* XBee is held off while flash is erased and written,    */
+/* rather than sending to a UART that nothing is reading. */
+/*                                                        */
+/* XBEEBOOT_PIGGYBACK:                                    */
+/* Carry the ACK for received data in the next reply,     */
+/* rather than in a packet of its own.                    */
+/* Needs XBEEBOOT_WINDOW.                                 */
+/*                                                        */
+/* XBEEBOOT_STAGING:                                      */
+/* Queue this many flash pages of received data (a power  */
+/* of two), rather than 256 bytes, so that reception      */
+/* runs well ahead of flash programming on parts with     */
+/* RAM to spare (eg. 8 on ATmega1284P).                   */
+/* Needs XBEEBOOT_WINDOW.                                 */
+/*                                                        */
+/* XBEEBOOT_API1:                                         */
+/* Talk to an XBee in API mode 1 (AP=1), without escaped  */
+/* characters, so binary data isn't inflated on the UART. */
+/* avrdude needs -x xbeeapimode=1 to match.               */
+/*                                                        */
+/* XBEEBOOT_AUTOBAUD:                                     */
+/* Set the UART rate from the first byte received, rather */
+/* than from BAUD_RATE, so one build suits any XBee BD.   */
+/* The rate must be at least F_CPU / 2048.                */
+/*                                                        */
+/* XBEEBOOT_BAUD:                                         */
+/* Let avrdude raise the UART rate, in step with the      */
+/* remote XBee's BD, for the rest of the session.         */
+/*                                                        */
+/* BIGBOOT builds with XBEEBOOT_WINDOW also erase and     */
+/* fill each flash page as its data arrives, and leave    */
+/* the write running while the next command is received.  */
+/*                                                        */
 /**********************************************************/
 
 /**********************************************************/
@@ -244,6 +309,9 @@ optiboot_version = 256*(OPTIBOOT_MAJVER + OPTIBOOT_CUSTOMVER) + OPTIBOOT_MINVER;
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#ifdef XBEEBOOT_UART_ISR
+#include <avr/interrupt.h>
+#endif
 
 /*
  * Note that we use our own version of "boot.h"
@@ -267,6 +335,12 @@ optiboot_version = 256*(OPTIBOOT_MAJVER + OPTIBOOT_CUSTOMVER) + OPTIBOOT_MINVER;
  */
 #include "stk500.h"
 
+/*
+ * xbeeboot.h contains the XBeeBoot packet types, parameters and
+ * commands, shared with xbeesim
+ */
+#include "xbeeboot.h"
+
 #ifndef LED_START_FLASHES
 #define LED_START_FLASHES 0
 #endif
@@ -362,9 +436,15 @@ static inline void getNch(uint8_t);
 #if LED_START_FLASHES > 0
 static inline void flash_led(uint8_t);
 #endif
+#ifdef XBEEBOOT_AUTOBAUD
+static inline void autobaud(void);
+#endif
 static inline void watchdogReset();
 static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
 			       uint16_t address, pagelen_t len);
+#ifdef XBEEBOOT_ERASE
+static inline void erasePage(uint16_t address);
+#endif
 static inline void read_mem(uint8_t memtype,
 			    uint16_t address, pagelen_t len);
 
@@ -433,9 +513,346 @@ void appStart(uint8_t rstFlags) __attribute__ ((naked));
 #define frameMode (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+2))
 #define outputIndex (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+3))
 
-#define packetBuffer ((uint8_t*)(RAMSTART+SPM_PAGESIZE*4))
-#define packet ((uint8_t*)(RAMSTART+SPM_PAGESIZE*5))
-#define outputBuffer ((uint8_t*)(RAMSTART+SPM_PAGESIZE*6))
+#ifdef XBEEBOOT_WINDOW
+#define XBEEBOOT_CAP_WINDOW_BIT XBEEBOOT_CAP_WINDOW
+#else
+#define XBEEBOOT_CAP_WINDOW_BIT 0
+#endif
+
+#ifdef XBEEBOOT_CRC
+#define XBEEBOOT_CAP_CRC_BIT XBEEBOOT_CAP_CRC
+#else
+#define XBEEBOOT_CAP_CRC_BIT 0
+#endif
+
+#ifdef XBEEBOOT_COMPRESS
+#define XBEEBOOT_CAP_COMPRESS_BIT XBEEBOOT_CAP_COMPRESS
+#else
+#define XBEEBOOT_CAP_COMPRESS_BIT 0
+#endif
+
+#ifdef XBEEBOOT_ERASE
+#define XBEEBOOT_CAP_ERASE_BIT XBEEBOOT_CAP_ERASE
+#else
+#define XBEEBOOT_CAP_ERASE_BIT 0
+#endif
+
+#ifdef XBEEBOOT_FLEET
+#define XBEEBOOT_CAP_FLEET_BIT XBEEBOOT_CAP_FLEET
+#else
+#define XBEEBOOT_CAP_FLEET_BIT 0
+#endif
+
+#ifdef XBEEBOOT_RTS
+#define XBEEBOOT_CAP_RTS_BIT XBEEBOOT_CAP_RTS
+#else
+#define XBEEBOOT_CAP_RTS_BIT 0
+#endif
+
+#ifdef XBEEBOOT_PIGGYBACK
+#define XBEEBOOT_CAP_PIGGYBACK_BIT XBEEBOOT_CAP_PIGGYBACK
+#else
+#define XBEEBOOT_CAP_PIGGYBACK_BIT 0
+#endif
+
+#define XBEEBOOT_CAPABILITIES (XBEEBOOT_CAP_VALID | XBEEBOOT_CAP_WINDOW_BIT | \
+                               XBEEBOOT_CAP_CRC_BIT | \
+                               XBEEBOOT_CAP_COMPRESS_BIT | \
+                               XBEEBOOT_CAP_ERASE_BIT | \
+                               XBEEBOOT_CAP_FLEET_BIT | \
+                               XBEEBOOT_CAP_RTS_BIT | \
+                               XBEEBOOT_CAP_PIGGYBACK_BIT)
+
+/*
+ * Deasserting RTS makes the XBee hold on to received data until it is
+ * asserted again.  The pin idles low, asserted.
+ */
+#ifdef XBEEBOOT_RTS
+#define rtsHold() (RTS_PORT |= _BV(RTS_BIT))
+#define rtsRelease() (RTS_PORT &= ~_BV(RTS_BIT))
+#else
+#define rtsHold()
+#define rtsRelease()
+#endif
+
+#if defined(XBEEBOOT_CRC) && defined(VIRTUAL_BOOT_PARTITION)
+#error XBEEBOOT_CRC is not supported with VIRTUAL_BOOT_PARTITION
+#endif
+
+#if defined(XBEEBOOT_COMPRESS) && defined(VIRTUAL_BOOT_PARTITION)
+#error XBEEBOOT_COMPRESS is not supported with VIRTUAL_BOOT_PARTITION
+#endif
+
+#if defined(XBEEBOOT_ERASE) && defined(VIRTUAL_BOOT_PARTITION)
+#error XBEEBOOT_ERASE is not supported with VIRTUAL_BOOT_PARTITION
+#endif
+
+#ifdef XBEEBOOT_BAUD
+/* UBRR values for XBEEBOOT_CMD_BAUD, see xbeeboot.h */
+#define XBEEBOOT_BD_UBRR(baud) ((F_CPU + (baud) * 4L) / ((baud) * 8L) - 1)
+#define XBEEBOOT_BD_ACTUAL(baud) (F_CPU / (8 * (XBEEBOOT_BD_UBRR(baud) + 1)))
+#define XBEEBOOT_BD_ERROR(baud) (XBEEBOOT_BD_ACTUAL(baud) > (baud) ? \
+                                 XBEEBOOT_BD_ACTUAL(baud) - (baud) : \
+                                 (baud) - XBEEBOOT_BD_ACTUAL(baud))
+/* UBRR for a rate, or 0 if it can't be used */
+#define XBEEBOOT_BD(baud) (XBEEBOOT_BD_UBRR(baud) > 255 || \
+                           XBEEBOOT_BD_ERROR(baud) * 100 > (baud) * 3 ? \
+                           0 : XBEEBOOT_BD_UBRR(baud))
+
+static const uint8_t baudSettings[8] PROGMEM = {
+  XBEEBOOT_BD(1200L), XBEEBOOT_BD(2400L), XBEEBOOT_BD(4800L),
+  XBEEBOOT_BD(9600L), XBEEBOOT_BD(19200L), XBEEBOOT_BD(38400L),
+  XBEEBOOT_BD(57600L), XBEEBOOT_BD(115200L)
+};
+
+#define XBEEBOOT_BAUDS ((XBEEBOOT_BD(1200L) ? 0x01 : 0) | \
+                        (XBEEBOOT_BD(2400L) ? 0x02 : 0) | \
+                        (XBEEBOOT_BD(4800L) ? 0x04 : 0) | \
+                        (XBEEBOOT_BD(9600L) ? 0x08 : 0) | \
+                        (XBEEBOOT_BD(19200L) ? 0x10 : 0) | \
+                        (XBEEBOOT_BD(38400L) ? 0x20 : 0) | \
+                        (XBEEBOOT_BD(57600L) ? 0x40 : 0) | \
+                        (XBEEBOOT_BD(115200L) ? 0x80 : 0))
+
+/* 0x03 would read as the answer of a bootloader without the feature */
+#define XBEEBOOT_BAUDS_REPLY (XBEEBOOT_BAUDS == 0x03 ? 0x01 : XBEEBOOT_BAUDS)
+
+/*
+ * The UBRR in use before the last XBEEBOOT_CMD_BAUD, zero once a
+ * command has arrived at the new rate.  A framing error before then
+ * means that the remote XBee didn't follow, so go back to it, and the
+ * programmer's retries get through at the old rate.
+ */
+#define baudFallback (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+17))
+#define baudRevert() do {                       \
+    if (baudFallback) {                         \
+      UART_SRL = baudFallback;                  \
+      baudFallback = 0;                         \
+    }                                           \
+  } while (0)
+
+#if defined(__AVR_ATmega8__) || defined(__AVR_ATmega32__) || defined(SOFT_UART)
+#error XBEEBOOT_BAUD is not supported on this UART
+#endif
+
+static void pushBuffer(const uint8_t max);
+#else
+#define baudRevert()
+#endif
+
+#ifdef XBEEBOOT_WINDOW
+#ifdef SOFT_UART
+#error XBEEBOOT_WINDOW is not supported with SOFT_UART
+#endif
+
+/*
+ * In window mode, in-sequence data is queued in packetQueue as it
+ * arrives, and the serial port is drained into uartRing whenever we
+ * would otherwise be busy-waiting.  Both are 256 byte rings, so the
+ * 8 bit indexes wrap for free.
+ *
+ * With XBEEBOOT_STAGING, packetQueue instead holds that many pages,
+ * with 16 bit indexes that wrap with the queue as it is a power of
+ * two.
+ */
+#ifdef XBEEBOOT_STAGING
+#define XBEEBOOT_QUEUE_SIZE (XBEEBOOT_STAGING * SPM_PAGESIZE)
+
+#if XBEEBOOT_QUEUE_SIZE & (XBEEBOOT_QUEUE_SIZE - 1)
+#error XBEEBOOT_STAGING must be a power of two
+#endif
+
+#define queueIn (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+12))
+#define queueOut (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+14))
+#define queueWrap(index) ((index) & (XBEEBOOT_QUEUE_SIZE - 1))
+#else
+#define XBEEBOOT_QUEUE_SIZE 256
+
+#define queueIn (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+4))
+#define queueOut (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+5))
+#define queueWrap(index) ((uint8_t)(index))
+#endif
+#define uartIn (*(volatile uint8_t*)(RAMSTART+SPM_PAGESIZE*3+6))
+#define uartOut (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+7))
+
+#define packetQueue ((uint8_t*)(RAMSTART+SPM_PAGESIZE*6))
+#define uartRing ((uint8_t*)(RAMSTART+SPM_PAGESIZE*6+XBEEBOOT_QUEUE_SIZE))
+
+/*
+ * uartRing holds 255 bytes, one slot being kept free to tell full
+ * from empty.  It only has to cover the serial port while we are
+ * busy elsewhere: the longest is a flash page erase and write, about
+ * 9ms, or some 100 bytes at 115200 baud.  The window is what limits
+ * the data in flight, and avrdude sizes it to packetQueue from
+ * XBEEBOOT_PARM_WINDOW, so the ring drains into the queue rather
+ * than filling.  Should it fill anyway, further bytes are dropped,
+ * leaving the unread ones intact, and the damaged frame fails its
+ * checksum and is resent.  XBEEBOOT_RTS holds the XBee off instead.
+ */
+#define uartRingFull() ((uint8_t)(uartIn + 1) == uartOut)
+
+#if RAMSTART+SPM_PAGESIZE*6+XBEEBOOT_QUEUE_SIZE+256 > RAMEND-0x40
+#error XBEEBOOT_WINDOW needs more RAM than this device has
+#endif
+
+/*
+ * With room to spare, program flash pages as their data is received
+ * rather than after.  This relies on uartRing to catch the serial
+ * port while we wait on flash.
+ */
+#if defined(BIGBOOT) && !defined(VIRTUAL_BOOT_PARTITION)
+#define XBEEBOOT_OVERLAP
+static void flashSync(void);
+
+/*
+ * Wait for flash as writebuffer() does, with the XBee held off, but
+ * only when there is something to wait for.
+ */
+#define overlapBusyWait() do {                  \
+    if (boot_spm_busy()) {                      \
+      rtsHold();                                \
+      spmBusyWait();                            \
+      rtsRelease();                             \
+    }                                           \
+  } while (0)
+#endif
+
+/*
+ * The most FIRMWARE_DELIVER data we accept in a packet, larger than
+ * XBEEBOOT_MAX_CHUNK where the network allows it.  The received frame,
+ * from its API type, must fit in packet: a 12 byte 0x90 header and
+ * our 3 byte header.
+ */
+#if SPM_PAGESIZE > 255
+#define XBEEBOOT_MAX_RECEIVE (255 - 12 - 3)
+#else
+#define XBEEBOOT_MAX_RECEIVE (SPM_PAGESIZE - 12 - 3)
+#endif
+
+#ifdef XBEEBOOT_UART_ISR
+/* The receive interrupt fills uartRing, so there is nothing to poll */
+#define uartService() do { } while (0)
+#else
+static void uartService(void);
+#endif
+#define spmBusyWait() do { while (boot_spm_busy()) uartService(); } while (0)
+#else
+#define spmBusyWait() boot_spm_busy_wait()
+#endif
+
+#ifdef XBEEBOOT_FLEET
+#ifdef VIRTUAL_BOOT_PARTITION
+#error XBEEBOOT_FLEET is not supported with VIRTUAL_BOOT_PARTITION
+#endif
+
+/*
+ * Fleet chunks, see xbeeboot.h, are gathered in buff a page at a
+ * time, so the programmer must not send them in the middle of an
+ * STK500 command.
+ */
+#define XBEEBOOT_FLEET_CHUNKS ((FLASHEND + 1UL) / XBEEBOOT_FLEET_CHUNK)
+
+/* Page in buff plus one, or zero for none */
+#define fleetPage (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+8))
+
+/* One bit per chunk, set once it has been received */
+#ifdef XBEEBOOT_WINDOW
+#define XBEEBOOT_FLEET_RAM (RAMSTART+SPM_PAGESIZE*6+XBEEBOOT_QUEUE_SIZE+256)
+#else
+#define XBEEBOOT_FLEET_RAM (RAMSTART+SPM_PAGESIZE*6)
+#endif
+#define fleetReceived ((uint8_t*)XBEEBOOT_FLEET_RAM)
+
+#if XBEEBOOT_FLEET_RAM+XBEEBOOT_FLEET_CHUNKS/8 > RAMEND-0x40
+#error XBEEBOOT_FLEET needs more RAM than this device has
+#endif
+#endif
+
+#if defined(XBEEBOOT_STAGING) && !defined(XBEEBOOT_WINDOW)
+#error XBEEBOOT_STAGING needs XBEEBOOT_WINDOW
+#endif
+
+#if defined(XBEEBOOT_AUTOBAUD) && defined(SOFT_UART)
+#error XBEEBOOT_AUTOBAUD is not supported with SOFT_UART
+#endif
+
+#ifdef XBEEBOOT_PIGGYBACK
+#ifndef XBEEBOOT_WINDOW
+#error XBEEBOOT_PIGGYBACK needs XBEEBOOT_WINDOW
+#endif
+
+/*
+ * Once piggybacking, see xbeeboot.h, in-sequence data is only ACK'd on
+ * its own (pendingAck) if we run out of input with no reply to send.
+ */
+#define pendingAck (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+10))
+#define piggyback (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+11))
+#endif
+
+#ifdef XBEEBOOT_UART_ISR
+#ifndef XBEEBOOT_WINDOW
+#error XBEEBOOT_UART_ISR needs XBEEBOOT_WINDOW
+#endif
+#ifdef VIRTUAL_BOOT_PARTITION
+#error XBEEBOOT_UART_ISR is not supported with VIRTUAL_BOOT_PARTITION
+#endif
+
+#if UART == 0 && defined(USART_RX_vect_num)
+#define UART_RX_vect USART_RX_vect
+#define UART_RX_vect_num USART_RX_vect_num
+#elif UART == 0 && defined(USART0_RX_vect_num)
+#define UART_RX_vect USART0_RX_vect
+#define UART_RX_vect_num USART0_RX_vect_num
+#elif UART == 1 && defined(USART1_RX_vect_num)
+#define UART_RX_vect USART1_RX_vect
+#define UART_RX_vect_num USART1_RX_vect_num
+#elif UART == 2 && defined(USART2_RX_vect_num)
+#define UART_RX_vect USART2_RX_vect
+#define UART_RX_vect_num USART2_RX_vect_num
+#elif UART == 3 && defined(USART3_RX_vect_num)
+#define UART_RX_vect USART3_RX_vect
+#define UART_RX_vect_num USART3_RX_vect_num
+#else
+#error Cant find UART receive interrupt vector for this CPU
+#endif
+
+/*
+ * Once IVSEL is set, interrupts vector into the start of the boot
+ * section instead of the application.  Only reset and the UART receive
+ * interrupt are used, so the rest of the table is left as padding.
+ */
+void bootVectors(void) __attribute__ ((naked)) __attribute__ ((section (".vectors")));
+void bootVectors(void) {
+  __asm__ __volatile__ (
+    "   rjmp main\n"
+    "   .org %[rxVector]\n"
+    "   rjmp __vector_%[rxNumber]\n"
+    :
+    :
+      [rxVector] "i" (UART_RX_vect_num * (FLASHEND > 8192 ? 4 : 2)),
+      [rxNumber] "i" (UART_RX_vect_num)
+  );
+}
+
+/*
+ * With the receive interrupt enabled, the sequence that enables an
+ * SPM instruction must not be interrupted, or the enable times out.
+ */
+#define spmAtomic(op) do { cli(); op; sei(); } while (0)
+#else
+#define spmAtomic(op) op
+#endif
+
+#define packet ((uint8_t*)(RAMSTART+SPM_PAGESIZE*4))
+#define outputBuffer ((uint8_t*)(RAMSTART+SPM_PAGESIZE*5))
+
+#ifndef XBEEBOOT_WINDOW
+/*
+ * Without the queue, getch() reads FIRMWARE_DELIVER data where poll()
+ * received it, the frameMode bytes before frameEnd in packet.
+ */
+#define frameEnd (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+16))
+#endif
 #define lastAddress (&outputBuffer[2])
 #define outputPayload (&outputBuffer[14])
 #define outputText (&outputBuffer[17])
@@ -553,6 +970,11 @@ int main(void) {
   LED_DDR |= _BV(LED);
 #endif
 
+#ifdef XBEEBOOT_RTS
+  /* Set RTS pin as output, asserted */
+  RTS_DDR |= _BV(RTS_BIT);
+#endif
+
 #ifdef SOFT_UART
   /* Set TX pin as output */
   UART_DDR |= _BV(UART_TX_BIT);
@@ -563,15 +985,60 @@ int main(void) {
   flash_led(LED_START_FLASHES * 2);
 #endif
 
+#ifdef XBEEBOOT_AUTOBAUD
+  autobaud();
+#endif
+
   frameMode = FRAME_UNKNOWN;
   lastOutgoingSequence = 0;
   lastIncomingSequence = 0;
+#ifdef XBEEBOOT_BAUD
+  baudFallback = 0;
+#endif
   outputIndex = 0;
+#ifdef XBEEBOOT_WINDOW
+  queueIn = 0;
+  queueOut = 0;
+  uartIn = 0;
+  uartOut = 0;
+#endif
+#ifdef XBEEBOOT_PIGGYBACK
+  pendingAck = 0;
+  piggyback = 0;
+#endif
+#ifdef XBEEBOOT_UART_ISR
+  /* Move the vectors to the boot section, and receive by interrupt */
+  MCUCR = _BV(IVCE);
+  MCUCR = _BV(IVSEL);
+  UART_SRB |= _BV(RXCIE0);
+  sei();
+#endif
+#ifdef XBEEBOOT_FLEET
+  fleetPage = 0;
+  {
+    uint16_t index = XBEEBOOT_FLEET_CHUNKS / 8;
+    do fleetReceived[--index] = 0;
+    while (index);
+  }
+#endif
 
   /* Forever loop: exits by causing WDT reset */
   for (;;) {
     /* get character from UART */
     ch = getch();
+#ifdef XBEEBOOT_BAUD
+    /* A whole command got through, so the new rate works */
+    baudFallback = 0;
+#endif
+
+#ifdef XBEEBOOT_OVERLAP
+    /*
+     * A page write may still be running.  Only LOAD_ADDRESS and
+     * PROG_PAGE can safely begin before it finishes.
+     */
+    if (ch != STK_LOAD_ADDRESS && ch != STK_PROG_PAGE)
+      flashSync();
+#endif
 
     if(ch == STK_GET_PARAMETER) {
       unsigned char which = getch();
@@ -584,6 +1051,28 @@ int main(void) {
 	  putch(optiboot_version & 0xFF);
       } else if (which == 0x81) {
 	  putch(optiboot_version >> 8);
+      } else if (which == XBEEBOOT_PARM_CAPABILITIES) {
+	  putch(XBEEBOOT_CAPABILITIES);
+#ifdef XBEEBOOT_WINDOW
+      } else if (which == XBEEBOOT_PARM_WINDOW) {
+	  /* Receive buffer capacity, in bytes */
+	  putch(XBEEBOOT_QUEUE_SIZE > 256 ? 255 : XBEEBOOT_QUEUE_SIZE - 1);
+      } else if (which == XBEEBOOT_PARM_QUEUE) {
+	  /* The same, in 64 byte units, for larger buffers */
+	  putch(XBEEBOOT_QUEUE_SIZE / 64);
+      } else if (which == XBEEBOOT_PARM_MAX_CHUNK) {
+	  putch(XBEEBOOT_MAX_RECEIVE);
+#endif
+#ifdef XBEEBOOT_PIGGYBACK
+      } else if (which == XBEEBOOT_PARM_PIGGYBACK) {
+	  /* Asking shows the programmer understands REPLY_ACK */
+	  piggyback = 1;
+	  putch(1);
+#endif
+#ifdef XBEEBOOT_BAUD
+      } else if (which == XBEEBOOT_PARM_BAUDS) {
+	  putch(XBEEBOOT_BAUDS_REPLY);
+#endif
       } else {
 	/*
 	 * GET PARAMETER returns a generic 0x03 reply for
@@ -629,6 +1118,43 @@ int main(void) {
       savelength = length;
       desttype = getch();
 
+#ifdef XBEEBOOT_OVERLAP
+      /*
+       * Only a whole, aligned page goes straight to flash; anything
+       * else is buffered and checked as before.  The page is erased
+       * before the rest of the command has arrived, so a PROG_PAGE
+       * cut short leaves it erased until avrdude writes it again.
+       */
+      if (desttype != 'E' && length == SPM_PAGESIZE &&
+          (address & (SPM_PAGESIZE - 1)) == 0) {
+        uint16_t addrPtr = (uint16_t)(void*)address;
+
+        /*
+         * Erase while the data is still arriving, and fill the page
+         * buffer word by word as it is read.  The write is left
+         * running; flashSync() waits for it.  RTS stays asserted
+         * while getch() keeps reading, and is only deasserted while
+         * we wait on flash.
+         */
+        overlapBusyWait();
+        spmAtomic(__boot_page_erase_short((uint16_t)(void*)address));
+        do {
+          uint16_t a;
+          a = getch();
+          a |= getch() << 8;
+          overlapBusyWait();
+          spmAtomic(__boot_page_fill_short((uint16_t)(void*)addrPtr, a));
+          addrPtr += 2;
+        } while (length -= 2);
+
+        verifySpace();
+        spmAtomic(__boot_page_write_short((uint16_t)(void*)address));
+        putch(STK_OK);
+        continue;
+      }
+      flashSync();
+#endif
+
       // read a page worth of contents
       bufPtr = buff;
       do *bufPtr++ = getch();
@@ -707,6 +1233,112 @@ int main(void) {
 
       read_mem(desttype, address, length);
     }
+#ifdef XBEEBOOT_COMPRESS
+    /* Write a compressed page of flash */
+    else if(ch == XBEEBOOT_CMD_PROG_PAGE_LZ) {
+      uint8_t desttype;
+      uint8_t *bufPtr;
+      pagelen_t savelength;
+
+      GETLENGTH(length);
+      savelength = length;
+      desttype = getch();
+
+      // decompress a page worth of contents
+      bufPtr = buff;
+      do {
+	uint8_t token = getch();
+	uint8_t *from = 0;
+	uint8_t count = token + 1;
+	if (token & 0x80) {
+	  from = bufPtr - getch() - 1;
+	  count = (token & 0x7f) + 3;
+	}
+	/*
+	 * Never write past the page, whatever the stream says.  Any
+	 * literals left over then fail verifySpace().
+	 */
+	if (count > buff + savelength - bufPtr)
+	  count = buff + savelength - bufPtr;
+	do *bufPtr++ = from ? *from++ : getch();
+	while (--count);
+      } while (bufPtr < buff + savelength);
+
+      // Read command terminator, start reply
+      verifySpace();
+
+      writebuffer(desttype, buff, address, savelength);
+    }
+#endif
+#ifdef XBEEBOOT_ERASE
+    /* Erase a page of flash, with no need to fill or write it */
+    else if(ch == XBEEBOOT_CMD_ERASE_PAGE) {
+      verifySpace();
+      erasePage(address);
+    }
+#endif
+#ifdef XBEEBOOT_CRC
+    /* CRC-32 of flash, for verification without reading back */
+    else if(ch == XBEEBOOT_CMD_CRC) {
+      uint16_t crcLength;
+      uint16_t crcAddress = address;
+      uint32_t crc = 0xffffffff;
+      uint8_t crcType;
+
+      crcLength = getch() << 8;
+      crcLength |= getch();
+      crcType = getch();
+      verifySpace();
+
+      while (crcLength--) {
+	uint8_t bit;
+#ifdef RAMPZ
+	__asm__ ("elpm %0,Z+\n" : "=r" (ch), "=z" (crcAddress): "1" (crcAddress));
+#else
+	__asm__ ("lpm %0,Z+\n" : "=r" (ch), "=z" (crcAddress): "1" (crcAddress));
+#endif
+	crc ^= ch;
+	for (bit = 0; bit < 8; bit++)
+	  crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	watchdogReset();
+
+	if (crcLength == 0 || (crcType == XBEEBOOT_CRC_PAGES &&
+			       ((uint8_t)crcAddress & (uint8_t)(SPM_PAGESIZE - 1)) == 0)) {
+	  crc = ~crc;
+	  putch(crc);
+	  putch(crc >> 8);
+	  putch(crc >> 16);
+	  putch(crc >> 24);
+	  crc = 0xffffffff;
+	}
+      }
+    }
+#endif
+
+#ifdef XBEEBOOT_BAUD
+    /* Change rate, in step with the remote XBee */
+    else if(ch == XBEEBOOT_CMD_BAUD) {
+      uint8_t ubrr = pgm_read_byte(&baudSettings[getch() & 7]);
+      verifySpace();
+      putch(STK_OK);
+
+      /*
+       * Only over XBee frames, where the ACK shows that the reply has
+       * gone at the old rate.  The programmer sends nothing more
+       * until it has set the XBee's rate to match.
+       */
+      if (frameMode != FRAME_UART) {
+	pushBuffer(0);
+	if (ubrr) {
+	  baudFallback = UART_SRL;
+	  /* Write the high byte first, the low one updates the rate */
+	  UART_SRH = 0;
+	  UART_SRL = ubrr;
+	}
+      }
+      continue;
+    }
+#endif
 
     /* Get device signature bytes  */
     else if(ch == STK_READ_SIGN) {
@@ -737,9 +1369,64 @@ int main(void) {
   }
 }
 
+#ifdef XBEEBOOT_UART_ISR
+/* Move each received character into uartRing as it arrives */
+ISR(UART_RX_vect) {
+  if (!(UART_SRA & _BV(FE0)))
+    /* See uartGetch() */
+    watchdogReset();
+  else
+    baudRevert();
+
+  /* Always read UDR, which clears RXC */
+  uint8_t ch = UART_UDR;
+  if (!uartRingFull())
+    uartRing[uartIn++] = ch;
+}
+#elif defined(XBEEBOOT_WINDOW)
+/*
+ * Move any received character into uartRing.  Called whenever we
+ * would otherwise spin, so that the serial port doesn't overrun while
+ * we transmit or wait on flash.
+ */
+static void uartService(void) {
+  if (!(UART_SRA & _BV(RXC0)))
+    return;
+
+  if (!(UART_SRA & _BV(FE0)))
+    /* See uartGetch() */
+    watchdogReset();
+  else
+    baudRevert();
+
+  /* Always read UDR, which clears RXC */
+  uint8_t ch = UART_UDR;
+  if (!uartRingFull())
+    uartRing[uartIn++] = ch;
+}
+#endif
+
+#ifdef XBEEBOOT_OVERLAP
+/*
+ * Wait for any page write left running by STK_PROG_PAGE, and make
+ * the application section readable again.
+ */
+static void flashSync(void) {
+  overlapBusyWait();
+#if defined(RWWSRE)
+  spmAtomic(boot_rww_enable());
+#endif
+}
+#endif
+
 void uartPutch(char ch) {
 #ifndef SOFT_UART
+#ifdef XBEEBOOT_WINDOW
+  while (!(UART_SRA & _BV(UDRE0)))
+    uartService();
+#else
   while (!(UART_SRA & _BV(UDRE0)));
+#endif
   UART_UDR = ch;
 #else
   __asm__ __volatile__ (
@@ -803,6 +1490,11 @@ uint8_t uartGetch(void) {
     :
       "r25"
 );
+#elif defined(XBEEBOOT_WINDOW)
+  while (uartIn == uartOut)
+    uartService();
+
+  ch = uartRing[uartOut++];
 #else
   while(!(UART_SRA & _BV(RXC0)))
     ;
@@ -816,6 +1508,8 @@ uint8_t uartGetch(void) {
        * don't care that an invalid char is returned...)
        */
     watchdogReset();
+  } else {
+    baudRevert();
   }
 
   ch = UART_UDR;
@@ -851,6 +1545,16 @@ void uartDelay() {
 }
 #endif
 
+#ifdef XBEEBOOT_API1
+/*
+ * In API mode 1 nothing is escaped, so 0x7e can turn up inside a
+ * frame.  poll() only looks for a start delimiter between frames,
+ * trusting the length to find the end of each, and resynchronises on
+ * the next 0x7e after a bad length or checksum.
+ */
+#define escGetch() uartGetch()
+#define escPutch(ch) uartPutch(ch)
+#else
 static __attribute__((__noinline__))
 uint8_t escGetch(void) {
   const uint8_t ch = uartGetch();
@@ -867,6 +1571,7 @@ static void escPutch(char ch) {
   }
   uartPutch(ch);
 }
+#endif
 
 #define TXHEADER_BYTES 14
 static __attribute__((__noinline__))
@@ -901,10 +1606,151 @@ void sendAck(const uint8_t sequence) {
   transmit(TXHEADER_BYTES + 2);
 }
 
+/* Offsets into a received 0x90 frame, from the API type */
+#define PACKOFF_ADDRESS 1
+#define PACKOFF_PAYLOAD 12
+
+#ifdef XBEEBOOT_FLEET
+/* Write out the page gathered in buff, if any */
+static void fleetFlush(void) {
+  if (fleetPage == 0)
+    return;
+
+#ifdef XBEEBOOT_OVERLAP
+  flashSync();
+#endif
+  const uint32_t pageAddress = (uint32_t)(fleetPage - 1) * SPM_PAGESIZE;
+#ifdef RAMPZ
+  RAMPZ = pageAddress >> 16;
+#endif
+  writebuffer('F', buff, (uint16_t)pageAddress, SPM_PAGESIZE);
+  fleetPage = 0;
+}
+
+static __attribute__((__noinline__))
+void fleetPacket(const uint8_t length) {
+  const uint8_t packetType = packet[PACKOFF_PAYLOAD];
+  const uint16_t chunk = packet[PACKOFF_PAYLOAD + 1] |
+    (packet[PACKOFF_PAYLOAD + 2] << 8);
+
+  if (packetType == XBEEBOOT_PACKET_TYPE_FLEET_CHUNK) {
+    if (length != PACKOFF_PAYLOAD + 3 + XBEEBOOT_FLEET_CHUNK ||
+        chunk >= XBEEBOOT_FLEET_CHUNKS)
+      return;
+
+    const uint16_t page =
+      chunk / (SPM_PAGESIZE / XBEEBOOT_FLEET_CHUNK) + 1;
+    if (page != fleetPage) {
+      fleetFlush();
+#ifdef XBEEBOOT_OVERLAP
+      /*
+       * Even with no fleet page to flush, poll() may have brought us
+       * here while an STK_PROG_PAGE write runs, with flash unreadable.
+       */
+      flashSync();
+#endif
+
+      /* Start from what is there, in case some chunks are missed */
+      uint32_t pageAddress = (uint32_t)(page - 1) * SPM_PAGESIZE;
+      uint16_t address = pageAddress;
+      uint8_t *bufPtr = buff;
+#ifdef RAMPZ
+      RAMPZ = pageAddress >> 16;
+#endif
+      do {
+        uint8_t ch;
+#ifdef RAMPZ
+        __asm__ ("elpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address));
+#else
+        __asm__ ("lpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address));
+#endif
+        *bufPtr++ = ch;
+      } while (bufPtr != buff + SPM_PAGESIZE);
+
+      fleetPage = page;
+    }
+
+    {
+      uint8_t *bufPtr = buff + (chunk * XBEEBOOT_FLEET_CHUNK) %
+        SPM_PAGESIZE;
+      uint8_t index;
+      for (index = 0; index < XBEEBOOT_FLEET_CHUNK; index++)
+        *bufPtr++ = packet[PACKOFF_PAYLOAD + 3 + index];
+    }
+
+    fleetReceived[chunk >> 3] |= 1 << (chunk & 7);
+  } else if (packetType == XBEEBOOT_PACKET_TYPE_FLEET_QUERY &&
+             length == PACKOFF_PAYLOAD + 5) {
+    uint16_t first = chunk;
+    uint16_t end = packet[PACKOFF_PAYLOAD + 3] |
+      (packet[PACKOFF_PAYLOAD + 4] << 8);
+    if (end > XBEEBOOT_FLEET_CHUNKS)
+      end = XBEEBOOT_FLEET_CHUNKS;
+
+    /* Everything received so far is in flash before we answer */
+    fleetFlush();
+
+    while (first < end && (fleetReceived[first >> 3] & (1 << (first & 7))))
+      first++;
+
+    {
+      uint8_t index;
+      for (index = 0; index < 10; index++)
+        lastAddress[index] = packet[PACKOFF_ADDRESS + index];
+    }
+
+    outputPayload[0] = XBEEBOOT_PACKET_TYPE_FLEET_NACK;
+    outputPayload[1] = first;
+    outputPayload[2] = first >> 8;
+
+    uint16_t missing = first;
+    uint8_t index;
+    for (index = 0; index < XBEEBOOT_FLEET_NACK; index++) {
+      uint8_t bits = 0;
+      uint8_t bit;
+      for (bit = 1; bit; bit <<= 1, missing++)
+        if (missing < end &&
+            !(fleetReceived[missing >> 3] & (1 << (missing & 7))))
+          bits |= bit;
+      outputPayload[3 + index] = bits;
+    }
+
+    transmit(TXHEADER_BYTES + 3 + XBEEBOOT_FLEET_NACK);
+  }
+}
+#endif
+
 static __attribute__((__noinline__))
 uint8_t poll(uint8_t waitForAck) {
   register uint8_t sawInvalid = 0;
+#ifdef XBEEBOOT_PIGGYBACK
+  uint8_t replyAcked = 0;
+#endif
   for (;;) {
+#ifdef XBEEBOOT_WINDOW
+    /*
+     * Keep queueing data while more is waiting on the serial port,
+     * so that it is ACK'd promptly.  Once caught up, return as soon
+     * as there is something to read.
+     */
+    if (!waitForAck && queueIn != queueOut && uartIn == uartOut)
+      return 0;
+#endif
+#ifdef XBEEBOOT_PIGGYBACK
+    /*
+     * The reply was ACK'd by a DELIVER_ACK.  Its data may have been
+     * out of sequence, so don't wait for the queue to fill.
+     */
+    if (replyAcked && uartIn == uartOut)
+      return 0;
+
+    /* About to wait for more, with no reply to carry the ACK */
+    if (pendingAck && uartIn == uartOut) {
+      sendAck(pendingAck);
+      pendingAck = 0;
+    }
+#endif
+
     /* Start delimiter */
     if (uartGetch() != 0x7e)
       continue;
@@ -914,7 +1760,7 @@ uint8_t poll(uint8_t waitForAck) {
       continue;
 
     /* Length LSB (of the data) */
-    const uint8_t length = escGetch();
+    uint8_t length = escGetch();
     /* Assume the length reaches the next check. */
     /* if (length < 12) continue; */
 
@@ -924,12 +1770,36 @@ uint8_t poll(uint8_t waitForAck) {
      * 0 = 0x90, 1-10 = 64-bit address and 16-bit address, 11 = options
      * 12 = data...
      */
-#define PACKOFF_ADDRESS 1
-#define PACKOFF_PAYLOAD 12
     uint8_t index;
+    uint8_t dataByte = 0;
+#ifdef XBEEBOOT_WINDOW
+    /*
+     * If it fits, data is received straight into the free end of
+     * packetQueue, and only queued once the packet checks out.
+     */
+    uint8_t inQueue =
+      queueWrap(queueOut - queueIn - 1) + PACKOFF_PAYLOAD + 3 >= length;
+#endif
     for (index = 0; index < length; index++) {
-      uint8_t dataByte = escGetch();
-      packet[index] = dataByte;
+      dataByte = escGetch();
+#ifdef XBEEBOOT_WINDOW
+#ifdef XBEEBOOT_FLEET
+      /* fleetPacket() reads its data from packet */
+      if (index == PACKOFF_PAYLOAD && (dataByte == 2 || dataByte == 3))
+        inQueue = 0;
+#endif
+      if (inQueue && index >= PACKOFF_PAYLOAD + 3)
+        packetQueue[queueWrap(queueIn + index - PACKOFF_PAYLOAD - 3)] =
+          dataByte;
+      else
+#else
+      /*
+       * While getch() still has data to read from packet, keep only
+       * the headers.  A REQUEST is dropped then anyway.
+       */
+      if (frameMode == FRAME_FRAME || index < PACKOFF_PAYLOAD + 3)
+#endif
+        packet[index] = dataByte;
       checksum -= dataByte;
     }
 
@@ -952,8 +1822,7 @@ uint8_t poll(uint8_t waitForAck) {
         /* We can't receive ACK right now, drop it. */
         continue;
 
-      if (packetType != 0)
-        /* ACK */
+      if (packetType != XBEEBOOT_PACKET_TYPE_ACK)
         continue;
 
       /* sequence is ACK'd */
@@ -968,8 +1837,30 @@ uint8_t poll(uint8_t waitForAck) {
     } else if (length >= PACKOFF_PAYLOAD + 4) {
       /* [REQUEST] [SEQUENCE] [FIRMWARE_DELIVER] [DATA] [[DATA]*] */
 
-      if (packetType != 1)
-        /* REQUEST */
+#ifdef XBEEBOOT_FLEET
+      if (packetType == XBEEBOOT_PACKET_TYPE_FLEET_CHUNK ||
+          packetType == XBEEBOOT_PACKET_TYPE_FLEET_QUERY) {
+        /*
+         * Not while a reply is waiting for its ACK, as the reply is
+         * still in outputBuffer.
+         */
+        if (!waitForAck)
+          fleetPacket(length);
+        continue;
+      }
+#endif
+
+#ifdef XBEEBOOT_PIGGYBACK
+      if (packetType == XBEEBOOT_PACKET_TYPE_DELIVER_ACK) {
+        /* The last byte ACKs our reply */
+        length--;
+        if (dataByte == waitForAck) {
+          replyAcked = 1;
+          waitForAck = 0;
+        }
+      } else
+#endif
+      if (packetType != XBEEBOOT_PACKET_TYPE_REQUEST)
         continue;
 
       const uint8_t type = packet[PACKOFF_PAYLOAD + 2];
@@ -994,6 +1885,26 @@ uint8_t poll(uint8_t waitForAck) {
         continue;
       }
 
+#ifdef XBEEBOOT_WINDOW
+      if (!inQueue)
+        /*
+         * No room in the queue, so drop it without an ACK.  The
+         * programmer will resend it, and everything after it.
+         */
+        continue;
+
+      queueIn += length - PACKOFF_PAYLOAD - 3;
+
+#ifdef XBEEBOOT_PIGGYBACK
+      if (piggyback && !waitForAck)
+        pendingAck = nextSequence;
+      else
+#endif
+      sendAck(nextSequence);
+
+      /* data is valid, sequence is correct. */
+      lastIncomingSequence = nextSequence;
+#else
       if (frameMode != FRAME_FRAME)
         /*
          * This means the buffer already has data in it, which means
@@ -1007,14 +1918,9 @@ uint8_t poll(uint8_t waitForAck) {
          */
         continue;
 
-      {
-        uint8_t index;
-        uint8_t dataLength = length - PACKOFF_PAYLOAD - 3;
-        for (index = 0; index < dataLength; index++)
-          packetBuffer[dataLength - 1 - index] =
-            packet[PACKOFF_PAYLOAD + 3 + index];
-        frameMode = dataLength;
-      }
+      /* getch() reads the data in place */
+      frameEnd = length;
+      frameMode = length - PACKOFF_PAYLOAD - 3;
 
       sendAck(nextSequence);
 
@@ -1029,6 +1935,7 @@ uint8_t poll(uint8_t waitForAck) {
          */
         return 0;
       }
+#endif
     }
   }
 }
@@ -1042,11 +1949,24 @@ void pushBuffer(const uint8_t max) {
   while ((++sequence & 0xff) == 0);
   lastOutgoingSequence = sequence;
 
+  uint8_t length = TXHEADER_BYTES + 3 + outputIndex;
+#ifdef XBEEBOOT_PIGGYBACK
+  if (piggyback) {
+    outputText[outputIndex] = lastIncomingSequence;
+    length++;
+    pendingAck = 0;
+  }
+#endif
+
   do {
-    outputPayload[0] = 1 /* REQUEST */;
+    outputPayload[0] = XBEEBOOT_PACKET_TYPE_REQUEST;
+#ifdef XBEEBOOT_PIGGYBACK
+    if (piggyback)
+      outputPayload[0] = XBEEBOOT_PACKET_TYPE_REPLY_ACK;
+#endif
     outputPayload[1] = sequence;
     outputPayload[2] = 24 /* FIRMWARE_REPLY */;
-    transmit(TXHEADER_BYTES + 3 + outputIndex);
+    transmit(length);
   } while (poll(sequence));
 
   outputIndex = 0;
@@ -1059,7 +1979,12 @@ void putch(const char ch) {
   }
 
   outputText[outputIndex++] = ch;
+#ifdef XBEEBOOT_PIGGYBACK
+  /* Leave room for the ACK */
+  pushBuffer(XBEEBOOT_MAX_CHUNK - 1);
+#else
   pushBuffer(XBEEBOOT_MAX_CHUNK);
+#endif
 }
 
 /*
@@ -1067,7 +1992,14 @@ void putch(const char ch) {
  * protocol here first.
  */
 uint8_t getch(void) {
-  pushBuffer(0);
+#ifdef XBEEBOOT_WINDOW
+  /*
+   * Hold replies until the queue runs dry, so that the replies to
+   * commands the programmer sent together go back together.
+   */
+  if (queueIn == queueOut)
+#endif
+    pushBuffer(0);
 
  loop:
   switch (frameMode) {
@@ -1112,6 +2044,15 @@ uint8_t getch(void) {
       /* FALLTHROUGH */
     }
   case FRAME_FRAME:
+#ifdef XBEEBOOT_WINDOW
+  default:
+    /*
+     * NB: frameMode stays FRAME_FRAME, data is read from the queue.
+     */
+    if (queueIn == queueOut)
+      poll(0);
+    return packetQueue[queueWrap(queueOut++)];
+#else
     /*
      * NB: Will not return unless the packet buffer has been
      * re-populated, so we can then immediately read from the buffer.
@@ -1119,7 +2060,8 @@ uint8_t getch(void) {
     poll(0);
     /* FALLTHROUGH */
   default:
-    return packetBuffer[--frameMode];
+    return packet[frameEnd - frameMode--];
+#endif
   }
 }
 
@@ -1153,6 +2095,34 @@ void flash_led(uint8_t count) {
 }
 #endif
 
+#ifdef XBEEBOOT_AUTOBAUD
+/*
+ * Time the first byte received, either the 0x7e that starts an XBee
+ * frame or the 0x30 of STK_GET_SYNC.  Both are low from the start
+ * bit and from bit 7, so the second rising edge is the stop bit,
+ * nine bits after the start.  The receiver is off meanwhile, so the
+ * byte is lost, and the programmer's retry is the first one read.
+ *
+ * Timer1 counts at F_CPU, and in double speed mode UBRR is an eighth
+ * of the bit time, less one.
+ */
+void autobaud(void) {
+  UART_SRB = _BV(TXEN0);
+  TCCR1B = _BV(CS10);
+
+  while (UART_RXD_PIN & _BV(UART_RXD_BIT));
+  uint16_t start = TCNT1;
+  while (!(UART_RXD_PIN & _BV(UART_RXD_BIT)));
+  while (UART_RXD_PIN & _BV(UART_RXD_BIT));
+  while (!(UART_RXD_PIN & _BV(UART_RXD_BIT)));
+  uint16_t ticks = TCNT1 - start;
+
+  TCCR1B = 0;
+  UART_SRL = (uint8_t)((ticks + 9 * 8 / 2) / (9 * 8) - 1);
+  UART_SRB = _BV(RXEN0) | _BV(TXEN0);
+}
+#endif
+
 // Watchdog functions. These are only safe with interrupts turned off.
 void watchdogReset() {
   __asm__ __volatile__ (
@@ -1161,6 +2131,14 @@ void watchdogReset() {
 }
 
 void watchdogConfig(uint8_t x) {
+#ifdef XBEEBOOT_UART_ISR
+  /*
+   * Every change here is a bootloader exit, either to the application
+   * or by reset: stop the receive interrupt resetting the watchdog,
+   * and from breaking the timed sequence below.
+   */
+  cli();
+#endif
   WDTCSR = _BV(WDCE) | _BV(WDE);
   WDTCSR = x;
 }
@@ -1200,6 +2178,9 @@ static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
 	 * until the WDT expires, which will eventually cause an error on
 	 * host system (which is what it should do.)
 	 */
+#ifdef XBEEBOOT_UART_ISR
+	cli(); // The receive interrupt would keep the WDT from expiring
+#endif
 	while (1)
 	    ; // Error: wait for WDT
 #endif
@@ -1219,10 +2200,12 @@ static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
 	     * Start the page erase and wait for it to finish.  There
 	     * used to be code to do this while receiving the data over
 	     * the serial link, but the performance improvement was slight,
-	     * and we needed the space back.
+	     * and we needed the space back.  BIGBOOT window builds do it
+	     * in STK_PROG_PAGE instead.
 	     */
-	    __boot_page_erase_short((uint16_t)(void*)address);
-	    boot_spm_busy_wait();
+	    rtsHold();
+	    spmAtomic(__boot_page_erase_short((uint16_t)(void*)address));
+	    spmBusyWait();
 
 	    /*
 	     * Copy data from the buffer into the flash write buffer.
@@ -1231,24 +2214,39 @@ static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
 		uint16_t a;
 		a = *bufPtr++;
 		a |= (*bufPtr++) << 8;
-		__boot_page_fill_short((uint16_t)(void*)addrPtr,a);
+		spmAtomic(__boot_page_fill_short((uint16_t)(void*)addrPtr,a));
 		addrPtr += 2;
 	    } while (len -= 2);
 
 	    /*
 	     * Actually Write the buffer to flash (and wait for it to finish.)
 	     */
-	    __boot_page_write_short((uint16_t)(void*)address);
-	    boot_spm_busy_wait();
+	    spmAtomic(__boot_page_write_short((uint16_t)(void*)address));
+	    spmBusyWait();
 #if defined(RWWSRE)
 	    // Reenable read access to flash
-	    boot_rww_enable();
+	    spmAtomic(boot_rww_enable());
 #endif
+	    rtsRelease();
 	} // default block
 	break;
     } // switch
 }
 
+#ifdef XBEEBOOT_ERASE
+static inline void erasePage(uint16_t address)
+{
+    rtsHold();
+    spmAtomic(__boot_page_erase_short((uint16_t)(void*)address));
+    spmBusyWait();
+#if defined(RWWSRE)
+    // Reenable read access to flash
+    spmAtomic(boot_rww_enable());
+#endif
+    rtsRelease();
+}
+#endif
+
 static inline void read_mem(uint8_t memtype, uint16_t address, pagelen_t length)
 {
     uint8_t ch;
@@ -0,0 +1,116 @@
+/*
+ * XBeeBoot protocol constants, shared by xbeeboot.c and the model of
+ * the bootloader in xbeesim.  Plain numbers only, so that this builds
+ * for the host as well as for the AVR.
+ *
+ * avrdude/xbee.c keeps its own copy, as it is built within avrdude.
+ * Any change here must be made there too.
+ */
+
+/*
+ * The first byte of every XBeeBoot packet:
+ *
+ *   [REQUEST = 1] [SEQUENCE] [FIRMWARE_DELIVER = 23] [DATA...]
+ *   [ACK = 0] [SEQUENCE]
+ */
+#define XBEEBOOT_PACKET_TYPE_ACK 0
+#define XBEEBOOT_PACKET_TYPE_REQUEST 1
+
+/*
+ * In fleet mode the programmer broadcasts the image to every device
+ * at once, as numbered chunks, then asks each device in turn which
+ * chunks it missed and repairs them:
+ *
+ *   [FLEET_CHUNK = 2] [CHUNK LSB] [CHUNK MSB] [DATA * XBEEBOOT_FLEET_CHUNK]
+ *   [FLEET_QUERY = 3] [START LSB] [START MSB] [END LSB] [END MSB]
+ *   [FLEET_NACK = 4] [FIRST LSB] [FIRST MSB] [BITMAP * XBEEBOOT_FLEET_NACK]
+ *
+ * None of these are ACK'd.  A NACK names the first chunk from START
+ * that hasn't been received (END if there are none), and has a bit
+ * set for each chunk from there on that is missing.
+ */
+#define XBEEBOOT_PACKET_TYPE_FLEET_CHUNK 2
+#define XBEEBOOT_PACKET_TYPE_FLEET_QUERY 3
+#define XBEEBOOT_PACKET_TYPE_FLEET_NACK 4
+#define XBEEBOOT_FLEET_CHUNK 32
+#define XBEEBOOT_FLEET_NACK 32
+
+/*
+ * Once the programmer has read XBEEBOOT_PARM_PIGGYBACK, replies are
+ * sent as REPLY_ACK packets, which also ACK everything received so
+ * far, and the programmer ACKs each reply with its next command:
+ *
+ *   [REPLY_ACK = 5] [SEQUENCE] [FIRMWARE_REPLY = 24] [DATA...] [ACK]
+ *   [DELIVER_ACK = 6] [SEQUENCE] [FIRMWARE_DELIVER = 23] [DATA...] [ACK]
+ */
+#define XBEEBOOT_PACKET_TYPE_REPLY_ACK 5
+#define XBEEBOOT_PACKET_TYPE_DELIVER_ACK 6
+
+/*
+ * XBeeBoot specific STK_GET_PARAMETER parameters, allowing the
+ * programmer to discover optional features.
+ */
+#define XBEEBOOT_PARM_CAPABILITIES 0xc0
+#define XBEEBOOT_PARM_WINDOW 0xc1
+#define XBEEBOOT_PARM_MAX_CHUNK 0xc2
+#define XBEEBOOT_PARM_PIGGYBACK 0xc3
+#define XBEEBOOT_PARM_QUEUE 0xc4
+#define XBEEBOOT_PARM_BAUDS 0xc5
+
+#define XBEEBOOT_CAP_VALID 0x80
+#define XBEEBOOT_CAP_WINDOW 0x01
+#define XBEEBOOT_CAP_CRC 0x02
+#define XBEEBOOT_CAP_COMPRESS 0x04
+#define XBEEBOOT_CAP_ERASE 0x08
+#define XBEEBOOT_CAP_FLEET 0x10
+#define XBEEBOOT_CAP_RTS 0x20
+#define XBEEBOOT_CAP_PIGGYBACK 0x40
+
+/*
+ * XBeeBoot specific command returning the CRC-32 of length bytes of
+ * flash from the loaded address:
+ *
+ *   [XBEEBOOT_CMD_CRC] [length MSB] [length LSB] [type] [CRC_EOP]
+ *
+ * Replies with one CRC for the range (type 'F') or one per flash page
+ * (type 'P'), each least significant byte first.
+ */
+#define XBEEBOOT_CMD_CRC 0xd0
+#define XBEEBOOT_CRC_PAGES 'P'
+
+/*
+ * XBeeBoot specific command writing a compressed page of flash at the
+ * loaded address:
+ *
+ *   [XBEEBOOT_CMD_PROG_PAGE_LZ] [length MSB] [length LSB] ['F']
+ *   [tokens...] [CRC_EOP]
+ *
+ * where length is the uncompressed length.  Token [0nnnnnnn] is
+ * followed by n + 1 literal bytes, and [1nnnnnnn] [d] copies n + 3
+ * bytes of this page from d + 1 bytes back.
+ */
+#define XBEEBOOT_CMD_PROG_PAGE_LZ 0xd1
+
+/*
+ * XBeeBoot specific command erasing the page of flash at the loaded
+ * address, leaving it all 0xff:
+ *
+ *   [XBEEBOOT_CMD_ERASE_PAGE] [CRC_EOP]
+ */
+#define XBEEBOOT_CMD_ERASE_PAGE 0xd2
+
+/*
+ * XBeeBoot specific command switching the UART to the rate of XBee
+ * BD setting bd (0 = 1200 to 7 = 115200) once the reply is ACK'd,
+ * which the programmer follows by setting BD on the remote XBee:
+ *
+ *   [XBEEBOOT_CMD_BAUD] [bd] [CRC_EOP]
+ *
+ * XBEEBOOT_PARM_BAUDS has a bit set for each bd that is within 3% at
+ * the bootloader's F_CPU.  Older bootloaders answer it with 0x03,
+ * which the programmer takes to mean that the rate can't be changed,
+ * so that set is reported as 0x01 instead.  If the remote XBee fails
+ * to follow, the framing errors that follow put the bootloader back
+ * at its old rate.
+ */
+#define XBEEBOOT_CMD_BAUD 0xd3
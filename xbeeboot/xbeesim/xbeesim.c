@@ -0,0 +1,1850 @@
+/*
+ * xbeesim - Emulated XBee Series 2 mesh for exercising the XBeeBoot
+ * host transport without radios
+ * Copyright (C) 2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xbeesim presents a pseudo terminal that behaves like a local XBee
+ * in API mode 2 (escaped), or API mode 1 once set with AT AP=1,
+ * attached to a mesh of one or more remote XBees.  Each remote XBee has an AVR running a model of the XBeeBoot
+ * bootloader behind it.
+ *
+ * The local XBee answers:
+ *
+ *  0x08 Local AT Command       -> 0x88 Local AT Command Response
+ *  0x17 Remote AT Command      -> 0x97 Remote AT Command Response
+ *  0x10 ZigBee Transmit Request -> 0x8b Transmit Status
+ *  0x21 Create Source Route    (accepted silently)
+ *
+ * and delivers XBeeBoot replies as 0x90 ZigBee Receive Packet frames,
+ * each preceded by a 0xa1 Route Record Indicator when the target is
+ * more than one hop away.
+ *
+ * Radio latency, jitter, loss, hop count and the maximum RF payload
+ * are configurable, as are the serial baud rates used to pace the
+ * host link and the links between each remote XBee and its AVR.  A
+ * local AT BD changes the host link's rate, a remote AT BD a node's, and with -B the modelled
+ * bootloader follows when asked; while they differ, nothing gets
+ * through.  Loss and jitter are drawn from a seeded generator, so
+ * a given seed always makes the same sequence of decisions.
+ *
+ * Typical use:
+ *
+ *   xbeesim -L /tmp/xbee -p 5 &
+ *   avrdude -c xbee -p m328p -P 0013A20000000001@/tmp/xbee -U flash:w:...
+ *
+ * Statistics are printed on SIGINT or SIGTERM.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+/* The bootloader's own protocol constants, from bootloaders/xbeeboot */
+#include "stk500.h"
+#include "xbeeboot.h"
+
+#define XBEESIM_MAX_NODES 16
+#define XBEESIM_MAX_EVENTS 1024
+
+/*
+ * Time taken by the local XBee to answer a local AT command, in
+ * microseconds.
+ */
+#define XBEESIM_LOCAL_AT_US 1000
+
+/*
+ * Time after which a remote AT command with no response is reported
+ * as failed, in microseconds.
+ */
+#define XBEESIM_REMOTE_AT_TIMEOUT_US 500000
+
+/*
+ * XBeeBoot flushes its reply buffer once more than XBEEBOOT_MAX_CHUNK
+ * (54) bytes are waiting.
+ */
+#define XBEESIM_REPLY_CHUNK 55
+
+/*
+ * The classic bootloader buffers a single packet, the windowed one
+ * has a queue, of several flash pages with XBEEBOOT_STAGING.
+ */
+#define XBEESIM_QUEUE_SIZE 256
+#define XBEESIM_MAX_QUEUE 8192
+
+#define XBEESIM_MAX_FLASH 131072
+
+/* Rates of XBee BD settings 0 to 7 */
+static const long bdRates[8] =
+  { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+
+struct Part {
+  const char *name;
+  unsigned char signature[3];
+  unsigned long flashSize;
+  unsigned int pageSize;
+};
+
+static const struct Part parts[] =
+  {
+   { "m328p", { 0x1e, 0x95, 0x0f }, 32768, 128 },
+   { "m1284p", { 0x1e, 0x97, 0x05 }, 131072, 256 },
+  };
+
+struct Node {
+  unsigned char address64[8];
+  unsigned int address16;
+
+  /*
+   * Non-zero while XBeeBoot is running, as opposed to the AVR being
+   * held in reset or running the application.
+   */
+  int running;
+  int inReset;
+
+  /* DIO6 configured as RTS, which XBeeBoot drives with -R */
+  int rtsEnabled;
+
+  /* Set to API mode 1 by a remote AT AP=1, so nothing is escaped */
+  int api1;
+
+  /*
+   * Rates of the remote XBee's UART and of XBeeBoot's, which changes
+   * to the BD setting in pendingBaud once the reply is ACK'd, going
+   * back to fallbackBaud if garbled data arrives before a command.
+   */
+  long serialBaud;
+  long avrBaud;
+  int pendingBaud;
+  long fallbackBaud;
+
+  unsigned char lastIncomingSequence;
+  unsigned char lastOutgoingSequence;
+
+  /* Sequence of the reply awaiting an ACK, or zero */
+  unsigned char awaitingAck;
+  unsigned int replyLength;
+  int sawInvalid;
+
+  /*
+   * With -P, once the host has read XBEEBOOT_PARM_PIGGYBACK, replies
+   * carry the ACK for received data.  Data not yet ACK'd either way.
+   */
+  int piggyback;
+  unsigned char pendingAck;
+
+  /* Data received and ACK'd, not yet consumed */
+  unsigned char queue[XBEESIM_MAX_QUEUE];
+  unsigned int queueLength;
+
+  /* STK500 command being assembled */
+  unsigned char command[300];
+  unsigned int commandLength;
+
+  /* STK500 output not yet ACK'd by the host */
+  unsigned char output[512];
+  unsigned int outputLength;
+
+  unsigned long address;
+  unsigned char *flash;
+
+  /* Flash write in progress until this time */
+  long long busyUntil;
+
+  /*
+   * Windowed bootloaders leave a PROG_PAGE write running until this
+   * time, and erase the page while its data is received, starting at
+   * commandStart.
+   */
+  long long flashUntil;
+  long long commandStart;
+
+  /* Serial links between the remote XBee and the AVR */
+  long long rxFreeAt;
+  long long txFreeAt;
+
+  /*
+   * Last new REQUEST sequence sent by the host, used to tell first
+   * transmissions from retransmissions.
+   */
+  unsigned char hostSequence;
+
+  unsigned long packets;
+  unsigned long duplicates;
+  unsigned long overruns;
+  unsigned long acks;
+  unsigned long replies;
+  unsigned long replyRetries;
+  unsigned long pagesWritten;
+  unsigned long pagesErased;
+  unsigned long resets;
+  unsigned long garbled;
+
+  /* Fleet chunks received, and the page being gathered plus one */
+  unsigned char fleetReceived[XBEESIM_MAX_FLASH / XBEEBOOT_FLEET_CHUNK / 8];
+  unsigned long fleetPage;
+  unsigned long fleetChunks;
+};
+
+#define EV_HOST_FRAME 0
+#define EV_NODE_PACKET 1
+#define EV_NODE_AT 2
+#define EV_NODE_WAKE 3
+
+struct Event {
+  int used;
+  int type;
+  long long time;
+  unsigned long order;
+  struct Node *node;
+  unsigned int length;
+  unsigned char data[256];
+};
+
+static struct Event events[XBEESIM_MAX_EVENTS];
+static unsigned long eventOrder;
+
+static struct Node nodes[XBEESIM_MAX_NODES];
+static int nodeCount;
+
+static const struct Part *part = &parts[0];
+static long latency = 10000;
+static long jitter;
+static int hops = 1;
+static unsigned long lossPpm;
+static unsigned int maxPayload = 84;
+static long baud = 115200;
+static long remoteBaud = -1;
+static long flashWriteTime = 9000;
+static int windowModel;
+static int crcModel;
+static int compressModel;
+static int eraseModel;
+static int fleetModel;
+static int rtsModel;
+static int piggybackModel;
+static int baudModel;
+static unsigned int stagingPages;
+static unsigned int queueSize = XBEESIM_QUEUE_SIZE;
+static int verbose;
+static unsigned int randomState = 1;
+
+/*
+ * API mode of the local XBee, as the host last set it, and of the
+ * frames being written to the host.  The reply to AT AP is still
+ * written in the old mode.
+ */
+static int apiMode = 2;
+static int hostWriteMode = 2;
+
+static int master = -1;
+static long long startTime;
+static long long hostTxFreeAt;
+static long long hostRxFreeAt;
+static long long firstHostFrame = -1;
+static long long lastHostFrame;
+
+static volatile sig_atomic_t stop;
+
+static unsigned long statLocalAT;
+static unsigned long statRemoteAT;
+static unsigned long statTransmit;
+static unsigned long statSourceRoute;
+static unsigned long statUnknown;
+static unsigned long statBadChecksum;
+static unsigned long statFramesSent;
+static unsigned long statRadioSent;
+static unsigned long statRadioLost;
+static unsigned long statTooLarge;
+static unsigned long statEventOverflow;
+static unsigned long statPayloadBytes;
+static unsigned long statHostRequests;
+static unsigned long statHostRetransmissions;
+static unsigned long statHostAcks;
+static unsigned long statCommands;
+
+static long long now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* xorshift32, so that runs with the same seed are reproducible */
+static unsigned int nextRandom(void)
+{
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static void trace(const char *format, ...)
+  __attribute__ ((format (printf, 1, 2)));
+
+static void trace(const char *format, ...)
+{
+  if (!verbose)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "xbeesim: %9.6f ", (now_us() - startTime) / 1e6);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+/* Time to move a number of bytes over a serial link */
+static long long serialTime(long rate, unsigned int bytes)
+{
+  if (rate <= 0)
+    return 0;
+
+  /* Eight data bits, one start bit and one stop bit */
+  return (long long)bytes * 10 * 1000000 / rate;
+}
+
+/*
+ * BD setting for a serial rate, the nearest standard rate below, or
+ * the fastest for an unlimited link.
+ */
+static unsigned char bdSetting(long rate)
+{
+  unsigned char bd = 0;
+  while (bd < 7 && (rate <= 0 || bdRates[bd + 1] <= rate))
+    bd++;
+  return bd;
+}
+
+/* Escapes needed to send data in API mode 2 */
+static unsigned int escapes(const unsigned char *data, unsigned int length)
+{
+  unsigned int count = 0;
+  unsigned int index;
+  for (index = 0; index < length; index++)
+    if (data[index] == 0x7d || data[index] == 0x7e ||
+        data[index] == 0x11 || data[index] == 0x13)
+      count++;
+  return count;
+}
+
+/* Time for a packet to cross the mesh */
+static long long airTime(void)
+{
+  long long total = 0;
+  int hop;
+  for (hop = 0; hop < hops; hop++) {
+    total += latency;
+    if (jitter > 0)
+      total += nextRandom() % (unsigned int)(jitter + 1);
+  }
+  return total;
+}
+
+/* Decide whether a packet crossing the mesh is lost */
+static int airLost(void)
+{
+  statRadioSent++;
+  if (lossPpm == 0 || nextRandom() % 1000000 >= lossPpm)
+    return 0;
+
+  statRadioLost++;
+  return 1;
+}
+
+static struct Event *schedule(int type, long long time, struct Node *node,
+                              const unsigned char *data, unsigned int length)
+{
+  if (length > sizeof(events[0].data)) {
+    statEventOverflow++;
+    return NULL;
+  }
+
+  int index;
+  for (index = 0; index < XBEESIM_MAX_EVENTS; index++) {
+    struct Event *event = &events[index];
+    if (event->used)
+      continue;
+
+    event->used = 1;
+    event->type = type;
+    event->time = time;
+    event->order = eventOrder++;
+    event->node = node;
+    event->length = length;
+    if (length > 0)
+      memcpy(event->data, data, length);
+    return event;
+  }
+
+  statEventOverflow++;
+  return NULL;
+}
+
+static struct Event *nextEvent(void)
+{
+  struct Event *best = NULL;
+  int index;
+  for (index = 0; index < XBEESIM_MAX_EVENTS; index++) {
+    struct Event *event = &events[index];
+    if (!event->used)
+      continue;
+
+    if (best == NULL || event->time < best->time ||
+        (event->time == best->time && event->order < best->order))
+      best = event;
+  }
+  return best;
+}
+
+/*
+ * Queue an API frame for the host.  The serial link to the host is
+ * paced, so frames are delivered no sooner than the link allows.
+ */
+static void hostSend(long long time, const unsigned char *data,
+                     unsigned int length)
+{
+  if (hostTxFreeAt > time)
+    time = hostTxFreeAt;
+
+  /* Start delimiter, two length bytes, checksum */
+  time += serialTime(baud, length + 4 +
+                     (apiMode == 2 ? escapes(data, length) : 0));
+  hostTxFreeAt = time;
+
+  schedule(EV_HOST_FRAME, time, NULL, data, length);
+}
+
+static void writeAll(const unsigned char *data, size_t length)
+{
+  while (length > 0) {
+    const ssize_t rc = write(master, data, length);
+    if (rc < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      perror("xbeesim: write");
+      return;
+    }
+    data += rc;
+    length -= rc;
+  }
+}
+
+static void hostWrite(const unsigned char *data, unsigned int length)
+{
+  unsigned char frame[2 * 256 + 8];
+  unsigned int out = 0;
+  unsigned char checksum = 0xff;
+
+#define putEscaped(x)                                           \
+  do {                                                          \
+    const unsigned char v = (x);                                \
+    if (hostWriteMode == 2 &&                                   \
+        (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13)) {   \
+      frame[out++] = 0x7d;                                      \
+      frame[out++] = v ^ 0x20;                                  \
+    } else {                                                    \
+      frame[out++] = v;                                         \
+    }                                                           \
+  } while (0)
+
+  frame[out++] = 0x7e;
+  putEscaped(length >> 8);
+  putEscaped(length & 0xff);
+
+  unsigned int index;
+  for (index = 0; index < length; index++) {
+    putEscaped(data[index]);
+    checksum -= data[index];
+  }
+  putEscaped(checksum);
+
+#undef putEscaped
+
+  trace("-> host frame type %02x length %u\n", data[0], length);
+  statFramesSent++;
+  writeAll(frame, out);
+
+  if (length >= 4 && data[0] == 0x88 && data[2] == 'A' && data[3] == 'P')
+    hostWriteMode = apiMode;
+}
+
+static void nodeTransmit(struct Node *node, long long time,
+                         const unsigned char *payload, unsigned int length);
+
+static void nodeBoot(struct Node *node)
+{
+  node->running = 1;
+  node->lastIncomingSequence = 0;
+  node->lastOutgoingSequence = 0;
+  node->awaitingAck = 0;
+  node->replyLength = 0;
+  node->sawInvalid = 0;
+  node->queueLength = 0;
+  node->commandLength = 0;
+  node->outputLength = 0;
+  node->piggyback = 0;
+  node->pendingAck = 0;
+  node->avrBaud = remoteBaud;
+  node->pendingBaud = -1;
+  node->fallbackBaud = 0;
+  node->address = 0;
+  node->busyUntil = 0;
+  node->flashUntil = 0;
+  node->fleetPage = 0;
+  memset(node->fleetReceived, 0, sizeof(node->fleetReceived));
+  node->resets++;
+}
+
+static void nodeOutput(struct Node *node, unsigned char byte)
+{
+  if (node->outputLength < sizeof(node->output))
+    node->output[node->outputLength++] = byte;
+}
+
+static void nodeSendReply(struct Node *node, long long time, int retry)
+{
+  unsigned char payload[3 + XBEESIM_REPLY_CHUNK];
+  /* Room is left for the ACK, when it is carried */
+  const unsigned int chunk = XBEESIM_REPLY_CHUNK - (piggybackModel ? 1 : 0);
+
+  if (!retry) {
+    unsigned char sequence = node->lastOutgoingSequence;
+    while ((++sequence & 0xff) == 0);
+    node->lastOutgoingSequence = sequence;
+    node->awaitingAck = sequence;
+    node->replyLength = node->outputLength < chunk ?
+      node->outputLength : chunk;
+    node->replies++;
+  } else {
+    node->replyRetries++;
+  }
+
+  node->sawInvalid = 0;
+
+  unsigned int length = 3 + node->replyLength;
+  payload[0] = XBEEBOOT_PACKET_TYPE_REQUEST;
+  payload[1] = node->awaitingAck;
+  payload[2] = 24; /* FIRMWARE_REPLY */
+  memcpy(&payload[3], node->output, node->replyLength);
+  if (node->piggyback) {
+    payload[0] = XBEEBOOT_PACKET_TYPE_REPLY_ACK;
+    payload[length++] = node->lastIncomingSequence;
+    node->pendingAck = 0;
+  }
+  nodeTransmit(node, time, payload, length);
+}
+
+static void nodeSendAck(struct Node *node, long long time,
+                        unsigned char sequence)
+{
+  const unsigned char payload[2] = { XBEEBOOT_PACKET_TYPE_ACK, sequence };
+  node->acks++;
+  nodeTransmit(node, time, payload, sizeof(payload));
+}
+
+/* The reply being sent has been ACK'd, on its own or with a command */
+static void nodeReplyAcked(struct Node *node)
+{
+  node->outputLength -= node->replyLength;
+  memmove(node->output, &node->output[node->replyLength],
+          node->outputLength);
+  node->awaitingAck = 0;
+  node->replyLength = 0;
+  node->sawInvalid = 0;
+
+  /* The XBEEBOOT_CMD_BAUD reply is out, at the old rate */
+  if (node->pendingBaud >= 0) {
+    node->fallbackBaud = node->avrBaud;
+    node->avrBaud = bdRates[node->pendingBaud];
+    node->pendingBaud = -1;
+    trace("node %u: XBeeBoot now at %ld baud\n", node->address16,
+          node->avrBaud);
+  }
+}
+
+/*
+ * Length of a compressed page command, as far as it can be told from
+ * the tokens collected so far.
+ */
+static unsigned int lzLength(const struct Node *node)
+{
+  const unsigned char *command = node->command;
+  if (node->commandLength < 4)
+    return 4;
+
+  const unsigned int pageLength = command[1] << 8 | command[2];
+  unsigned int produced = 0;
+  unsigned int index = 4;
+  while (produced < pageLength) {
+    if (index >= node->commandLength)
+      return index + 1;
+    const unsigned char token = command[index];
+    if (token & 0x80) {
+      produced += (token & 0x7f) + 3;
+      index += 2;
+    } else {
+      produced += token + 1;
+      index += token + 2;
+    }
+  }
+
+  return index + 1;
+}
+
+/* Decompress a page the way XBeeBoot does */
+static void lzDecompress(const unsigned char *in, unsigned char *page,
+                         unsigned int pageLength)
+{
+  unsigned int produced = 0;
+  while (produced < pageLength) {
+    const unsigned char token = *in++;
+    unsigned int count;
+    if (token & 0x80) {
+      const unsigned int distance = *in++ + 1;
+      for (count = (token & 0x7f) + 3; count > 0; count--, produced++)
+        page[produced] = produced >= distance ?
+          page[produced - distance] : 0xff;
+    } else {
+      for (count = token + 1; count > 0; count--)
+        page[produced++] = *in++;
+    }
+  }
+}
+
+/* Total length of the STK500 command collected so far */
+static unsigned int stkLength(const struct Node *node)
+{
+  switch (node->command[0]) {
+  case STK_GET_PARAMETER:
+    return 3;
+  case STK_SET_DEVICE:
+    return 22;
+  case STK_SET_DEVICE_EXT:
+    return 7;
+  case STK_LOAD_ADDRESS:
+    return 4;
+  case STK_UNIVERSAL:
+    return 6;
+  case STK_READ_PAGE:
+    return 5;
+  case XBEEBOOT_CMD_CRC:
+    return crcModel ? 5 : 2;
+  case XBEEBOOT_CMD_BAUD:
+    return baudModel ? 3 : 2;
+  case XBEEBOOT_CMD_PROG_PAGE_LZ:
+    return compressModel ? lzLength(node) : 2;
+  case STK_PROG_PAGE:
+    if (node->commandLength < 3)
+      return 3;
+    return 5 + (node->command[1] << 8 | node->command[2]);
+  default:
+    return 2;
+  }
+}
+
+/*
+ * Execute a complete STK500 command the way XBeeBoot does.  Returns
+ * zero if the command was not terminated correctly, in which case
+ * XBeeBoot would be reset by the watchdog.
+ */
+static int stkExecute(struct Node *node, long long time)
+{
+  const unsigned char *command = node->command;
+  const unsigned int length = node->commandLength;
+
+  if (command[length - 1] != CRC_EOP)
+    return 0;
+
+  statCommands++;
+  nodeOutput(node, STK_INSYNC);
+
+  switch (command[0]) {
+  case STK_GET_PARAMETER:
+    if (command[1] == 0x82)
+      nodeOutput(node, 2); /* OPTIBOOT_MINVER */
+    else if (command[1] == 0x81)
+      nodeOutput(node, 6); /* OPTIBOOT_MAJVER */
+    else if (command[1] == XBEEBOOT_PARM_CAPABILITIES)
+      nodeOutput(node, XBEEBOOT_CAP_VALID |
+                 (windowModel ? XBEEBOOT_CAP_WINDOW : 0) |
+                 (crcModel ? XBEEBOOT_CAP_CRC : 0) |
+                 (compressModel ? XBEEBOOT_CAP_COMPRESS : 0) |
+                 (eraseModel ? XBEEBOOT_CAP_ERASE : 0) |
+                 (fleetModel ? XBEEBOOT_CAP_FLEET : 0) |
+                 (rtsModel ? XBEEBOOT_CAP_RTS : 0) |
+                 (piggybackModel ? XBEEBOOT_CAP_PIGGYBACK : 0));
+    else if (command[1] == XBEEBOOT_PARM_WINDOW && windowModel)
+      nodeOutput(node, queueSize > 256 ? 255 : queueSize - 1);
+    else if (command[1] == XBEEBOOT_PARM_QUEUE && windowModel)
+      nodeOutput(node, queueSize / 64);
+    else if (command[1] == XBEEBOOT_PARM_MAX_CHUNK && windowModel)
+      /* What fits in the packet buffer, after the 0x90 header */
+      nodeOutput(node, (part->pageSize > 255 ? 255 : part->pageSize) - 15);
+    else if (command[1] == XBEEBOOT_PARM_PIGGYBACK && piggybackModel) {
+      node->piggyback = 1;
+      nodeOutput(node, 1);
+    }
+    else if (command[1] == XBEEBOOT_PARM_BAUDS && baudModel)
+      nodeOutput(node, 0xff);
+    else
+      nodeOutput(node, 0x03);
+    break;
+
+  case STK_LOAD_ADDRESS:
+    node->address = 2UL * (command[1] | command[2] << 8);
+    break;
+
+  case STK_UNIVERSAL:
+    nodeOutput(node, 0x00);
+    break;
+
+  case STK_PROG_PAGE:
+    {
+      const unsigned int dataLength = command[1] << 8 | command[2];
+      if (command[3] == 'F' &&
+          node->address + dataLength <= part->flashSize) {
+        memcpy(&node->flash[node->address], &command[4], dataLength);
+        node->pagesWritten++;
+        if (windowModel) {
+          long long filled = node->commandStart;
+          if (filled < node->flashUntil)
+            filled = node->flashUntil;
+          filled += flashWriteTime / 2;
+          if (filled < time)
+            filled = time;
+          node->flashUntil = filled + flashWriteTime / 2;
+        } else {
+          node->busyUntil = time + flashWriteTime;
+        }
+      }
+    }
+    break;
+
+  case STK_READ_PAGE:
+    {
+      const unsigned int dataLength = command[1] << 8 | command[2];
+      unsigned int index;
+      for (index = 0; index < dataLength; index++) {
+        const unsigned long address = node->address + index;
+        nodeOutput(node, command[3] == 'F' && address < part->flashSize ?
+                   node->flash[address] : 0xff);
+      }
+    }
+    break;
+
+  case XBEEBOOT_CMD_PROG_PAGE_LZ:
+    if (compressModel) {
+      /* The last token may run past the end of the page */
+      unsigned char page[sizeof(node->command) + 130];
+      const unsigned int dataLength = command[1] << 8 | command[2];
+      if (dataLength <= sizeof(node->command)) {
+        lzDecompress(&command[4], page, dataLength);
+        if (command[3] == 'F' &&
+            node->address + dataLength <= part->flashSize) {
+          memcpy(&node->flash[node->address], page, dataLength);
+          node->pagesWritten++;
+          node->busyUntil = time + flashWriteTime;
+        }
+      }
+    }
+    break;
+
+  case XBEEBOOT_CMD_ERASE_PAGE:
+    if (eraseModel) {
+      const unsigned long page = node->address - node->address % part->pageSize;
+      if (page < part->flashSize) {
+        memset(&node->flash[page], 0xff, part->pageSize);
+        node->pagesErased++;
+        /* Erasing is about half of an erase and write */
+        node->busyUntil = time + flashWriteTime / 2;
+      }
+    }
+    break;
+
+  case XBEEBOOT_CMD_CRC:
+    if (crcModel) {
+      /* One CRC for the range, or with type 'P' one per page */
+      const unsigned int dataLength = command[1] << 8 | command[2];
+      unsigned long crc = 0xffffffffUL;
+      unsigned int index;
+      for (index = 0; index < dataLength; index++) {
+        const unsigned long address = node->address + index;
+        crc ^= address < part->flashSize ? node->flash[address] : 0xff;
+
+        int bit;
+        for (bit = 0; bit < 8; bit++)
+          crc = (crc >> 1) ^ (0xedb88320UL & -(crc & 1));
+
+        if (index + 1 == dataLength ||
+            (command[3] == 'P' && (address + 1) % part->pageSize == 0)) {
+          crc = ~crc;
+          nodeOutput(node, crc & 0xff);
+          nodeOutput(node, (crc >> 8) & 0xff);
+          nodeOutput(node, (crc >> 16) & 0xff);
+          nodeOutput(node, (crc >> 24) & 0xff);
+          crc = 0xffffffffUL;
+        }
+      }
+    }
+    break;
+
+  case XBEEBOOT_CMD_BAUD:
+    if (baudModel)
+      node->pendingBaud = command[1] & 7;
+    break;
+
+  case STK_READ_SIGN:
+    nodeOutput(node, part->signature[0]);
+    nodeOutput(node, part->signature[1]);
+    nodeOutput(node, part->signature[2]);
+    break;
+
+  default:
+    break;
+  }
+
+  nodeOutput(node, STK_OK);
+  return 1;
+}
+
+/*
+ * Let XBeeBoot make progress: consume queued data, and send replies
+ * when they fill a packet or when more input is needed.
+ */
+static void nodeRun(struct Node *node, long long time)
+{
+  while (node->running && node->awaitingAck == 0) {
+    if (node->busyUntil > time) {
+      schedule(EV_NODE_WAKE, node->busyUntil, node, NULL, 0);
+      return;
+    }
+
+    if (node->outputLength >= XBEESIM_REPLY_CHUNK -
+        (piggybackModel ? 1 : 0)) {
+      nodeSendReply(node, time, 0);
+      return;
+    }
+
+    /*
+     * The classic bootloader replies before reading any further, the
+     * windowed one once its queue has run dry.
+     */
+    if (node->outputLength > 0 &&
+        (node->queueLength == 0 || !windowModel)) {
+      nodeSendReply(node, time, 0);
+      return;
+    }
+
+    if (node->queueLength == 0) {
+      /* Nothing to carry the ACK, so it goes on its own */
+      if (node->pendingAck != 0) {
+        nodeSendAck(node, time, node->pendingAck);
+        node->pendingAck = 0;
+      }
+      return;
+    }
+
+    const unsigned char byte = node->queue[0];
+    if (node->commandLength == 0) {
+      /* Only these may start while a page write is running */
+      if (node->flashUntil > time &&
+          byte != STK_LOAD_ADDRESS && byte != STK_PROG_PAGE) {
+        schedule(EV_NODE_WAKE, node->flashUntil, node, NULL, 0);
+        return;
+      }
+      node->commandStart = time;
+    }
+    node->queueLength--;
+    memmove(node->queue, &node->queue[1], node->queueLength);
+
+    if (node->commandLength < sizeof(node->command))
+      node->command[node->commandLength++] = byte;
+
+    if (node->commandLength < stkLength(node))
+      continue;
+
+    const int ok = stkExecute(node, time);
+    node->commandLength = 0;
+    node->fallbackBaud = 0;
+    if (!ok) {
+      trace("node %u: bad STK500 command terminator, watchdog reset\n",
+            node->address16);
+      nodeBoot(node);
+    }
+  }
+}
+
+/* Write the fleet page being gathered, if any */
+static void nodeFleetFlush(struct Node *node, long long time)
+{
+  if (node->fleetPage == 0)
+    return;
+  node->fleetPage = 0;
+  node->pagesWritten++;
+  if (node->flashUntil > time)
+    time = node->flashUntil;
+  node->busyUntil = time + flashWriteTime;
+}
+
+/*
+ * A FLEET_CHUNK or FLEET_QUERY packet, broadcast or addressed to this
+ * node.  Chunks are gathered a page at a time, and the page written
+ * when a chunk for another page arrives or the host asks what is
+ * missing.
+ */
+static void nodeFleet(struct Node *node, long long time,
+                      const unsigned char *payload, unsigned int length)
+{
+  const unsigned long chunks = part->flashSize / XBEEBOOT_FLEET_CHUNK;
+  const unsigned long chunk = payload[1] | payload[2] << 8;
+
+  if (payload[0] == XBEEBOOT_PACKET_TYPE_FLEET_CHUNK) {
+    if (length != 3 + XBEEBOOT_FLEET_CHUNK || chunk >= chunks)
+      return;
+
+    const unsigned long page =
+      chunk / (part->pageSize / XBEEBOOT_FLEET_CHUNK) + 1;
+    if (page != node->fleetPage) {
+      nodeFleetFlush(node, time);
+      node->fleetPage = page;
+    }
+
+    memcpy(&node->flash[chunk * XBEEBOOT_FLEET_CHUNK], &payload[3],
+           XBEEBOOT_FLEET_CHUNK);
+    node->fleetReceived[chunk / 8] |= 1 << (chunk % 8);
+    node->fleetChunks++;
+    statPayloadBytes += XBEEBOOT_FLEET_CHUNK;
+    return;
+  }
+
+  if (length != 5)
+    return;
+
+  unsigned long first = chunk;
+  unsigned long end = payload[3] | payload[4] << 8;
+  if (end > chunks)
+    end = chunks;
+
+  nodeFleetFlush(node, time);
+  if (node->busyUntil > time)
+    time = node->busyUntil;
+
+  while (first < end &&
+         (node->fleetReceived[first / 8] & (1 << (first % 8))))
+    first++;
+
+  unsigned char reply[3 + XBEEBOOT_FLEET_NACK];
+  reply[0] = XBEEBOOT_PACKET_TYPE_FLEET_NACK;
+  reply[1] = first & 0xff;
+  reply[2] = first >> 8;
+  memset(&reply[3], 0, XBEEBOOT_FLEET_NACK);
+
+  unsigned long missing;
+  for (missing = first;
+       missing < end && missing < first + 8 * XBEEBOOT_FLEET_NACK; missing++) {
+    if (!(node->fleetReceived[missing / 8] & (1 << (missing % 8))))
+      reply[3 + (missing - first) / 8] |= 1 << ((missing - first) % 8);
+  }
+
+  nodeTransmit(node, time, reply, sizeof(reply));
+}
+
+/* An XBeeBoot packet has reached the AVR */
+static void nodePacket(struct Node *node, long long time,
+                       const unsigned char *payload, unsigned int length)
+{
+  if (!node->running)
+    return;
+
+  if (node->busyUntil > time) {
+    if (windowModel || (rtsModel && node->rtsEnabled))
+      /*
+       * The UART ring catches it while the flash is written, or the
+       * XBee holds it while RTS is deasserted.
+       */
+      schedule(EV_NODE_PACKET, node->busyUntil, node, payload, length);
+    else
+      /* Nothing is reading the UART */
+      node->overruns++;
+    return;
+  }
+
+  node->packets++;
+
+  if (length == 2) {
+    const unsigned char sequence = payload[1];
+
+    if (node->awaitingAck == 0 || payload[0] != 0)
+      /* We can't receive ACK right now, drop it. */
+      return;
+
+    if (sequence == node->awaitingAck) {
+      nodeReplyAcked(node);
+      nodeRun(node, time);
+      return;
+    }
+
+    if (node->sawInvalid++)
+      /* Wrong ACK twice, resend the reply */
+      nodeSendReply(node, time, 1);
+    return;
+  }
+
+  if (fleetModel && (payload[0] == XBEEBOOT_PACKET_TYPE_FLEET_CHUNK ||
+                     payload[0] == XBEEBOOT_PACKET_TYPE_FLEET_QUERY)) {
+    if (node->awaitingAck == 0)
+      nodeFleet(node, time, payload, length);
+    return;
+  }
+
+  if (piggybackModel && length >= 4 &&
+      payload[0] == XBEEBOOT_PACKET_TYPE_DELIVER_ACK) {
+    /* DELIVER_ACK, the last byte ACKs the reply */
+    if (node->awaitingAck != 0 && payload[--length] == node->awaitingAck)
+      nodeReplyAcked(node);
+  } else if (length < 4 || payload[0] != 1) {
+    /* Not REQUEST */
+    return;
+  }
+
+  if (payload[2] != 23)
+    /* Not FIRMWARE_DELIVER */
+    return;
+
+  const unsigned char sequence = payload[1];
+  unsigned char nextSequence = node->lastIncomingSequence;
+  while ((++nextSequence & 0xff) == 0);
+
+  if (sequence != nextSequence) {
+    node->duplicates++;
+    if (node->sawInvalid++)
+      nodeSendAck(node, time, node->lastIncomingSequence);
+    /* It may still have ACK'd the reply */
+    nodeRun(node, time);
+    return;
+  }
+
+  const unsigned int dataLength = length - 3;
+  const unsigned int room = windowModel ?
+    queueSize - 1 - node->queueLength :
+    (node->queueLength == 0 ? XBEESIM_QUEUE_SIZE : 0);
+  if (room < dataLength) {
+    /* No room, drop it without an ACK */
+    node->overruns++;
+    nodeRun(node, time);
+    return;
+  }
+
+  memcpy(&node->queue[node->queueLength], &payload[3], dataLength);
+  node->queueLength += dataLength;
+  statPayloadBytes += dataLength;
+
+  if (node->piggyback && node->awaitingAck == 0)
+    node->pendingAck = nextSequence;
+  else
+    nodeSendAck(node, time, nextSequence);
+  node->lastIncomingSequence = nextSequence;
+
+  if (node->awaitingAck == 0)
+    node->sawInvalid = 0;
+
+  nodeRun(node, time);
+}
+
+/* A remote AT command has reached the remote XBee */
+static void nodeAT(struct Node *node,
+                   const unsigned char *command, unsigned int length)
+{
+  if (length >= 3 && command[0] == 'A' && command[1] == 'P') {
+    node->api1 = command[2] == 1;
+    return;
+  }
+
+  if (length >= 3 && command[0] == 'B' && command[1] == 'D' &&
+      command[2] < 8) {
+    node->serialBaud = bdRates[command[2]];
+    trace("node %u: XBee now at %ld baud\n", node->address16,
+          node->serialBaud);
+    return;
+  }
+
+  if (length >= 2 && command[0] == 'F' && command[1] == 'R') {
+    /* Back to the power-on settings, nothing having been written */
+    node->api1 = 0;
+    node->serialBaud = remoteBaud;
+    return;
+  }
+
+  if (length < 3 || command[0] != 'D' ||
+      command[1] < '0' || command[1] > '7')
+    return;
+
+  if (command[1] == '6') {
+    node->rtsEnabled = command[2] == 1;
+    return;
+  }
+
+  /*
+   * Driving the reset pin low holds the AVR in reset, releasing it
+   * starts XBeeBoot.
+   */
+  if (command[2] == 4) {
+    node->running = 0;
+    node->inReset = 1;
+    trace("node %u: reset asserted\n", node->address16);
+  } else if (command[2] == 5 && node->inReset) {
+    node->inReset = 0;
+    nodeBoot(node);
+    trace("node %u: XBeeBoot started\n", node->address16);
+  }
+}
+
+/*
+ * The AVR sends a payload to the host: over the serial link to its
+ * XBee, then across the mesh.
+ */
+static void nodeTransmit(struct Node *node, long long time,
+                         const unsigned char *payload, unsigned int length)
+{
+  if (node->txFreeAt > time)
+    time = node->txFreeAt;
+
+  /* 0x10 header, plus delimiter, length and checksum */
+  time += serialTime(node->serialBaud, length + 14 + 4 +
+                     (node->api1 ? 0 : escapes(payload, length)));
+  node->txFreeAt = time;
+
+  if (node->serialBaud != node->avrBaud) {
+    node->garbled++;
+    return;
+  }
+
+  if (airLost())
+    return;
+
+  time += airTime();
+
+  if (hops > 1) {
+    /* Route Record Indicator */
+    unsigned char record[2 * 25 + 13];
+    unsigned int out = 0;
+    record[out++] = 0xa1;
+    memcpy(&record[out], node->address64, 8);
+    out += 8;
+    record[out++] = node->address16 >> 8;
+    record[out++] = node->address16 & 0xff;
+    record[out++] = 0x01; /* Packet acknowledged */
+    record[out++] = hops - 1;
+    int hop;
+    for (hop = hops - 1; hop > 0; hop--) {
+      record[out++] = 0x10;
+      record[out++] = hop;
+    }
+    hostSend(time, record, out);
+  }
+
+  unsigned char frame[256];
+  frame[0] = 0x90;
+  memcpy(&frame[1], node->address64, 8);
+  frame[9] = node->address16 >> 8;
+  frame[10] = node->address16 & 0xff;
+  frame[11] = 0x01; /* Packet acknowledged */
+  memcpy(&frame[12], payload, length);
+  hostSend(time, frame, 12 + length);
+}
+
+/*
+ * Deliver a payload across the mesh, then over the serial link from
+ * the remote XBee to the AVR.  Returns non-zero if it was lost.
+ */
+static int nodeDeliver(struct Node *node, int type, long long time,
+                       const unsigned char *data, unsigned int length)
+{
+  if (airLost())
+    return 1;
+
+  time += airTime();
+
+  if (type == EV_NODE_PACKET) {
+    if (node->rxFreeAt > time)
+      time = node->rxFreeAt;
+
+    /* 0x90 header, plus delimiter, length and checksum */
+    time += serialTime(node->serialBaud, length + 12 + 4 +
+                       (node->api1 ? 0 : escapes(data, length)));
+    node->rxFreeAt = time;
+
+    if (node->serialBaud != node->avrBaud) {
+      /* Received, but XBeeBoot can't make sense of it */
+      node->garbled++;
+      if (node->fallbackBaud > 0) {
+        node->avrBaud = node->fallbackBaud;
+        node->fallbackBaud = 0;
+        trace("node %u: XBeeBoot back at %ld baud\n", node->address16,
+              node->avrBaud);
+      }
+      return 0;
+    }
+  }
+
+  schedule(type, time, node, data, length);
+  return 0;
+}
+
+static struct Node *findNode(const unsigned char *address64)
+{
+  int index;
+  for (index = 0; index < nodeCount; index++) {
+    if (memcmp(nodes[index].address64, address64, 8) == 0)
+      return &nodes[index];
+  }
+  return NULL;
+}
+
+static int isBroadcast(const unsigned char *address64)
+{
+  static const unsigned char broadcast[8] =
+    { 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+  return memcmp(address64, broadcast, 8) == 0;
+}
+
+static void localAT(const unsigned char *frame, unsigned int length,
+                    long long time)
+{
+  unsigned char reply[16];
+  unsigned int out = 0;
+
+  statLocalAT++;
+  if (length < 4 || frame[1] == 0)
+    return;
+
+  reply[out++] = 0x88;
+  reply[out++] = frame[1];
+  reply[out++] = frame[2];
+  reply[out++] = frame[3];
+  reply[out++] = 0; /* OK */
+
+  if (length == 4) {
+    /* Query */
+    if (frame[2] == 'A' && frame[3] == 'P') {
+      reply[out++] = apiMode;
+    } else if (frame[2] == 'N' && frame[3] == 'P') {
+      reply[out++] = maxPayload >> 8;
+      reply[out++] = maxPayload & 0xff;
+    } else if (frame[2] == 'B' && frame[3] == 'D') {
+      reply[out++] = bdSetting(baud);
+    } else if ((frame[2] == 'E' && frame[3] == 'E') ||
+               (frame[2] == 'T' && frame[3] == 'O')) {
+      /* No encryption */
+      reply[out++] = 0;
+    }
+  } else if (length == 5 && frame[2] == 'A' && frame[3] == 'P' &&
+             (frame[4] == 1 || frame[4] == 2)) {
+    /* The host sends in the new mode from here on */
+    apiMode = frame[4];
+  } else if (length == 5 && frame[2] == 'B' && frame[3] == 'D' &&
+             frame[4] < 8) {
+    /* Paced at the new rate after the reply, unless unlimited */
+    hostSend(time + XBEESIM_LOCAL_AT_US, reply, out);
+    if (baud > 0)
+      baud = bdRates[frame[4]];
+    return;
+  }
+
+  hostSend(time + XBEESIM_LOCAL_AT_US, reply, out);
+}
+
+static void remoteAT(const unsigned char *frame, unsigned int length,
+                     long long time)
+{
+  statRemoteAT++;
+  if (length < 15)
+    return;
+
+  struct Node *node = findNode(&frame[2]);
+
+  if (node != NULL && length >= 16 && frame[13] == 'D' && frame[15] == 5)
+    /* The host is restarting XBeeBoot, so its sequence restarts too */
+    node->hostSequence = 0;
+
+  unsigned char reply[16];
+  unsigned int out = 15;
+  reply[0] = 0x97;
+  reply[1] = frame[1];
+  memcpy(&reply[2], &frame[2], 8);
+  reply[10] = node != NULL ? node->address16 >> 8 : 0xff;
+  reply[11] = node != NULL ? node->address16 & 0xff : 0xfe;
+  reply[12] = frame[13];
+  reply[13] = frame[14];
+
+  long long replyTime = time + XBEESIM_REMOTE_AT_TIMEOUT_US;
+  reply[14] = 4; /* Transmission failure */
+
+  if (node != NULL &&
+      nodeDeliver(node, EV_NODE_AT, time, &frame[13], length - 13) == 0 &&
+      !airLost()) {
+    replyTime = time + airTime() + airTime();
+    reply[14] = 0; /* OK */
+
+    if (length == 15 && frame[13] == 'B' && frame[14] == 'D')
+      reply[out++] = bdSetting(node->serialBaud);
+  }
+
+  if (frame[1] != 0)
+    hostSend(replyTime, reply, out);
+}
+
+static void transmitRequest(const unsigned char *frame, unsigned int length,
+                            long long time)
+{
+  statTransmit++;
+  if (length < 14)
+    return;
+
+  const unsigned char *address64 = &frame[2];
+  const unsigned char *payload = &frame[14];
+  const unsigned int payloadLength = length - 14;
+
+  unsigned char status[7];
+  status[0] = 0x8b;
+  status[1] = frame[1];
+  status[2] = frame[10];
+  status[3] = frame[11];
+  status[4] = 0; /* Transmit retry count */
+  status[5] = 0; /* Success */
+  status[6] = 0; /* No discovery overhead */
+
+  long long statusTime = time + airTime() + airTime();
+
+  if (payloadLength >= 2 && payload[0] == XBEEBOOT_PACKET_TYPE_ACK) {
+    statHostAcks++;
+  } else if (payloadLength >= 2 &&
+             payload[0] == XBEEBOOT_PACKET_TYPE_REQUEST) {
+    struct Node *node = findNode(address64);
+    unsigned char nextSequence = node != NULL ? node->hostSequence : 0;
+    while ((++nextSequence & 0xff) == 0);
+    if (node == NULL || payload[1] == nextSequence) {
+      statHostRequests++;
+      if (node != NULL)
+        node->hostSequence = nextSequence;
+    } else {
+      statHostRetransmissions++;
+    }
+  }
+
+  if (payloadLength > maxPayload) {
+    statTooLarge++;
+    status[5] = 0x74; /* Data payload too large */
+    statusTime = time + XBEESIM_LOCAL_AT_US;
+  } else if (isBroadcast(address64)) {
+    int index;
+    for (index = 0; index < nodeCount; index++)
+      nodeDeliver(&nodes[index], EV_NODE_PACKET, time,
+                  payload, payloadLength);
+  } else {
+    struct Node *node = findNode(address64);
+    if (node == NULL ||
+        nodeDeliver(node, EV_NODE_PACKET, time, payload, payloadLength)) {
+      status[5] = 0x21; /* Network ACK failure */
+    } else {
+      status[2] = node->address16 >> 8;
+      status[3] = node->address16 & 0xff;
+    }
+  }
+
+  if (frame[1] != 0)
+    hostSend(statusTime, status, sizeof(status));
+}
+
+static void hostFrame(const unsigned char *frame, unsigned int length)
+{
+  long long time = now_us();
+
+  /* Account for the time the frame takes on the serial link */
+  if (hostRxFreeAt > time)
+    time = hostRxFreeAt;
+  time += serialTime(baud, length + 4 +
+                     (apiMode == 2 ? escapes(frame, length) : 0));
+  hostRxFreeAt = time;
+
+  if (firstHostFrame < 0)
+    firstHostFrame = time;
+  lastHostFrame = time;
+
+  trace("<- host frame type %02x length %u\n", frame[0], length);
+
+  switch (frame[0]) {
+  case 0x08:
+    localAT(frame, length, time);
+    break;
+  case 0x17:
+    remoteAT(frame, length, time);
+    break;
+  case 0x10:
+    transmitRequest(frame, length, time);
+    break;
+  case 0x21:
+    statSourceRoute++;
+    break;
+  default:
+    statUnknown++;
+    break;
+  }
+}
+
+/* Incremental parser for frames from the host */
+static void hostReceive(const unsigned char *data, size_t length)
+{
+  static int inFrame;
+  static int escaped;
+  static unsigned int index;
+  static unsigned int frameSize;
+  static unsigned char frame[2 + 256 + 1];
+
+  size_t offset;
+  for (offset = 0; offset < length; offset++) {
+    unsigned char byte = data[offset];
+
+    /* In API mode 1, 0x7e within a frame is data */
+    if (byte == 0x7e && (apiMode == 2 || !inFrame)) {
+      inFrame = 1;
+      escaped = 0;
+      index = 0;
+      frameSize = 2;
+      continue;
+    }
+
+    if (!inFrame)
+      continue;
+
+    if (escaped) {
+      byte ^= 0x20;
+      escaped = 0;
+    } else if (byte == 0x7d && apiMode == 2) {
+      escaped = 1;
+      continue;
+    }
+
+    frame[index++] = byte;
+
+    if (index == 2) {
+      /* Length plus the two length bytes, plus the checksum byte */
+      frameSize = (frame[0] << 8 | frame[1]) + 3;
+      if (frameSize > sizeof(frame) || frameSize < 4) {
+        inFrame = 0;
+        continue;
+      }
+    }
+
+    if (index < frameSize)
+      continue;
+
+    inFrame = 0;
+
+    unsigned char checksum = 0;
+    unsigned int cIndex;
+    for (cIndex = 2; cIndex < frameSize; cIndex++)
+      checksum += frame[cIndex];
+
+    if (checksum != 0xff) {
+      statBadChecksum++;
+      continue;
+    }
+
+    hostFrame(&frame[2], frameSize - 3);
+  }
+}
+
+static void runEvent(struct Event *event)
+{
+  switch (event->type) {
+  case EV_HOST_FRAME:
+    hostWrite(event->data, event->length);
+    if (event->time > lastHostFrame)
+      lastHostFrame = event->time;
+    break;
+  case EV_NODE_PACKET:
+    nodePacket(event->node, event->time, event->data, event->length);
+    break;
+  case EV_NODE_AT:
+    nodeAT(event->node, event->data, event->length);
+    break;
+  case EV_NODE_WAKE:
+    nodeRun(event->node, event->time);
+    break;
+  }
+}
+
+static void printAddress(const unsigned char *address64)
+{
+  int index;
+  for (index = 0; index < 8; index++)
+    fprintf(stderr, "%02X", (unsigned int)address64[index]);
+}
+
+static void printStatistics(void)
+{
+  const double elapsed = firstHostFrame < 0 ? 0 :
+    (lastHostFrame - firstHostFrame) / 1e6;
+
+  fprintf(stderr, "xbeesim: elapsed: %.6f\n", elapsed);
+  fprintf(stderr, "xbeesim: local AT requests: %lu\n", statLocalAT);
+  fprintf(stderr, "xbeesim: remote AT requests: %lu\n", statRemoteAT);
+  fprintf(stderr, "xbeesim: transmit requests: %lu\n", statTransmit);
+  fprintf(stderr, "xbeesim: data requests: %lu\n", statHostRequests);
+  fprintf(stderr, "xbeesim: data retransmissions: %lu\n",
+          statHostRetransmissions);
+  fprintf(stderr, "xbeesim: ACKs from host: %lu\n", statHostAcks);
+  fprintf(stderr, "xbeesim: STK500 commands: %lu\n", statCommands);
+  fprintf(stderr, "xbeesim: source route requests: %lu\n", statSourceRoute);
+  fprintf(stderr, "xbeesim: unknown frames: %lu\n", statUnknown);
+  fprintf(stderr, "xbeesim: bad checksums: %lu\n", statBadChecksum);
+  fprintf(stderr, "xbeesim: frames to host: %lu\n", statFramesSent);
+  fprintf(stderr, "xbeesim: radio packets: %lu\n", statRadioSent);
+  fprintf(stderr, "xbeesim: radio packets lost: %lu\n", statRadioLost);
+  fprintf(stderr, "xbeesim: payload too large: %lu\n", statTooLarge);
+  fprintf(stderr, "xbeesim: payload bytes delivered: %lu\n",
+          statPayloadBytes);
+  if (statEventOverflow)
+    fprintf(stderr, "xbeesim: events dropped: %lu\n", statEventOverflow);
+
+  int index;
+  for (index = 0; index < nodeCount; index++) {
+    const struct Node *node = &nodes[index];
+    fprintf(stderr, "xbeesim: node ");
+    printAddress(node->address64);
+    fprintf(stderr, ": packets %lu duplicates %lu overruns %lu acks %lu "
+            "replies %lu reply-retries %lu pages %lu erased %lu "
+            "fleet-chunks %lu boots %lu garbled %lu\n",
+            node->packets, node->duplicates, node->overruns, node->acks,
+            node->replies, node->replyRetries, node->pagesWritten,
+            node->pagesErased, node->fleetChunks, node->resets,
+            node->garbled);
+  }
+}
+
+static void onSignal(int signum)
+{
+  (void)signum;
+  stop = 1;
+}
+
+static int parseAddress(const char *text, unsigned char *address64)
+{
+  unsigned int index;
+  if (strlen(text) != 16)
+    return -1;
+
+  for (index = 0; index < 8; index++) {
+    unsigned int value;
+    if (sscanf(&text[index * 2], "%2x", &value) != 1)
+      return -1;
+    address64[index] = value;
+  }
+  return 0;
+}
+
+static struct Node *addNode(void)
+{
+  if (nodeCount >= XBEESIM_MAX_NODES) {
+    fprintf(stderr, "xbeesim: too many nodes\n");
+    exit(1);
+  }
+
+  struct Node *node = &nodes[nodeCount++];
+  memset(node, 0, sizeof(*node));
+  node->address16 = nodeCount;
+  return node;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: xbeesim [options]\n"
+          "  -a address  add a remote node with this 64-bit address (hex)\n"
+          "  -n count    add count remote nodes, 0013A20000000001 upwards\n"
+          "  -d part     AVR behind each node: m328p (default) or m1284p\n"
+          "  -W          model XBeeBoot built with XBEEBOOT_WINDOW\n"
+          "  -C          model XBeeBoot built with XBEEBOOT_CRC\n"
+          "  -Z          model XBeeBoot built with XBEEBOOT_COMPRESS\n"
+          "  -E          model XBeeBoot built with XBEEBOOT_ERASE\n"
+          "  -F          model XBeeBoot built with XBEEBOOT_FLEET\n"
+          "  -R          model XBeeBoot built with XBEEBOOT_RTS\n"
+          "  -P          model XBeeBoot built with XBEEBOOT_PIGGYBACK (with -W)\n"
+          "  -S pages    model XBeeBoot built with XBEEBOOT_STAGING (with -W)\n"
+          "  -B          model XBeeBoot built with XBEEBOOT_BAUD\n"
+          "  -l usec     one-way latency per radio hop (default 10000)\n"
+          "  -j usec     random jitter added per radio hop (default 0)\n"
+          "  -h hops     radio hops to each node (default 1)\n"
+          "  -p percent  loss per packet crossing the mesh (default 0)\n"
+          "  -u bytes    maximum RF payload (default 84)\n"
+          "  -b baud     serial baud rate, 0 for unlimited (default 115200)\n"
+          "  -r baud     remote XBee to AVR baud rate (default as -b)\n"
+          "  -w usec     flash page erase and write time (default 9000)\n"
+          "  -s seed     seed for loss and jitter (default 1)\n"
+          "  -L path     symlink path for the pseudo terminal\n"
+          "  -v          trace frames\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  const char *linkPath = NULL;
+  int generated = 0;
+  int option;
+
+  while ((option = getopt(argc, argv, "a:n:d:WCZEFRPS:Bl:j:h:p:u:b:r:w:s:L:v")) != -1) {
+    switch (option) {
+    case 'a':
+      if (parseAddress(optarg, addNode()->address64) < 0) {
+        fprintf(stderr, "xbeesim: bad address \"%s\"\n", optarg);
+        return 1;
+      }
+      break;
+    case 'n':
+      generated = atoi(optarg);
+      break;
+    case 'd':
+      {
+        size_t index;
+        part = NULL;
+        for (index = 0; index < sizeof(parts) / sizeof(parts[0]); index++) {
+          if (strcmp(parts[index].name, optarg) == 0)
+            part = &parts[index];
+        }
+        if (part == NULL) {
+          fprintf(stderr, "xbeesim: unknown part \"%s\"\n", optarg);
+          return 1;
+        }
+      }
+      break;
+    case 'W':
+      windowModel = 1;
+      break;
+    case 'C':
+      crcModel = 1;
+      break;
+    case 'Z':
+      compressModel = 1;
+      break;
+    case 'E':
+      eraseModel = 1;
+      break;
+    case 'F':
+      fleetModel = 1;
+      break;
+    case 'R':
+      rtsModel = 1;
+      break;
+    case 'P':
+      piggybackModel = 1;
+      break;
+    case 'S':
+      stagingPages = atoi(optarg);
+      break;
+    case 'B':
+      baudModel = 1;
+      break;
+    case 'l':
+      latency = atol(optarg);
+      break;
+    case 'j':
+      jitter = atol(optarg);
+      break;
+    case 'h':
+      hops = atoi(optarg);
+      if (hops < 1 || hops > 25) {
+        fprintf(stderr, "xbeesim: hops must be 1 to 25\n");
+        return 1;
+      }
+      break;
+    case 'p':
+      lossPpm = (unsigned long)(atof(optarg) * 10000);
+      break;
+    case 'u':
+      maxPayload = atoi(optarg);
+      break;
+    case 'b':
+      baud = atol(optarg);
+      break;
+    case 'r':
+      remoteBaud = atol(optarg);
+      break;
+    case 'w':
+      flashWriteTime = atol(optarg);
+      break;
+    case 's':
+      randomState = strtoul(optarg, NULL, 0);
+      if (randomState == 0)
+        /* xorshift never leaves zero */
+        randomState = 1;
+      break;
+    case 'L':
+      linkPath = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (optind != argc)
+    usage();
+
+  if (nodeCount == 0 && generated == 0)
+    generated = 1;
+
+  if (remoteBaud < 0)
+    remoteBaud = baud;
+
+  if (stagingPages > 0) {
+    queueSize = stagingPages * part->pageSize;
+    if ((stagingPages & (stagingPages - 1)) != 0 ||
+        queueSize > XBEESIM_MAX_QUEUE) {
+      fprintf(stderr, "xbeesim: bad staging page count %u\n",
+              stagingPages);
+      return 1;
+    }
+  }
+
+  int index;
+  for (index = 0; index < generated; index++) {
+    struct Node *node = addNode();
+    static const unsigned char prefix[4] = { 0x00, 0x13, 0xa2, 0x00 };
+    memcpy(node->address64, prefix, sizeof(prefix));
+    node->address64[7] = index + 1;
+  }
+
+  for (index = 0; index < nodeCount; index++) {
+    nodes[index].flash = malloc(part->flashSize);
+    if (nodes[index].flash == NULL) {
+      perror("xbeesim: malloc");
+      return 1;
+    }
+    memset(nodes[index].flash, 0xff, part->flashSize);
+    nodes[index].serialBaud = remoteBaud;
+    nodes[index].avrBaud = remoteBaud;
+    nodes[index].pendingBaud = -1;
+    nodes[index].fallbackBaud = 0;
+  }
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+    perror("xbeesim: posix_openpt");
+    return 1;
+  }
+
+  const char *slaveName = ptsname(master);
+
+  /*
+   * Hold the slave open so that the master doesn't see a hangup
+   * between host sessions, and make it raw until the host sets it up.
+   */
+  const int slave = open(slaveName, O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    perror("xbeesim: open slave");
+    return 1;
+  }
+
+  struct termios termios;
+  if (tcgetattr(slave, &termios) == 0) {
+    cfmakeraw(&termios);
+    tcsetattr(slave, TCSANOW, &termios);
+  }
+
+  if (linkPath != NULL) {
+    unlink(linkPath);
+    if (symlink(slaveName, linkPath) < 0) {
+      perror("xbeesim: symlink");
+      return 1;
+    }
+  }
+
+  printf("%s\n", slaveName);
+  fflush(stdout);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  startTime = now_us();
+
+  while (!stop) {
+    struct Event *event;
+    long long now = now_us();
+    while ((event = nextEvent()) != NULL && event->time <= now) {
+      /* Copy out, running the event may schedule more */
+      struct Event current = *event;
+      event->used = 0;
+      runEvent(&current);
+    }
+
+    struct timeval timeout;
+    struct timeval *timeoutp = NULL;
+    if (event != NULL) {
+      const long long wait = event->time - now;
+      timeout.tv_sec = wait / 1000000;
+      timeout.tv_usec = wait % 1000000;
+      timeoutp = &timeout;
+    }
+
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(master, &readfds);
+
+    const int rc = select(master + 1, &readfds, NULL, NULL, timeoutp);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("xbeesim: select");
+      break;
+    }
+
+    if (rc > 0 && FD_ISSET(master, &readfds)) {
+      unsigned char buffer[512];
+      const ssize_t length = read(master, buffer, sizeof(buffer));
+      if (length < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EIO)
+          continue;
+        perror("xbeesim: read");
+        break;
+      }
+      hostReceive(buffer, length);
+    }
+  }
+
+  printStatistics();
+
+  if (linkPath != NULL)
+    unlink(linkPath);
+  close(slave);
+  close(master);
+  return 0;
+}